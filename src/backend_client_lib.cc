@@ -1,5 +1,8 @@
 #include "backend_client_lib.h"
 
+#include <chrono>
+#include <iterator>
+#include <memory>
 #include <thread>
 
 #include <grpc/grpc.h>
@@ -7,6 +10,7 @@
 #include <grpcpp/client_context.h>
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
+#include <grpcpp/server_context.h>
 
 #include "grpc_client_lib.h"
 #include "key_value.grpc.pb.h"
@@ -14,37 +18,215 @@
 namespace {
 const char *kDefaultHostname = "localhost";
 const char *kDefaultPort = "50000";
+
+// The request the backend requests of this thread are bound to
+thread_local const grpc::ServerContextBase *bound_request = nullptr;
+
+// returns the context for a backend request, which inherits the deadline and
+// the cancellation of the request bound on this thread if there is one
+std::unique_ptr<grpc::ClientContext> NewClientContext() {
+  if (bound_request == nullptr) {
+    return std::unique_ptr<grpc::ClientContext>(new grpc::ClientContext());
+  }
+  return grpc::ClientContext::FromServerContext(*bound_request);
+}
 }  // Anonymous namespace
 
+// Start of `BackendRequestScope` definitions
+BackendRequestScope::BackendRequestScope(
+    const grpc::ServerContextBase *const context)
+    : previous_(bound_request) {
+  bound_request = context;
+}
+
+BackendRequestScope::~BackendRequestScope() { bound_request = previous_; }
+
+const grpc::ServerContextBase *BackendRequestScope::Current() {
+  return bound_request;
+}
+
+bool BackendRequestScope::IsDone() {
+  if (bound_request == nullptr) {
+    return false;
+  }
+  return bound_request->IsCancelled() ||
+         bound_request->deadline() <= std::chrono::system_clock::now();
+}
+// End of `BackendRequestScope` definitions
+
 // Start of `BackendClient` definitions
 BackendClient::BackendClient()
     : GrpcClient<chirp::KeyValueStore::Stub>(kDefaultHostname, kDefaultPort) {}
 
 BackendClient::BackendClient(const std::string &host)
     : GrpcClient<chirp::KeyValueStore::Stub>(host.c_str(), kDefaultPort) {}
+
+bool BackendClient::SendPutBatchRequest(
+    const std::vector<std::pair<std::string, std::string>> &key_values,
+    std::vector<bool> *const results) {
+  for (const auto &key_value : key_values) {
+    bool ok = SendPutRequest(key_value.first, key_value.second);
+    if (results != nullptr) {
+      results->push_back(ok);
+    }
+  }
+  return true;
+}
+
+bool BackendClient::SendCompareAndSwapRequest(const std::string &key,
+                                              const std::string &expected,
+                                              const std::string &value,
+                                              bool *const swapped,
+                                              std::string *const current) {
+  std::vector<std::string> reply;
+  if (!SendGetRequest(std::vector<std::string>(1, key), &reply) ||
+      reply.size() != 1) {
+    return false;
+  }
+
+  *swapped = reply[0] == expected;
+  if (*swapped && !SendPutRequest(key, value)) {
+    return false;
+  }
+  if (current != nullptr) {
+    *current = *swapped ? value : reply[0];
+  }
+  return true;
+}
 // End of `BackendClient` definitions
 
+// Start of `BackendWriteBatcher` definitions
+BackendWriteBatcher::BackendWriteBatcher(
+    BackendClient *const client, const std::chrono::microseconds &window,
+    const size_t &max_ops)
+    : client_(client),
+      window_(window),
+      max_ops_(max_ops),
+      pending_(),
+      stopping_(false) {
+  flusher_ = std::thread(&BackendWriteBatcher::FlushLoop, this);
+}
+
+BackendWriteBatcher::~BackendWriteBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  flusher_.join();
+}
+
+std::future<bool> BackendWriteBatcher::Put(const std::string &key,
+                                           const std::string &value) {
+  PendingPut put;
+  put.key = key;
+  put.value = value;
+  std::future<bool> ret = put.result.get_future();
+
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty()) {
+      batch_start_ = std::chrono::steady_clock::now();
+    }
+    pending_.push_back(std::move(put));
+    // wake up the flusher when a batch starts or when it is full
+    notify = pending_.size() == 1 || pending_.size() >= max_ops_;
+  }
+  if (notify) {
+    cv_.notify_all();
+  }
+
+  return ret;
+}
+
+void BackendWriteBatcher::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+    if (pending_.empty()) {
+      // stopping and nothing left to send
+      break;
+    }
+
+    // wait until the batch is full or its window has passed
+    cv_.wait_until(lock, batch_start_ + window_, [this]() {
+      return stopping_ || pending_.size() >= max_ops_;
+    });
+
+    std::vector<PendingPut> batch;
+    batch.swap(pending_);
+    lock.unlock();
+
+    std::vector<std::pair<std::string, std::string>> key_values;
+    key_values.reserve(batch.size());
+    for (const auto &put : batch) {
+      key_values.push_back(std::make_pair(put.key, put.value));
+    }
+
+    std::vector<bool> results;
+    bool ok = client_->SendPutBatchRequest(key_values, &results);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      batch[i].result.set_value(ok && i < results.size() && results[i]);
+    }
+
+    lock.lock();
+  }
+}
+// End of `BackendWriteBatcher` definitions
+
 // Start of `BackendClientStandard` definitions
 bool BackendClientStandard::SendPutRequest(const std::string &key,
                                            const std::string &value) {
-  grpc::ClientContext context;
+  if (write_batcher_ != nullptr) {
+    return write_batcher_->Put(key, value).get();
+  }
+
+  std::unique_ptr<grpc::ClientContext> context = NewClientContext();
 
   chirp::PutRequest request;
   request.set_key(key);
   request.set_value(value);
   chirp::PutReply reply;
 
-  grpc::Status status = stub_->put(&context, request, &reply);
+  grpc::Status status = stub_->put(context.get(), request, &reply);
 
   return status.ok();
 }
 
+bool BackendClientStandard::SendPutBatchRequest(
+    const std::vector<std::pair<std::string, std::string>> &key_values,
+    std::vector<bool> *const results) {
+  std::unique_ptr<grpc::ClientContext> context = NewClientContext();
+
+  chirp::PutBatchRequest request;
+  for (const auto &key_value : key_values) {
+    chirp::PutRequest *put = request.add_puts();
+    put->set_key(key_value.first);
+    put->set_value(key_value.second);
+  }
+  chirp::PutBatchReply reply;
+
+  grpc::Status status = stub_->putbatch(context.get(), request, &reply);
+  if (!status.ok()) {
+    return false;
+  }
+
+  if (results != nullptr) {
+    for (int i = 0; i < reply.ok_size(); ++i) {
+      results->push_back(reply.ok(i));
+    }
+  }
+  return true;
+}
+
 bool BackendClientStandard::SendGetRequest(
     const std::vector<std::string> &keys,
     std::vector<std::string> *reply_values) {
-  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientContext> context = NewClientContext();
   std::shared_ptr<grpc::ClientReaderWriter<chirp::GetRequest, chirp::GetReply>>
-      stream(stub_->get(&context));
+      stream(stub_->get(context.get()));
 
   // this lambda function takes `stream` and `keys` from this
   // `BackendClient::SendGetRequest` scope and takes them by reference.
@@ -71,19 +253,221 @@ bool BackendClientStandard::SendGetRequest(
   return status.ok();
 }
 
+bool BackendClientStandard::SendCompareAndSwapRequest(
+    const std::string &key, const std::string &expected,
+    const std::string &value, bool *const swapped,
+    std::string *const current) {
+  std::unique_ptr<grpc::ClientContext> context = NewClientContext();
+
+  chirp::CompareAndSwapRequest request;
+  request.set_key(key);
+  request.set_expected(expected);
+  request.set_value(value);
+  chirp::CompareAndSwapReply reply;
+
+  grpc::Status status = stub_->compareandswap(context.get(), request, &reply);
+  if (!status.ok()) {
+    return false;
+  }
+
+  *swapped = reply.swapped();
+  if (current != nullptr) {
+    *current = reply.current();
+  }
+  return true;
+}
+
 bool BackendClientStandard::SendDeleteKeyRequest(const std::string &key) {
-  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientContext> context = NewClientContext();
 
   chirp::DeleteRequest request;
   request.set_key(key);
   chirp::DeleteReply reply;
 
-  grpc::Status status = stub_->deletekey(&context, request, &reply);
+  grpc::Status status = stub_->deletekey(context.get(), request, &reply);
 
   return status.ok();
 }
+
+void BackendClientStandard::EnableWriteBatching(
+    const std::chrono::microseconds &window, const size_t &max_ops) {
+  write_batcher_.reset(new BackendWriteBatcher(this, window, max_ops));
+}
 // End of `BackendClientStandard` definitions
 
+// Start of `BackendClientSharedMemory` definitions
+BackendClientSharedMemory::BackendClientSharedMemory(
+    const std::string &shm_name)
+    : channel_(shm_name) {}
+
+bool BackendClientSharedMemory::SendPutRequest(const std::string &key,
+                                               const std::string &value) {
+  chirp::PutRequest request;
+  request.set_key(key);
+  request.set_value(value);
+
+  switch (channel_.Call(shared_memory_transport::PUT,
+                        request.SerializeAsString(), nullptr)) {
+    case shared_memory_transport::CALL_OK:
+      return true;
+    case shared_memory_transport::CALL_FAILED:
+      return false;
+    default:
+      return BackendClientStandard::SendPutRequest(key, value);
+  }
+}
+
+bool BackendClientSharedMemory::SendPutBatchRequest(
+    const std::vector<std::pair<std::string, std::string>> &key_values,
+    std::vector<bool> *const results) {
+  chirp::PutBatchRequest request;
+  for (const auto &key_value : key_values) {
+    chirp::PutRequest *put = request.add_puts();
+    put->set_key(key_value.first);
+    put->set_value(key_value.second);
+  }
+
+  std::string payload;
+  switch (channel_.Call(shared_memory_transport::PUT_BATCH,
+                        request.SerializeAsString(), &payload)) {
+    case shared_memory_transport::CALL_OK:
+      break;
+    case shared_memory_transport::CALL_FAILED:
+      return false;
+    default:
+      return BackendClientStandard::SendPutBatchRequest(key_values, results);
+  }
+
+  chirp::PutBatchReply reply;
+  if (!reply.ParseFromString(payload)) {
+    return false;
+  }
+  if (results != nullptr) {
+    for (int i = 0; i < reply.ok_size(); ++i) {
+      results->push_back(reply.ok(i));
+    }
+  }
+  return true;
+}
+
+bool BackendClientSharedMemory::SendGetRequest(
+    const std::vector<std::string> &keys,
+    std::vector<std::string> *reply_values) {
+  chirp::GetBatchRequest request;
+  for (const std::string &key : keys) {
+    request.add_keys(key);
+  }
+
+  std::string payload;
+  switch (channel_.Call(shared_memory_transport::GET_BATCH,
+                        request.SerializeAsString(), &payload)) {
+    case shared_memory_transport::CALL_OK:
+      break;
+    case shared_memory_transport::CALL_FAILED:
+      return false;
+    default:
+      return BackendClientStandard::SendGetRequest(keys, reply_values);
+  }
+
+  chirp::GetBatchReply reply;
+  if (!reply.ParseFromString(payload)) {
+    return false;
+  }
+  for (int i = 0; i < reply.values_size(); ++i) {
+    reply_values->push_back(reply.values(i));
+  }
+  return true;
+}
+
+bool BackendClientSharedMemory::SendCompareAndSwapRequest(
+    const std::string &key, const std::string &expected,
+    const std::string &value, bool *const swapped,
+    std::string *const current) {
+  chirp::CompareAndSwapRequest request;
+  request.set_key(key);
+  request.set_expected(expected);
+  request.set_value(value);
+
+  std::string payload;
+  switch (channel_.Call(shared_memory_transport::COMPARE_AND_SWAP,
+                        request.SerializeAsString(), &payload)) {
+    case shared_memory_transport::CALL_OK:
+      break;
+    case shared_memory_transport::CALL_FAILED:
+      return false;
+    default:
+      // The value has not been swapped if the reply is too large
+      return BackendClientStandard::SendCompareAndSwapRequest(
+          key, expected, value, swapped, current);
+  }
+
+  chirp::CompareAndSwapReply reply;
+  if (!reply.ParseFromString(payload)) {
+    return false;
+  }
+  *swapped = reply.swapped();
+  if (current != nullptr) {
+    // The current value is only replied when it is not `value`
+    *current = reply.swapped() ? value : reply.current();
+  }
+  return true;
+}
+
+bool BackendClientSharedMemory::SendDeleteKeyRequest(const std::string &key) {
+  chirp::DeleteRequest request;
+  request.set_key(key);
+
+  switch (channel_.Call(shared_memory_transport::DELETE_KEY,
+                        request.SerializeAsString(), nullptr)) {
+    case shared_memory_transport::CALL_OK:
+      return true;
+    case shared_memory_transport::CALL_FAILED:
+      return false;
+    default:
+      return BackendClientStandard::SendDeleteKeyRequest(key);
+  }
+}
+// End of `BackendClientSharedMemory` definitions
+
+// Start of `BackendClientEmbedded` definitions
+bool BackendClientEmbedded::SendPutRequest(const std::string &key,
+                                           const std::string &value) {
+  return backend_data_.Put(key, value);
+}
+
+bool BackendClientEmbedded::SendPutBatchRequest(
+    const std::vector<std::pair<std::string, std::string>> &key_values,
+    std::vector<bool> *const results) {
+  backend_data_.PutBatch(key_values, results);
+  return true;
+}
+
+bool BackendClientEmbedded::SendGetRequest(
+    const std::vector<std::string> &keys,
+    std::vector<std::string> *reply_values) {
+  std::vector<std::string> values;
+  backend_data_.GetBatch(keys, &values);
+  if (reply_values != nullptr) {
+    reply_values->insert(reply_values->end(),
+                         std::make_move_iterator(values.begin()),
+                         std::make_move_iterator(values.end()));
+  }
+  return true;
+}
+
+bool BackendClientEmbedded::SendCompareAndSwapRequest(
+    const std::string &key, const std::string &expected,
+    const std::string &value, bool *const swapped,
+    std::string *const current) {
+  *swapped = backend_data_.CompareAndSwap(key, expected, value, current);
+  return true;
+}
+
+bool BackendClientEmbedded::SendDeleteKeyRequest(const std::string &key) {
+  return backend_data_.DeleteKey(key);
+}
+// End of `BackendClientEmbedded` definitions
+
 // Start of `BackendClientDebug` definitions
 bool BackendClientDebug::SendPutRequest(const std::string &key,
                                         const std::string &value) {
@@ -1,15 +1,24 @@
 #ifndef CHIRP_SRC_BACKEND_CLIENT_LIB_H_
 #define CHIRP_SRC_BACKEND_CLIENT_LIB_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <grpcpp/channel.h>
+#include <grpcpp/server_context.h>
 
+#include "backend_data_structure.h"
 #include "grpc_client_lib.h"
 #include "key_value.grpc.pb.h"
+#include "shared_memory_transport.h"
 
 // This is an abstract class for backend clients.
 // Those who are going to inherit this should implement the three interfaces
@@ -24,12 +33,24 @@ class BackendClient : public GrpcClient<chirp::KeyValueStore::Stub> {
   // hostname is specified in the argument and port number will be "50000"
   BackendClient(const std::string &host);
 
+  virtual ~BackendClient() {}
+
   // Send a put request to the server
   // returns true if this operation succeeds
   // returns false otherwise
   virtual bool SendPutRequest(const std::string &key,
                               const std::string &value) = 0;
 
+  // Send a batch of put requests to the server
+  // The result of each put will be set to `results` in the same order if
+  // `results` is not nullptr.
+  // The default implementation sends the puts one by one.
+  // returns true if the batch has been sent
+  // returns false otherwise
+  virtual bool SendPutBatchRequest(
+      const std::vector<std::pair<std::string, std::string>> &key_values,
+      std::vector<bool> *const results);
+
   // Send a get request to the server
   // This member function will change the vector that `reply_values` points to.
   // It will not change anything if `reply_values` is nullptr
@@ -38,21 +59,180 @@ class BackendClient : public GrpcClient<chirp::KeyValueStore::Stub> {
   virtual bool SendGetRequest(const std::vector<std::string> &keys,
                               std::vector<std::string> *reply_values) = 0;
 
+  // Send a compare and swap request to the server
+  // This sets `key` to `value` only if the current value of `key` is
+  // `expected`. An empty `expected` matches a key that does not exist.
+  // Whether `key` has been set will be set to `swapped`, and the value of
+  // `key` after this operation will be set to `current` if `current` is not
+  // nullptr.
+  // The default implementation sends a get and then a put, which is not
+  // atomic against other clients. It is only meant for the clients that are
+  // not shared, e.g. the debug version.
+  // returns true if this operation succeeds
+  // returns false otherwise
+  virtual bool SendCompareAndSwapRequest(const std::string &key,
+                                         const std::string &expected,
+                                         const std::string &value,
+                                         bool *const swapped,
+                                         std::string *const current);
+
   // Send a delete key request to the server
   // returns true if this operation succeeds
   // returns false otherwise
   virtual bool SendDeleteKeyRequest(const std::string &key) = 0;
 };
 
+// This binds the backend requests sent from the constructing thread to the
+// request `context` being served while it lives, so that they carry its
+// deadline and are cancelled along with it, instead of running on after the
+// client has gone.
+// Scopes can be nested, and the innermost one applies. Only the requests
+// going through grpc are bound, i.e. not the ones of the debug and embedded
+// versions or the ones through shared memory.
+class BackendRequestScope {
+ public:
+  explicit BackendRequestScope(const grpc::ServerContextBase *const context);
+  ~BackendRequestScope();
+
+  // returns the request the backend requests of this thread are bound to
+  // returns nullptr if there is none
+  static const grpc::ServerContextBase *Current();
+
+  // returns true if the request bound on this thread has been cancelled or
+  // its deadline has passed, after which the backend requests fail
+  // returns false otherwise
+  static bool IsDone();
+
+ private:
+  const grpc::ServerContextBase *const previous_;
+};
+
+// This collects put requests from concurrent callers and sends them to the
+// backend together as one batched request.
+// A batch is sent once `max_ops` puts have been collected or `window` has
+// passed since the first put of the batch came in, whichever comes first.
+// A put alone still waits for the whole window, so this only pays off when
+// puts come in faster than one per window.
+class BackendWriteBatcher {
+ public:
+  // The batches will be sent through `client`, which should outlive this
+  BackendWriteBatcher(BackendClient *const client,
+                      const std::chrono::microseconds &window,
+                      const size_t &max_ops);
+
+  // Sends the puts still waiting and stops the flushing thread
+  ~BackendWriteBatcher();
+
+  // Queue a put to be sent with the next batch
+  // returns a future holding whether this put succeeds
+  std::future<bool> Put(const std::string &key, const std::string &value);
+
+ private:
+  // A put waiting to be sent and the promise of its result
+  struct PendingPut {
+    std::string key;
+    std::string value;
+    std::promise<bool> result;
+  };
+
+  // The flushing thread runs this to send the batches
+  void FlushLoop();
+
+  BackendClient *const client_;
+  const std::chrono::microseconds window_;
+  const size_t max_ops_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<PendingPut> pending_;
+  // When the first put of the pending batch came in
+  std::chrono::steady_clock::time_point batch_start_;
+  bool stopping_;
+
+  std::thread flusher_;
+};
+
 // This is the standard version of backend client
 // which will complete the requests through grpc
 class BackendClientStandard : public BackendClient {
  public:
   bool SendPutRequest(const std::string &key,
                       const std::string &value) override;
+  bool SendPutBatchRequest(
+      const std::vector<std::pair<std::string, std::string>> &key_values,
+      std::vector<bool> *const results) override;
   bool SendGetRequest(const std::vector<std::string> &keys,
                       std::vector<std::string> *reply_values) override;
+  bool SendCompareAndSwapRequest(const std::string &key,
+                                 const std::string &expected,
+                                 const std::string &value, bool *const swapped,
+                                 std::string *const current) override;
   bool SendDeleteKeyRequest(const std::string &key) override;
+
+  // Make `SendPutRequest` collect puts from concurrent callers and send them
+  // in batches, which is off by default.
+  // See `BackendWriteBatcher` for the meaning of `window` and `max_ops`.
+  void EnableWriteBatching(const std::chrono::microseconds &window,
+                           const size_t &max_ops);
+
+ private:
+  // This is nullptr if write batching is not enabled
+  std::unique_ptr<BackendWriteBatcher> write_batcher_;
+};
+
+// This is the shared memory version of backend client
+// which will complete the requests through the shared memory segment that a
+// `backend_server` on the same host creates. It falls back to grpc for the
+// requests that cannot go through the segment, e.g. when the segment is not
+// available or a request is too large for it.
+// It is safe to be used by multiple threads.
+class BackendClientSharedMemory : public BackendClientStandard {
+ public:
+  // `shm_name` is the name of the segment that the backend server creates
+  explicit BackendClientSharedMemory(const std::string &shm_name);
+
+  bool SendPutRequest(const std::string &key,
+                      const std::string &value) override;
+  bool SendPutBatchRequest(
+      const std::vector<std::pair<std::string, std::string>> &key_values,
+      std::vector<bool> *const results) override;
+  bool SendGetRequest(const std::vector<std::string> &keys,
+                      std::vector<std::string> *reply_values) override;
+  bool SendCompareAndSwapRequest(const std::string &key,
+                                 const std::string &expected,
+                                 const std::string &value, bool *const swapped,
+                                 std::string *const current) override;
+  bool SendDeleteKeyRequest(const std::string &key) override;
+
+ private:
+  SharedMemoryChannel channel_;
+};
+
+// This is the embedded version of backend client
+// which will complete the requests by calling the key-value store engine in
+// this process without going through grpc.
+// Unlike the debug version, it is safe to be used by multiple threads. It is
+// meant for the deployments where the service layer and the key-value store
+// share a host.
+class BackendClientEmbedded : public BackendClient {
+ public:
+  bool SendPutRequest(const std::string &key,
+                      const std::string &value) override;
+  bool SendPutBatchRequest(
+      const std::vector<std::pair<std::string, std::string>> &key_values,
+      std::vector<bool> *const results) override;
+  bool SendGetRequest(const std::vector<std::string> &keys,
+                      std::vector<std::string> *reply_values) override;
+  bool SendCompareAndSwapRequest(const std::string &key,
+                                 const std::string &expected,
+                                 const std::string &value, bool *const swapped,
+                                 std::string *const current) override;
+  bool SendDeleteKeyRequest(const std::string &key) override;
+
+ private:
+  // The same engine as `KeyValueStoreImpl` uses
+  ConcurrentBackendDataStructure backend_data_;
 };
 
 // This is the debug version of backend client
@@ -25,3 +25,65 @@ bool BackendDataStructure::DeleteKey(const std::string &key) {
   bool ok = key_value_map_.erase(key);
   return ok;
 }
+
+ConcurrentBackendDataStructure::ConcurrentBackendDataStructure()
+    : backend_data_(), lock_(ATOMIC_FLAG_INIT) {}
+
+bool ConcurrentBackendDataStructure::Put(const std::string &key,
+                                         const std::string &value) {
+  Lock();
+  bool ok = backend_data_.Put(key, value);
+  Unlock();
+  return ok;
+}
+
+void ConcurrentBackendDataStructure::PutBatch(
+    const std::vector<std::pair<std::string, std::string>> &key_values,
+    std::vector<bool> *const results) {
+  Lock();
+  for (const auto &key_value : key_values) {
+    bool ok = backend_data_.Put(key_value.first, key_value.second);
+    if (results != nullptr) {
+      results->push_back(ok);
+    }
+  }
+  Unlock();
+}
+
+void ConcurrentBackendDataStructure::GetBatch(
+    const std::vector<std::string> &keys,
+    std::vector<std::string> *const values) {
+  Lock();
+  for (const std::string &key : keys) {
+    std::string value;
+    if (!backend_data_.Get(key, &value)) {
+      value.clear();
+    }
+    values->push_back(std::move(value));
+  }
+  Unlock();
+}
+
+bool ConcurrentBackendDataStructure::CompareAndSwap(
+    const std::string &key, const std::string &expected,
+    const std::string &value, std::string *const current) {
+  Lock();
+  std::string now;
+  if (!backend_data_.Get(key, &now)) {
+    now.clear();
+  }
+  bool swapped = now == expected && backend_data_.Put(key, value);
+  Unlock();
+
+  if (current != nullptr) {
+    *current = swapped ? value : now;
+  }
+  return swapped;
+}
+
+bool ConcurrentBackendDataStructure::DeleteKey(const std::string &key) {
+  Lock();
+  bool ok = backend_data_.DeleteKey(key);
+  Unlock();
+  return ok;
+}
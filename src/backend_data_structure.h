@@ -1,8 +1,11 @@
 #ifndef CHIRP_SRC_BACKEND_DATA_STRUCTURE_H_
 #define CHIRP_SRC_BACKEND_DATA_STRUCTURE_H_
 
+#include <atomic>
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 // This is the backend data structure.
 // It stores the key-value mapping
@@ -32,4 +35,59 @@ class BackendDataStructure {
   std::map<std::string, std::string> key_value_map_;
 };
 
+// This is the backend data structure that can be shared by multiple threads.
+// Every operation holds a spinlock while it touches the data.
+// Batched operations hold the spinlock once for the whole batch, so a batch
+// is applied or read as a whole.
+class ConcurrentBackendDataStructure {
+ public:
+  ConcurrentBackendDataStructure();
+
+  // Put operation
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool Put(const std::string &key, const std::string &value);
+
+  // Put operation on a batch of key-value pairs
+  // The result of each put will be appended to `results` if `results` is not
+  // nullptr.
+  void PutBatch(
+      const std::vector<std::pair<std::string, std::string>> &key_values,
+      std::vector<bool> *const results);
+
+  // Get operation on a batch of keys
+  // The value of each key will be appended to `values`. Keys that are not
+  // found get an empty string.
+  void GetBatch(const std::vector<std::string> &keys,
+                std::vector<std::string> *const values);
+
+  // Compare and swap operation
+  // This sets `key` to `value` only if the current value of `key` is
+  // `expected`. An empty `expected` matches a key that does not exist.
+  // The value of `key` after this operation will be set to `current` if
+  // `current` is not nullptr.
+  // returns true if `key` has been set to `value`
+  // returns false otherwise
+  bool CompareAndSwap(const std::string &key, const std::string &expected,
+                      const std::string &value, std::string *const current);
+
+  // Delete key operation
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool DeleteKey(const std::string &key);
+
+ private:
+  // acquire and release the spinlock
+  inline void Lock() {
+    while (lock_.test_and_set(std::memory_order_acquire))
+      ;  // spin
+  }
+  inline void Unlock() { lock_.clear(std::memory_order_release); }
+
+  BackendDataStructure backend_data_;
+
+  // spinlock
+  std::atomic_flag lock_;
+};
+
 #endif /* CHIRP_SRC_BACKEND_DATA_STRUCTURE_H_ */
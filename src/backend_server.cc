@@ -3,6 +3,7 @@
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <grpc/grpc.h>
 #include <grpcpp/impl/codegen/status.h>
@@ -11,13 +12,21 @@
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
 
+#include <gflags/gflags.h>
+
 #include "backend_data_structure.h"
 #include "key_value.grpc.pb.h"
+#include "shared_memory_transport.h"
 
 #define DEFAULT_HOST_AND_PORT "0.0.0.0:50000"
 
-KeyValueStoreImpl::KeyValueStoreImpl()
-    : backend_data_(), lock_(ATOMIC_FLAG_INIT) {}
+DEFINE_string(shm_name, "/chirp_backend",
+              "The name of the shared memory segment that clients on this "
+              "host can send requests through. Empty disables it.");
+
+KeyValueStoreImpl::KeyValueStoreImpl(
+    ConcurrentBackendDataStructure *const backend_data)
+    : backend_data_(backend_data) {}
 
 grpc::Status KeyValueStoreImpl::put(grpc::ServerContext *context,
                                     const chirp::PutRequest *request,
@@ -27,12 +36,7 @@ grpc::Status KeyValueStoreImpl::put(grpc::ServerContext *context,
                         "`ServerContext` or `PutRequest` is nullptr.");
   }
 
-  // acquire lock
-  while (lock_.test_and_set(std::memory_order_acquire))
-    ;  // spin
-  bool ok = backend_data_.Put(request->key(), request->value());
-  // release lock
-  lock_.clear(std::memory_order_release);
+  bool ok = backend_data_->Put(request->key(), request->value());
 
   if (!ok) {
     return grpc::Status(grpc::UNKNOWN, "Unknown error happened.");
@@ -41,6 +45,30 @@ grpc::Status KeyValueStoreImpl::put(grpc::ServerContext *context,
   return grpc::Status::OK;
 }
 
+grpc::Status KeyValueStoreImpl::putbatch(grpc::ServerContext *context,
+                                         const chirp::PutBatchRequest *request,
+                                         chirp::PutBatchReply *reply) {
+  if (context == nullptr || request == nullptr || reply == nullptr) {
+    return grpc::Status(
+        grpc::FAILED_PRECONDITION,
+        "`ServerContext`, `PutBatchRequest`, or `reply` is nullptr.");
+  }
+
+  std::vector<std::pair<std::string, std::string>> key_values;
+  key_values.reserve(request->puts_size());
+  for (const chirp::PutRequest &put : request->puts()) {
+    key_values.push_back(std::make_pair(put.key(), put.value()));
+  }
+
+  std::vector<bool> results;
+  backend_data_->PutBatch(key_values, &results);
+  for (const bool ok : results) {
+    reply->add_ok(ok);
+  }
+
+  return grpc::Status::OK;
+}
+
 grpc::Status KeyValueStoreImpl::get(
     grpc::ServerContext *context,
     grpc::ServerReaderWriter<chirp::GetReply, chirp::GetRequest> *stream) {
@@ -49,26 +77,40 @@ grpc::Status KeyValueStoreImpl::get(
                         "`ServerContext` or `ServerReaderWriter` is nullptr.");
   }
 
+  // Collect all the keys first so that the lock is not held while waiting on
+  // the network
   chirp::GetRequest request;
-
-  // acquire lock
-  while (lock_.test_and_set(std::memory_order_acquire))
-    ;  // spin
+  std::vector<std::string> keys;
   while (stream->Read(&request)) {
-    chirp::GetReply reply;
-    std::string value;
+    keys.push_back(request.key());
+  }
 
-    bool ok = backend_data_.Get(request.key(), &value);
-    if (ok) {
-      reply.set_value(value);
-    } else {
-      reply.set_value(std::string());
-    }
+  // Keys that are not found get empty values
+  std::vector<std::string> values;
+  backend_data_->GetBatch(keys, &values);
 
+  for (const std::string &value : values) {
+    chirp::GetReply reply;
+    reply.set_value(value);
     stream->Write(reply);
   }
-  // release lock
-  lock_.clear(std::memory_order_release);
+
+  return grpc::Status::OK;
+}
+
+grpc::Status KeyValueStoreImpl::compareandswap(
+    grpc::ServerContext *context, const chirp::CompareAndSwapRequest *request,
+    chirp::CompareAndSwapReply *reply) {
+  if (context == nullptr || request == nullptr || reply == nullptr) {
+    return grpc::Status(
+        grpc::FAILED_PRECONDITION,
+        "`ServerContext`, `CompareAndSwapRequest`, or `reply` is nullptr.");
+  }
+
+  std::string current;
+  reply->set_swapped(backend_data_->CompareAndSwap(
+      request->key(), request->expected(), request->value(), &current));
+  reply->set_current(current);
 
   return grpc::Status::OK;
 }
@@ -81,12 +123,7 @@ grpc::Status KeyValueStoreImpl::deletekey(grpc::ServerContext *context,
                         "`ServerContext` or `PutRequest` is nullptr.");
   }
 
-  // acquire lock
-  while (lock_.test_and_set(std::memory_order_acquire))
-    ;  // spin
-  bool ok = backend_data_.DeleteKey(request->key());
-  // release lock
-  lock_.clear(std::memory_order_release);
+  bool ok = backend_data_->DeleteKey(request->key());
 
   if (!ok) {
     return grpc::Status(grpc::UNKNOWN, "Unknown error happened.", "");
@@ -97,7 +134,21 @@ grpc::Status KeyValueStoreImpl::deletekey(grpc::ServerContext *context,
 
 void run_server() {
   std::string server_address(DEFAULT_HOST_AND_PORT);
-  KeyValueStoreImpl service;
+  ConcurrentBackendDataStructure backend_data;
+  KeyValueStoreImpl service(&backend_data);
+
+  // Serve the same data through shared memory for clients on this host
+  std::unique_ptr<SharedMemoryListener> listener;
+  if (!FLAGS_shm_name.empty()) {
+    listener.reset(new SharedMemoryListener(FLAGS_shm_name, &backend_data));
+    if (listener->Start()) {
+      std::cout << "Server is listening on shared memory " << FLAGS_shm_name
+                << std::endl;
+    } else {
+      std::cout << "Failed to create shared memory " << FLAGS_shm_name
+                << std::endl;
+    }
+  }
 
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
@@ -108,6 +159,8 @@ void run_server() {
 }
 
 int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
   run_server();
 
   return 0;
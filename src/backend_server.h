@@ -1,7 +1,6 @@
 #ifndef CHIRP_SRC_BACKEND_SERVER_H_
 #define CHIRP_SRC_BACKEND_SERVER_H_
 
-#include <atomic>
 #include <map>
 #include <string>
 
@@ -15,32 +14,46 @@
 #include "key_value.grpc.pb.h"
 
 // Key-value store implementation inherits from the
-// `chirp::KeyValueStore::Service` which implements the `put`, `get`, and
-// `deletekey` operations
+// `chirp::KeyValueStore::Service` which implements the `put`, `putbatch`,
+// `get`, `compareandswap`, and `deletekey` operations
 class KeyValueStoreImpl final : public chirp::KeyValueStore::Service {
  public:
-  explicit KeyValueStoreImpl();
+  // The requests will be served on `backend_data`, which should outlive this
+  // and may be shared with a `SharedMemoryListener`
+  explicit KeyValueStoreImpl(
+      ConcurrentBackendDataStructure *const backend_data);
 
   // Accepts put requests
   grpc::Status put(grpc::ServerContext *context,
                    const chirp::PutRequest *request,
                    chirp::PutReply *reply) override;
 
+  // Accepts batched put requests
+  // The puts in a batch are applied in order as a whole
+  grpc::Status putbatch(grpc::ServerContext *context,
+                        const chirp::PutBatchRequest *request,
+                        chirp::PutBatchReply *reply) override;
+
   // Accepts get requests
+  // All the keys in the stream are read as a whole once the client finishes
+  // writing them
   grpc::Status get(grpc::ServerContext *context,
                    grpc::ServerReaderWriter<chirp::GetReply, chirp::GetRequest>
                        *stream) override;
 
+  // Accepts compareandswap requests
+  grpc::Status compareandswap(grpc::ServerContext *context,
+                              const chirp::CompareAndSwapRequest *request,
+                              chirp::CompareAndSwapReply *reply) override;
+
   // Accepts deletekey requests
   grpc::Status deletekey(grpc::ServerContext *context,
                          const chirp::DeleteRequest *request,
                          chirp::DeleteReply *reply) override;
 
  private:
-  BackendDataStructure backend_data_;
-
-  // spinlock
-  std::atomic_flag lock_;
+  // The data is guarded by the spinlock inside
+  ConcurrentBackendDataStructure *const backend_data_;
 };
 
 #endif /* CHIRP_SRC_BACKEND_SERVER_H_ */
@@ -0,0 +1,95 @@
+#include "chirp_id_codec.h"
+
+namespace {
+// The most bytes a 64-bit varint takes
+const int kMaxVarintBytes = 10;
+
+inline uint64_t ZigZagEncode(const uint64_t &delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+inline uint64_t ZigZagDecode(const uint64_t &value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+}  // Anonymous namespace
+
+// Start of `Reader` definitions
+chirp_id_codec::Reader::Reader(const std::string &input)
+    : next_(reinterpret_cast<const unsigned char *>(input.data())),
+      end_(next_ + input.size()),
+      last_id_(0),
+      malformed_(false) {}
+
+bool chirp_id_codec::Reader::Next(uint64_t *const id) {
+  if (next_ == end_ || malformed_) {
+    return false;
+  }
+
+  uint64_t value = 0;
+  for (int i = 0; i < kMaxVarintBytes; ++i) {
+    if (next_ == end_) {
+      break;
+    }
+    unsigned char byte = *next_++;
+    if (i == kMaxVarintBytes - 1 && byte > 1) {
+      // Only the top bit of 64 is left for the last byte
+      break;
+    }
+    value |= uint64_t(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      // Differences wrap around, so adding them recovers the ids in any order
+      last_id_ += ZigZagDecode(value);
+      *id = last_id_;
+      return true;
+    }
+  }
+
+  // The varint is cut off, too long or over 64 bits
+  malformed_ = true;
+  return false;
+}
+
+// Start of `Writer` definitions
+void chirp_id_codec::Writer::Append(const uint64_t &id) {
+  uint64_t value = ZigZagEncode(id - last_id_);
+  last_id_ = id;
+
+  char buffer[kMaxVarintBytes];
+  int size = 0;
+  while (value >= 0x80) {
+    buffer[size++] = char(value | 0x80);
+    value >>= 7;
+  }
+  buffer[size++] = char(value);
+  output_.append(buffer, size);
+}
+
+std::string chirp_id_codec::Writer::Release() {
+  std::string ret;
+  ret.swap(output_);
+  last_id_ = 0;
+  return ret;
+}
+
+void chirp_id_codec::Encode(const std::vector<uint64_t> &ids,
+                            std::string *const output) {
+  Writer writer;
+  for (const uint64_t &id : ids) {
+    writer.Append(id);
+  }
+  *output = writer.Release();
+}
+
+bool chirp_id_codec::Decode(const std::string &input,
+                            std::vector<uint64_t> *const ids) {
+  ids->clear();
+  // Every id takes at least one byte
+  ids->reserve(input.size());
+
+  Reader reader(input);
+  uint64_t id;
+  while (reader.Next(&id)) {
+    ids->push_back(id);
+  }
+  return reader.at_end();
+}
@@ -0,0 +1,67 @@
+#ifndef CHIRP_SRC_CHIRP_ID_CODEC_H_
+#define CHIRP_SRC_CHIRP_ID_CODEC_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// This encodes lists of chirp ids compactly.
+// Each id is stored as the difference from the previous id, zigzag-mapped so
+// that a smaller id costs as little as a larger one, in a little-endian base
+// 128 varint. Ids in a list are usually close to each other, so most of them
+// take one to three bytes instead of the eight of a raw id or the up to ten
+// of a protobuf varint. Lists in any order can be encoded, but sorted lists
+// encode the smallest.
+// The encoding of an empty list is an empty string.
+namespace chirp_id_codec {
+// Reads the ids of an encoded list one at a time without decoding the whole
+// list
+class Reader {
+ public:
+  // `input` should outlive this
+  explicit Reader(const std::string &input);
+
+  // Read the next id into `id`
+  // returns true if there is one
+  // returns false at the end of the list or if the list is malformed
+  bool Next(uint64_t *const id);
+
+  // returns true if the list has been read to its end without errors
+  inline bool at_end() const { return !malformed_ && next_ == end_; }
+
+ private:
+  const unsigned char *next_;
+  const unsigned char *const end_;
+  uint64_t last_id_;
+  bool malformed_;
+};
+
+// Encodes a list of ids one at a time
+class Writer {
+ public:
+  Writer() : last_id_(0) {}
+
+  // Append `id` to the end of the list
+  void Append(const uint64_t &id);
+
+  // returns the encoded list
+  inline const std::string &get_output() const { return output_; }
+
+  // Move the encoded list out, leaving this empty
+  std::string Release();
+
+ private:
+  std::string output_;
+  uint64_t last_id_;
+};
+
+// Encode `ids` into `output`
+void Encode(const std::vector<uint64_t> &ids, std::string *const output);
+
+// Decode `input` into `ids`
+// returns true if this operation succeeds
+// returns false if `input` is malformed
+bool Decode(const std::string &input, std::vector<uint64_t> *const ids);
+}  // namespace chirp_id_codec
+
+#endif /* CHIRP_SRC_CHIRP_ID_CODEC_H_ */
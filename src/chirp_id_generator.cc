@@ -0,0 +1,134 @@
+#include "chirp_id_generator.h"
+
+#include <chrono>
+
+#include <glog/logging.h>
+
+SnowflakeIdGenerator::SnowflakeIdGenerator(const uint32_t &worker_id)
+    : worker_id_(worker_id), last_timestamp_(0), sequence_(0) {
+  CHECK(worker_id <= kMaxWorkerId)
+      << "The worker id should not be greater than " << kMaxWorkerId << ".";
+}
+
+uint64_t SnowflakeIdGenerator::NextId() {
+  const uint64_t kMaxSequence = (1ULL << kSequenceBits) - 1;
+
+  uint64_t now = NowMilliseconds();
+  // Times before the epoch only happen with a broken clock
+  now = now > kEpochMilliseconds ? now - kEpochMilliseconds : 0;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (now > last_timestamp_) {
+    last_timestamp_ = now;
+    sequence_ = 0;
+  } else if (sequence_ < kMaxSequence) {
+    // Same millisecond, or the clock has gone backwards
+    ++sequence_;
+  } else {
+    // The sequence of this millisecond is used up
+    ++last_timestamp_;
+    sequence_ = 0;
+  }
+
+  // The id is never 0 because either the timestamp is positive or the worker
+  // id and the sequence are not both 0 after the first id
+  return (last_timestamp_ << (kWorkerIdBits + kSequenceBits)) |
+         (worker_id_ << kSequenceBits) | sequence_;
+}
+
+uint64_t SnowflakeIdGenerator::NowMilliseconds() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+BlockLeasedIdAllocator::BlockLeasedIdAllocator(const Leaser &lease,
+                                               const uint64_t &block_size,
+                                               const uint64_t &refill_threshold)
+    : lease_(lease),
+      block_size_(block_size),
+      refill_threshold_(refill_threshold),
+      next_(0),
+      end_(0),
+      next_block_(0),
+      refill_requested_(false),
+      stopping_(false),
+      lease_count_(0) {
+  CHECK(block_size > 0 && refill_threshold < block_size)
+      << "The refill threshold should be less than the block size.";
+  refiller_ = std::thread(&BlockLeasedIdAllocator::RefillLoop, this);
+}
+
+BlockLeasedIdAllocator::~BlockLeasedIdAllocator() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  refiller_.join();
+}
+
+uint64_t BlockLeasedIdAllocator::NextId() {
+  while (true) {
+    uint64_t end = end_.load();
+    uint64_t id = next_.fetch_add(1);
+    if (id < end) {
+      if (end - id - 1 == refill_threshold_) {
+        // Only the caller taking this exact id asks for the next block
+        std::lock_guard<std::mutex> lock(mutex_);
+        refill_requested_ = true;
+        cv_.notify_all();
+      }
+      return id;
+    }
+
+    // The block is used up, unless another caller has just switched it
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (next_.load() >= end_.load()) {
+      SwitchBlock(&lock);
+    }
+  }
+}
+
+void BlockLeasedIdAllocator::RefillLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || refill_requested_; });
+    if (stopping_) {
+      return;
+    }
+
+    if (next_block_ == 0) {
+      lock.unlock();
+      uint64_t first_id;
+      bool ok = lease_(block_size_, &first_id);
+      lock.lock();
+      if (ok) {
+        next_block_ = first_id;
+        ++lease_count_;
+      }
+    }
+    refill_requested_ = false;
+    cv_.notify_all();
+  }
+}
+
+void BlockLeasedIdAllocator::SwitchBlock(
+    std::unique_lock<std::mutex> *const lock) {
+  // Wait for the block being leased ahead of time
+  cv_.wait(*lock, [this]() { return !refill_requested_ || stopping_; });
+
+  uint64_t first_id = next_block_;
+  next_block_ = 0;
+  if (first_id == 0) {
+    // Nothing has been leased ahead of time, e.g. for the first block or
+    // after the leasing thread failed, so lease it here with the lock held
+    bool ok = lease_(block_size_, &first_id);
+    CHECK(ok) << "Leasing a block of chirp ids should be successful.";
+    ++lease_count_;
+  }
+
+  // See the comment on `next_` for the order
+  next_.store(first_id);
+  end_.store(first_id + block_size_);
+}
@@ -0,0 +1,124 @@
+#ifndef CHIRP_SRC_CHIRP_ID_GENERATOR_H_
+#define CHIRP_SRC_CHIRP_ID_GENERATOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// This is an abstract class for the generators of chirp ids.
+// Those who are going to inherit this should implement `NextId`, which should
+// be safe to be called by multiple threads.
+class ChirpIdGenerator {
+ public:
+  virtual ~ChirpIdGenerator() {}
+
+  // returns an id that has not been returned before
+  // The returned id is never 0, which means no chirp.
+  virtual uint64_t NextId() = 0;
+};
+
+// This generates Snowflake-style ids locally without touching the backend.
+// An id consists of, from the most significant bit,
+//   41 bits of milliseconds since `kEpochMilliseconds`,
+//   10 bits of the worker id, and
+//   12 bits of the sequence within the same millisecond.
+// Ids from the same worker are increasing and ids from different workers
+// never collide, so each service server should be given a distinct worker id.
+// Ids are roughly sorted by the time they are generated.
+class SnowflakeIdGenerator : public ChirpIdGenerator {
+ public:
+  // 2019-01-01T00:00:00Z
+  static const uint64_t kEpochMilliseconds = 1546300800000ULL;
+  static const int kWorkerIdBits = 10;
+  static const int kSequenceBits = 12;
+  static const uint32_t kMaxWorkerId = (1U << kWorkerIdBits) - 1;
+
+  // `worker_id` should not be greater than `kMaxWorkerId`
+  explicit SnowflakeIdGenerator(const uint32_t &worker_id);
+
+  // If the clock goes backwards, ids keep being generated from the latest
+  // time seen so that they stay unique and increasing. If more than 4096 ids
+  // are needed within one millisecond, the next millisecond is borrowed.
+  uint64_t NextId() override;
+
+ protected:
+  // returns the current time in milliseconds since the unix epoch
+  virtual uint64_t NowMilliseconds();
+
+ private:
+  const uint64_t worker_id_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  // The timestamp of the latest id, relative to `kEpochMilliseconds`
+  uint64_t last_timestamp_;
+  uint64_t sequence_;
+};
+
+// This hands out ids from blocks leased from a shared counter.
+// A whole block of ids is reserved from the counter in one atomic step and
+// the ids in it are handed out locally with an atomic increment. Once the
+// ids left in the current block drop to `refill_threshold`, the next block is
+// leased by a thread of its own so that callers rarely wait for the counter.
+// Ids are unique as long as every user of the counter leases from it
+// atomically, but they are only increasing within one allocator.
+class BlockLeasedIdAllocator : public ChirpIdGenerator {
+ public:
+  // The function that reserves `count` ids from the shared counter
+  // The first id of the reserved range will be set to `first_id`.
+  // returns true if this operation succeeds
+  // returns false otherwise
+  typedef std::function<bool(const uint64_t &count, uint64_t *const first_id)>
+      Leaser;
+
+  // `block_size` ids are leased through `lease` at a time
+  BlockLeasedIdAllocator(const Leaser &lease, const uint64_t &block_size,
+                         const uint64_t &refill_threshold);
+
+  // Stops the leasing thread
+  // The ids left in the leased blocks are never used.
+  ~BlockLeasedIdAllocator();
+
+  // This fails a CHECK if no block can be leased
+  uint64_t NextId() override;
+
+  // returns the number of blocks that have been leased
+  inline uint64_t get_lease_count() const { return lease_count_; }
+
+ private:
+  // The leasing thread runs this to lease the next block ahead of time
+  void RefillLoop();
+
+  // Move to the next block, leasing it here if the leasing thread has not
+  // leased it yet
+  // This should be called with `mutex_` held.
+  void SwitchBlock(std::unique_lock<std::mutex> *const lock);
+
+  const Leaser lease_;
+  const uint64_t block_size_;
+  const uint64_t refill_threshold_;
+
+  // The current block is [`next_`, `end_`).
+  // `next_` is updated before `end_` when switching blocks, and readers load
+  // `end_` before taking from `next_`. Since blocks are leased from an
+  // increasing counter, an id taken from a newer block than the `end_` loaded
+  // never passes the check against it.
+  std::atomic<uint64_t> next_;
+  std::atomic<uint64_t> end_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // The first id of the block leased ahead of time, 0 if there is none
+  uint64_t next_block_;
+  bool refill_requested_;
+  bool stopping_;
+  std::atomic<uint64_t> lease_count_;
+
+  std::thread refiller_;
+};
+
+#endif /* CHIRP_SRC_CHIRP_ID_GENERATOR_H_ */
@@ -11,8 +11,15 @@ DEFINE_string(chirp, "", "");
 DEFINE_uint64(reply, 0, "");
 DEFINE_string(follow, "", "");
 DEFINE_uint64(read, 0, "");
+DEFINE_uint32(max_depth, 0, "The deepest replies printed by --read, 0 for all");
+DEFINE_uint32(page_size, 0,
+              "The number of chirps read at a time by --read, 0 to stream "
+              "the thread");
 DEFINE_bool(monitor, false, "");
 DEFINE_string(stream, "", "--stream tag to stream chirps with tag");
+DEFINE_uint32(trending, 0, "--trending count to list the hottest tags");
+DEFINE_string(search, "", "--search words to find the chirps with them");
+DEFINE_uint32(max_results, 20, "The most chirps found by --search");
 
 int main(int argc, char **argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
@@ -20,7 +27,10 @@ int main(int argc, char **argv) {
   command_tool::usage =
       std::string("Usage: ") + argv[0] +
       " --register <username> --user <username> --chirp <chirp text> --reply "
-      "<reply chirp id> --follow <username> --read <chirp id> --monitor\n";
+      "<reply chirp id> --follow <username> --read <chirp id> --max_depth "
+      "<depth> --page_size <count> --monitor "
+      "--stream <tag> --trending <count> --search <words> --max_results "
+      "<count>\n";
 
   // Count the number of operations specifies
   size_t op_cnt = 0;
@@ -30,6 +40,8 @@ int main(int argc, char **argv) {
   op_cnt += (FLAGS_read > 0);
   op_cnt += (FLAGS_monitor);
   op_cnt += (!FLAGS_stream.empty());
+  op_cnt += (FLAGS_trending > 0);
+  op_cnt += (!FLAGS_search.empty());
   if (op_cnt > 1) {
     std::cout << command_tool::usage;
     return ServiceClient::INVALID_ARGUMENT;
@@ -42,11 +54,15 @@ int main(int argc, char **argv) {
   } else if (!FLAGS_follow.empty()) {
     return command_tool::Follow(FLAGS_user, FLAGS_follow);
   } else if (FLAGS_read > 0) {
-    return command_tool::Read(FLAGS_read);
+    return command_tool::Read(FLAGS_read, FLAGS_max_depth, FLAGS_page_size);
   } else if (FLAGS_monitor) {
     return command_tool::Monitor(FLAGS_user);
   } else if (!FLAGS_stream.empty()) {
     return command_tool::Stream(FLAGS_stream);
+  } else if (FLAGS_trending > 0) {
+    return command_tool::Trending(FLAGS_trending);
+  } else if (!FLAGS_search.empty()) {
+    return command_tool::Search(FLAGS_search, FLAGS_max_results);
   }
 
   std::cout << command_tool::usage;
@@ -6,7 +6,6 @@
 #include <iostream>
 #include <stack>
 #include <string>
-#include <thread>
 #include <vector>
 
 #include "service_client_lib.h"
@@ -87,23 +86,75 @@ ServiceClient::ReturnCodes command_tool::Follow(const std::string &username,
   return ret;
 }
 
-ServiceClient::ReturnCodes command_tool::Read(const uint64_t &chirp_id) {
+ServiceClient::ReturnCodes command_tool::Read(const uint64_t &chirp_id,
+                                              const uint32_t &max_depth,
+                                              const uint32_t &page_size) {
   std::cout << "Read a chirp with id " << chirp_id << ": ";
 
+  if (page_size == 0) {
+    // The status is known only at the end of the stream, so the first chirp
+    // tells the read has succeeded
+    bool printed = false;
+    // ServiceClient::ReturnCodes
+    auto ret = service_client.SendReadStreamRequest(
+        chirp_id, max_depth,
+        [&printed](const struct ServiceClient::Chirp &chirp,
+                   const uint32_t &depth) {
+          if (!printed) {
+            std::cout << service_client.ErrorMsgs[ServiceClient::OK]
+                      << "\n\n--------------------------\n";
+            printed = true;
+          }
+          PrintThreadChirp(chirp, depth);
+          return true;
+        });
+    if (!printed || ret != ServiceClient::OK) {
+      std::cout << service_client.ErrorMsgs[ret] << "\n";
+    }
+    return ret;
+  }
+
   std::vector<struct ServiceClient::Chirp> chirps;
+  std::string cursor;
   // ServiceClient::ReturnCodes
-  auto ret = service_client.SendReadRequest(chirp_id, &chirps);
+  auto ret = service_client.SendReadPageRequest(chirp_id, max_depth,
+                                                page_size, &cursor, &chirps);
   std::cout << service_client.ErrorMsgs[ret] << "\n";
+  if (ret != ServiceClient::OK) {
+    return ret;
+  }
 
-  if (ret == ServiceClient::OK) {
-    std::cout << "\n";
-    PrintChirps(chirps);
+  // Print each page before reading the next one, so that only a page is
+  // held at a time
+  std::cout << "\n";
+  std::stack<uint64_t> dfs;
+  PrintChirps(chirps, &dfs);
+  while (!cursor.empty()) {
+    chirps.clear();
+    ret = service_client.SendReadPageRequest(chirp_id, max_depth, page_size,
+                                             &cursor, &chirps);
+    if (ret != ServiceClient::OK) {
+      std::cout << service_client.ErrorMsgs[ret] << "\n";
+      return ret;
+    }
+    PrintChirps(chirps, &dfs);
   }
 
   return ret;
 }
 
-const uint64_t kPollingInterval = 100;
+namespace {
+// Print a chirp of a monitor or stream and the chirps skipped before it
+bool PrintStreamChirp(const struct ServiceClient::Chirp &chirp,
+                      const uint64_t &num_of_dropped) {
+  if (num_of_dropped > 0) {
+    std::cout << "(" << num_of_dropped << " chirps skipped)\n";
+  }
+  command_tool::PrintSingleChirp(chirp, 0);
+  return true;
+}
+}  // Anonymous namespace
+
 ServiceClient::ReturnCodes command_tool::Monitor(const std::string &username) {
   std::cout << "Monitored as " << username << ": ";
   if (username.empty()) {
@@ -114,31 +165,12 @@ ServiceClient::ReturnCodes command_tool::Monitor(const std::string &username) {
 
   std::cout << "\n";
 
-  std::vector<struct ServiceClient::Chirp> chirps;
-
-  std::thread print_chirps([&]() {
-    size_t last_size = 0;
-    size_t current_size;
-
-    while (1) {
-      current_size = chirps.size();
-
-      for (size_t i = last_size; i < current_size; ++i) {
-        PrintSingleChirp(chirps[i], 0);
-      }
-
-      last_size = current_size;
-      std::this_thread::sleep_for(std::chrono::milliseconds(kPollingInterval));
-    }
-  });
-
+  // Each chirp is printed as soon as it arrives, so nothing is held
   // Should never go to this line if everything works perfect
   // ServiceClient::ReturnCodes
-  auto ret = service_client.SendMonitorRequest(username, &chirps);
+  auto ret = service_client.SendMonitorRequest(username, PrintStreamChirp);
   std::cout << service_client.ErrorMsgs[ret] << "\n";
 
-  print_chirps.join();
-
   return ret;
 }
 
@@ -147,31 +179,68 @@ ServiceClient::ReturnCodes command_tool::Stream(const std::string &tag) {
     std::cout << "Cannot stream empty tag.\n";
     return ServiceClient::INVALID_ARGUMENT;
   }
+  // More than one term makes a query, e.g. "#a OR #b"
+  bool is_query = tag.find(' ') != std::string::npos;
   std::string parsed_tag = tag.substr(1); //strip off the initial '#'
-  std::cout << "Streaming #" << parsed_tag << std::endl;
-  std::vector<struct ServiceClient::Chirp> chirps;
+  if (is_query) {
+    std::cout << "Streaming " << tag << std::endl;
+  } else {
+    std::cout << "Streaming #" << parsed_tag << std::endl;
+  }
 
-  std::thread print_chirps([&]() {
-    size_t last_size = 0;
-    size_t current_size;
+  // Each chirp is printed as soon as it arrives, so nothing is held
+  // Should never go to this line if everything works perfect
+  // ServiceClient::ReturnCodes
+  auto ret =
+      is_query ? service_client.SendStreamQueryRequest(tag, PrintStreamChirp)
+               : service_client.SendStreamRequest(parsed_tag, PrintStreamChirp);
+  std::cout << service_client.ErrorMsgs[ret] << "\n";
+  return ret;
+}
 
-    while (1) {
-      current_size = chirps.size();
+ServiceClient::ReturnCodes command_tool::Trending(const uint32_t &count) {
+  std::cout << "Trending tags: ";
 
-      for (size_t i = last_size; i < current_size; ++i) {
-        PrintSingleChirp(chirps[i], 0);
-      }
+  std::vector<std::pair<std::string, double>> tags;
+  // ServiceClient::ReturnCodes
+  auto ret = service_client.SendTrendingRequest(count, &tags);
+  std::cout << service_client.ErrorMsgs[ret] << "\n";
 
-      last_size = current_size;
-      std::this_thread::sleep_for(std::chrono::milliseconds(kPollingInterval));
+  if (ret == ServiceClient::OK) {
+    for (size_t i = 0; i < tags.size(); ++i) {
+      std::cout << i + 1 << ". #" << tags[i].first << " (" << std::fixed
+                << std::setprecision(1) << tags[i].second << ")\n";
     }
-  });
+  }
 
-  // Should never go to this line if everything works perfect
+  return ret;
+}
+
+ServiceClient::ReturnCodes command_tool::Search(const std::string &query,
+                                                const uint32_t &max_results) {
+  std::cout << "Searched " << query << ": ";
+
+  // A page may stop short of `max_results` before the last one, so keep
+  // asking for the rest
+  std::vector<struct ServiceClient::Chirp> chirps;
+  std::string cursor;
   // ServiceClient::ReturnCodes
-  auto ret = service_client.SendStreamRequest(parsed_tag, &chirps);
+  auto ret = ServiceClient::OK;
+  do {
+    ret = service_client.SendSearchRequest(query, max_results - chirps.size(),
+                                           &cursor, &chirps);
+  } while (ret == ServiceClient::OK && !cursor.empty() &&
+           chirps.size() < max_results);
   std::cout << service_client.ErrorMsgs[ret] << "\n";
-  print_chirps.join();
+
+  if (ret == ServiceClient::OK) {
+    std::cout << "\n";
+    for (const auto &chirp : chirps) {
+      PrintSingleChirp(chirp, 0);
+      std::cout << "--------------------------\n";
+    }
+  }
+
   return ret;
 }
 
@@ -238,18 +307,28 @@ void command_tool::PrintSingleChirp(const struct ServiceClient::Chirp &chirp,
   std::cout << prefix << chirp.text << '\n';
 }
 
+void command_tool::PrintThreadChirp(const struct ServiceClient::Chirp &chirp,
+                                    const unsigned &depth) {
+  PrintSingleChirp(chirp, depth);
+  std::cout << "--------------------------" << std::endl;
+}
+
 void command_tool::PrintChirps(
-    const std::vector<struct ServiceClient::Chirp> &chirps) {
-  std::stack<uint64_t> dfs;
+    const std::vector<struct ServiceClient::Chirp> &chirps,
+    std::stack<uint64_t> *const page_dfs) {
+  std::stack<uint64_t> local_dfs;
+  std::stack<uint64_t> &dfs = page_dfs != nullptr ? *page_dfs : local_dfs;
 
-  std::cout << "--------------------------\n";
+  // The separator above the first chirp of the thread
+  if (dfs.empty()) {
+    std::cout << "--------------------------\n";
+  }
   for (const auto &chirp : chirps) {
     while (!dfs.empty() && dfs.top() != chirp.parent_id) {
       dfs.pop();
     }
 
-    PrintSingleChirp(chirp, dfs.size());
-    std::cout << "--------------------------\n";
+    PrintThreadChirp(chirp, dfs.size());
 
     if (dfs.empty() || dfs.top() == chirp.parent_id) {
       dfs.push(chirp.id);
@@ -1,6 +1,7 @@
 #ifndef CHIRP_COMMAND_LINE_TOOL_H_
 #define CHIRP_COMMAND_LINE_TOOL_H_
 
+#include <stack>
 #include <string>
 #include <vector>
 
@@ -35,9 +36,14 @@ ServiceClient::ReturnCodes Follow(const std::string &username,
 
 // This executes read operation through grpc using the API in
 // `service_client_lib`
+// The thread is streamed and each chirp is printed as soon as it arrives,
+// or if `page_size` is not 0, it is read and printed `page_size` chirps at a
+// time. The replies deeper than `max_depth` are left out. 0 means no limit.
 // returns OK if succeeds
 // returns other error codes otherwise
-ServiceClient::ReturnCodes Read(const uint64_t &chirp_id);
+ServiceClient::ReturnCodes Read(const uint64_t &chirp_id,
+                                const uint32_t &max_depth = 0,
+                                const uint32_t &page_size = 0);
 
 // This executes monitor operation through grpc using the API in
 // `service_client_lib`.
@@ -49,12 +55,27 @@ ServiceClient::ReturnCodes Monitor(const std::string &username);
 
 // This executes stream operation through grpc using the API in
 // `service_client_lib`.
-// The `tag` cannot be an empty string.
+// The `tag` cannot be an empty string. If it has more than one term, e.g.
+// "#a OR #b -#c", it is sent as a query on tags.
 // This function should never return except users press Ctrl+C in the console.
 // returns OK if succeeds
 // returns other error codes otherwise
 ServiceClient::ReturnCodes Stream(const std::string &tag);
 
+// This executes trending operation through grpc using the API in
+// `service_client_lib`, printing at most `count` tags used the most recently
+// returns OK if succeeds
+// returns other error codes otherwise
+ServiceClient::ReturnCodes Trending(const uint32_t &count);
+
+// This executes search operation through grpc using the API in
+// `service_client_lib`, printing at most `max_results` chirps containing
+// every word in `query`, newest first
+// returns OK if succeeds
+// returns other error codes otherwise
+ServiceClient::ReturnCodes Search(const std::string &query,
+                                  const uint32_t &max_results);
+
 // This is a helper function that helps print out time diff from the current
 // time to the specified chirp posting time.
 void PrintTimeDiff(const struct ServiceClient::Chirp &chirp);
@@ -65,10 +86,20 @@ void PrintTimeDiff(const struct ServiceClient::Chirp &chirp);
 void PrintSingleChirp(const struct ServiceClient::Chirp &chirp,
                       unsigned padding);
 
+// This is a helper function that helps print a chirp of a thread at `depth`
+// followed by a separator
+// used in `Read()` and `PrintChirps()`, so a thread can be printed one chirp
+// at a time as it arrives
+void PrintThreadChirp(const struct ServiceClient::Chirp &chirp,
+                      const unsigned &depth);
+
 // This is a helper function that helps print a series of chirps
 // This assumes the order of the input is ordered so that it can be easily
 // iterated in the DFS manner
-void PrintChirps(const std::vector<struct ServiceClient::Chirp> &chirps);
+// A page of a thread continues from the `dfs` stack left by the previous
+// page, if it is given.
+void PrintChirps(const std::vector<struct ServiceClient::Chirp> &chirps,
+                 std::stack<uint64_t> *const dfs = nullptr);
 
 // The `ServiceClient` object is declared here
 // defined in `command_line_tool.cc`
@@ -0,0 +1,243 @@
+#include "event_bus.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+#include <glog/logging.h>
+
+const size_t EventBus::kDefaultCapacity;
+
+namespace {
+// returns `topics` sorted without duplicates, which is the key of a group
+std::vector<std::string> GroupKeyOf(const std::vector<std::string> &topics) {
+  std::vector<std::string> key(topics);
+  std::sort(key.begin(), key.end());
+  key.erase(std::unique(key.begin(), key.end()), key.end());
+  return key;
+}
+}  // Anonymous namespace
+
+// Start of `Subscription` definitions
+EventBus::Subscription::Subscription(
+    EventBus *const bus, const std::vector<std::string> &topics,
+    const std::function<void()> &on_publish, const QueueLimit &limit)
+    : bus_(bus),
+      topics_(topics),
+      on_publish_(on_publish),
+      limit_(limit),
+      num_of_calls_(0),
+      num_of_dropped_since_poll_(0),
+      num_of_dropped_(0),
+      overflowed_(false) {
+  CHECK(limit.capacity > 0) << "A queue should hold at least one event.";
+}
+
+EventBus::Subscription::~Subscription() { bus_->Unsubscribe(this); }
+
+bool EventBus::Subscription::Wait(const std::chrono::milliseconds &timeout,
+                                  std::vector<Event> *const events) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!ready_.wait_for(lock, timeout, [this]() { return !events_.empty(); })) {
+    return false;
+  }
+  std::move(events_.begin(), events_.end(), std::back_inserter(*events));
+  events_.clear();
+  return true;
+}
+
+bool EventBus::Subscription::Poll(Event *const event,
+                                  uint64_t *const num_of_dropped) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (events_.empty()) {
+    return false;
+  }
+  *event = std::move(events_.front());
+  events_.pop_front();
+  if (num_of_dropped != nullptr) {
+    *num_of_dropped = num_of_dropped_since_poll_;
+  }
+  num_of_dropped_since_poll_ = 0;
+  return true;
+}
+
+size_t EventBus::Subscription::GetNumOfQueued() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return events_.size();
+}
+
+uint64_t EventBus::Subscription::GetNumOfDropped() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_of_dropped_;
+}
+
+bool EventBus::Subscription::IsOverflowed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return overflowed_;
+}
+
+void EventBus::Subscription::SetTopics(
+    const std::vector<std::string> &topics) {
+  std::vector<std::string> key = GroupKeyOf(topics);
+  // The subscription moves between the groups at once, so each chirp is
+  // published to it either by the old topics or by the new ones
+  std::lock_guard<std::mutex> lock(bus_->mutex_);
+  if (key == topics_) {
+    return;
+  }
+  bus_->LeaveGroup(this);
+  topics_ = std::move(key);
+  bus_->JoinGroup(this);
+}
+
+void EventBus::Subscription::Push(const Event &event) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (overflowed_) {
+    ++num_of_dropped_;
+    return;
+  }
+  if (events_.size() >= limit_.capacity) {
+    if (limit_.policy == DISCONNECT) {
+      num_of_dropped_ += events_.size() + 1;
+      events_.clear();
+      overflowed_ = true;
+      return;
+    }
+
+    auto dropped = events_.begin();
+    if (limit_.policy == COALESCE) {
+      // The latest chirp of the same user, if any, is the one replaced
+      for (auto it = events_.rbegin(); it != events_.rend(); ++it) {
+        if (it->chirp->username() == event.chirp->username()) {
+          dropped = std::next(it).base();
+          break;
+        }
+      }
+    }
+    events_.erase(dropped);
+    ++num_of_dropped_since_poll_;
+    ++num_of_dropped_;
+  }
+  events_.push_back(event);
+}
+
+// Start of `EventBus` definitions
+std::string EventBus::UserTopic(const std::string &username) {
+  return "user/" + username;
+}
+
+std::string EventBus::TagTopic(const std::string &tag) { return "tag/" + tag; }
+
+std::unique_ptr<EventBus::Subscription> EventBus::Subscribe(
+    const std::vector<std::string> &topics,
+    const std::function<void()> &on_publish, const QueueLimit &limit) {
+  std::unique_ptr<Subscription> ret(
+      new Subscription(this, GroupKeyOf(topics), on_publish, limit));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  JoinGroup(ret.get());
+  return ret;
+}
+
+void EventBus::Publish(const std::vector<std::string> &topics,
+                       const chirp::Chirp &chirp) {
+  std::shared_ptr<const chirp::Chirp> shared_chirp(new chirp::Chirp(chirp));
+
+  // The subscriptions to be called back, which are not destroyed until the
+  // calls return
+  std::vector<Subscription *> to_call;
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The topics each group is published to
+  std::map<Group *, std::vector<std::string>> matched;
+  for (const auto &topic : topics) {
+    auto it = topic_groups_.find(topic);
+    if (it == topic_groups_.end()) {
+      continue;
+    }
+    for (Group *group : it->second) {
+      auto &matched_topics = matched[group];
+      if (std::find(matched_topics.begin(), matched_topics.end(), topic) ==
+          matched_topics.end()) {
+        matched_topics.push_back(topic);
+      }
+    }
+  }
+
+  for (auto &it : matched) {
+    // One event is made for the whole group
+    std::shared_ptr<const std::vector<std::string>> matched_topics(
+        new std::vector<std::string>(std::move(it.second)));
+    Event event = {shared_chirp, matched_topics};
+    for (Subscription *subscription : it.first->members) {
+      subscription->Push(event);
+      subscription->ready_.notify_one();
+      if (subscription->on_publish_) {
+        ++subscription->num_of_calls_;
+        to_call.push_back(subscription);
+      }
+    }
+  }
+  if (to_call.empty()) {
+    return;
+  }
+
+  // The subscribers start their writes without holding up the others
+  lock.unlock();
+  for (Subscription *subscription : to_call) {
+    subscription->on_publish_();
+  }
+  lock.lock();
+  for (Subscription *subscription : to_call) {
+    --subscription->num_of_calls_;
+  }
+  lock.unlock();
+  calls_done_.notify_all();
+}
+
+size_t EventBus::GetNumOfGroups() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return groups_.size();
+}
+
+void EventBus::Unsubscribe(Subscription *const subscription) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  LeaveGroup(subscription);
+  calls_done_.wait(lock, [subscription]() {
+    return subscription->num_of_calls_ == 0;
+  });
+}
+
+void EventBus::JoinGroup(Subscription *const subscription) {
+  std::unique_ptr<Group> &group = groups_[subscription->topics_];
+  if (group == nullptr) {
+    group.reset(new Group());
+    for (const auto &topic : subscription->topics_) {
+      topic_groups_[topic].push_back(group.get());
+    }
+  }
+  group->members.push_back(subscription);
+}
+
+void EventBus::LeaveGroup(Subscription *const subscription) {
+  auto it = groups_.find(subscription->topics_);
+  if (it == groups_.end()) {
+    return;
+  }
+  auto &members = it->second->members;
+  members.erase(std::remove(members.begin(), members.end(), subscription),
+                members.end());
+  if (!members.empty()) {
+    return;
+  }
+
+  // The last subscription of the group has gone
+  for (const auto &topic : it->first) {
+    auto &groups = topic_groups_[topic];
+    groups.erase(std::remove(groups.begin(), groups.end(), it->second.get()),
+                 groups.end());
+    if (groups.empty()) {
+      topic_groups_.erase(topic);
+    }
+  }
+  groups_.erase(it);
+}
@@ -0,0 +1,182 @@
+#ifndef CHIRP_SRC_EVENT_BUS_H_
+#define CHIRP_SRC_EVENT_BUS_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "service.pb.h"
+
+// This publishes the chirps posted through a service server to the streams
+// subscribed to them in the same process.
+// A chirp is published once to all of its topics, such as its user and its
+// tags. Each subscription has its own queue, which a subscriber either blocks
+// on or is called back for when a chirp is published to one of its topics,
+// so a chirp is delivered as soon as it is posted and an idle subscriber
+// costs nothing.
+// Subscriptions to the same topics share a group, which matches each chirp
+// published and makes its event once for all of them, so publishing costs
+// the distinct sets of topics subscribed to plus a push to each queue. A
+// group is torn down when its last subscription goes.
+// Every queue is bounded, so a subscriber reading slowly neither makes the
+// server buffer without limit nor blocks publishing. A full queue makes room
+// by its `OverflowPolicy`.
+// This is safe to be used by multiple threads.
+class EventBus {
+ public:
+  // A published chirp and the topics of a subscription it was published to
+  // Both are shared by all the subscriptions it is delivered to.
+  struct Event {
+    std::shared_ptr<const chirp::Chirp> chirp;
+    std::shared_ptr<const std::vector<std::string>> topics;
+  };
+
+  // What a full queue does with a new event
+  enum OverflowPolicy : int {
+    // Drop the oldest event queued
+    DROP_OLDEST = 0,
+    // Replace the event queued for a chirp of the same user, or drop the
+    // oldest if there is none, so that the latest chirp of each user is kept
+    COALESCE,
+    // Drop every event queued and stop queueing, so that the subscriber
+    // disconnects and resumes from the last event it has taken
+    DISCONNECT
+  };
+
+  // The default number of events a queue holds
+  static const size_t kDefaultCapacity = 1000;
+
+  // The bound of a queue and what happens beyond it
+  struct QueueLimit {
+    size_t capacity;
+    OverflowPolicy policy;
+  };
+
+  // The queue of the events published to some topics
+  // Destroying this unsubscribes from the topics.
+  class Subscription {
+   public:
+    ~Subscription();
+
+    // Wait at most `timeout` for events, and move the events queued into
+    // `events`, oldest first
+    // returns true if there are events
+    // returns false if `timeout` passes without any event
+    bool Wait(const std::chrono::milliseconds &timeout,
+              std::vector<Event> *const events);
+
+    // Move the oldest event queued into `event` without waiting
+    // The number of events dropped since the last poll will be set to
+    // `num_of_dropped` if it is not nullptr.
+    // returns true if there is one
+    bool Poll(Event *const event, uint64_t *const num_of_dropped = nullptr);
+
+    // returns the number of events queued, i.e. how far the subscriber is
+    // behind
+    size_t GetNumOfQueued();
+
+    // returns the number of events dropped in total
+    uint64_t GetNumOfDropped();
+
+    // returns true if the queue has overflowed with `DISCONNECT`, after
+    // which nothing is queued
+    bool IsOverflowed();
+
+    // Subscribe to `topics` instead, keeping the events queued
+    // No event published meanwhile is lost or queued twice.
+    void SetTopics(const std::vector<std::string> &topics);
+
+   private:
+    // Befriend with `EventBus` so that only it subscribes
+    friend class EventBus;
+    Subscription(EventBus *const bus, const std::vector<std::string> &topics,
+                 const std::function<void()> &on_publish,
+                 const QueueLimit &limit);
+
+    // Queue `event`, making room by `limit_` if the queue is full
+    void Push(const Event &event);
+
+    EventBus *const bus_;
+    // Sorted without duplicates, which is the key of its group
+    // This is guarded by the mutex of `bus_`.
+    std::vector<std::string> topics_;
+    const std::function<void()> on_publish_;
+    const QueueLimit limit_;
+    // The calls of `on_publish_` running, which the destructor waits for
+    // This is guarded by the mutex of `bus_`.
+    size_t num_of_calls_;
+
+    // This guards the members below
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Event> events_;
+    // The events dropped since the last poll, and in total
+    uint64_t num_of_dropped_since_poll_;
+    uint64_t num_of_dropped_;
+    bool overflowed_;
+  };
+
+  // returns the topic of the chirps posted by `username`
+  static std::string UserTopic(const std::string &username);
+  // returns the topic of the chirps with `tag`
+  static std::string TagTopic(const std::string &tag);
+
+  // Subscribe to `topics`
+  // `on_publish`, if given, is called on the publishing thread after an
+  // event is queued or the queue overflows, with the bus unlocked. It is
+  // never called once the subscription is destroyed, and it should neither
+  // block nor destroy the subscription.
+  // The queue holds at most `limit.capacity` events, which should be more
+  // than 0.
+  // The subscription should not outlive this.
+  // returns the subscription receiving the chirps published from now on
+  std::unique_ptr<Subscription> Subscribe(
+      const std::vector<std::string> &topics,
+      const std::function<void()> &on_publish = nullptr,
+      const QueueLimit &limit = QueueLimit{kDefaultCapacity, DROP_OLDEST});
+
+  // Publish `chirp` to `topics`
+  // A subscription to several of `topics` receives it once.
+  void Publish(const std::vector<std::string> &topics,
+               const chirp::Chirp &chirp);
+
+  // returns the number of distinct sets of topics subscribed to
+  size_t GetNumOfGroups();
+
+ private:
+  // The subscriptions to the same topics
+  struct Group {
+    std::vector<Subscription *> members;
+  };
+
+  // Remove `subscription` from its group, and the group if it is the last
+  void Unsubscribe(Subscription *const subscription);
+
+  // Add `subscription` to the group of its topics, making the group if it is
+  // the first
+  // This should be called with `mutex_` held.
+  void JoinGroup(Subscription *const subscription);
+
+  // Remove `subscription` from its group, and the group if it is the last
+  // This should be called with `mutex_` held.
+  void LeaveGroup(Subscription *const subscription);
+
+  // This guards the members below, and is held while events are queued so
+  // that a subscription is not destroyed while being published to
+  std::mutex mutex_;
+  // Notified when a call of `on_publish` returns
+  std::condition_variable calls_done_;
+  // The groups by their topics, and the groups subscribed to each topic
+  std::map<std::vector<std::string>, std::unique_ptr<Group>> groups_;
+  std::unordered_map<std::string, std::vector<Group *>> topic_groups_;
+};
+
+#endif /* CHIRP_SRC_EVENT_BUS_H_ */
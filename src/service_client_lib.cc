@@ -1,5 +1,6 @@
 #include "service_client_lib.h"
 
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <thread>
@@ -12,6 +13,12 @@
 namespace {
 const char *kDefaultHostname = "localhost";
 const char *kDefaultPort = "50002";
+
+// A broken monitor or stream is reconnected at most this many times in a row
+// without receiving any chirp, waiting up to twice as long for the server
+// each time
+const size_t kMaxReconnects = 5;
+const std::chrono::milliseconds kInitialReconnectWait(250);
 }  // Anonymous namespace
 
 ServiceClient::ServiceClient()
@@ -93,25 +100,61 @@ ServiceClient::ReturnCodes ServiceClient::SendReadRequest(
   return GrpcStatusToReturnCodes(status);
 }
 
-ServiceClient::ReturnCodes ServiceClient::SendMonitorRequest(
-    const std::string &username,
-    std::vector<ServiceClient::Chirp> *const chirps) {
+ServiceClient::ReturnCodes ServiceClient::SendReadPageRequest(
+    const uint64_t &chirp_id, const uint32_t &max_depth,
+    const uint32_t &max_chirps, std::string *const cursor,
+    std::vector<struct ServiceClient::Chirp> *const chirps) {
   grpc::ClientContext context;
 
-  chirp::MonitorRequest request;
-  request.set_username(username);
+  chirp::ReadRequest request;
+  request.set_chirp_id(Uint64ToBinary(chirp_id));
+  request.set_max_depth(max_depth);
+  request.set_max_chirps(max_chirps);
+  if (cursor != nullptr) {
+    request.set_cursor(*cursor);
+  }
 
-  std::unique_ptr<grpc::ClientReader<chirp::MonitorReply> > reader(
-      stub_->monitor(&context, request));
+  chirp::ReadReply reply;
 
-  std::cout << "Ctrl + C to terminate\n";
+  grpc::Status status = stub_->read(&context, request, &reply);
+
+  if (chirps != nullptr) {
+    for (const auto &grpc_chirp : reply.chirps()) {
+      struct ServiceClient::Chirp chirp;
+      GrpcChirpToClientChirp(grpc_chirp, &chirp);
+      chirps->push_back(std::move(chirp));
+    }
+  }
+  if (cursor != nullptr && status.ok()) {
+    *cursor = reply.next_cursor();
+  }
+
+  return GrpcStatusToReturnCodes(status);
+}
 
-  chirp::MonitorReply reply;
+ServiceClient::ReturnCodes ServiceClient::SendReadStreamRequest(
+    const uint64_t &chirp_id, const uint32_t &max_depth,
+    const std::function<bool(const Chirp &, const uint32_t &)> &on_chirp) {
+  grpc::ClientContext context;
+
+  chirp::ReadRequest request;
+  request.set_chirp_id(Uint64ToBinary(chirp_id));
+  request.set_max_depth(max_depth);
+
+  std::unique_ptr<grpc::ClientReader<chirp::ReadStreamReply> > reader(
+      stub_->readstream(&context, request));
+
+  chirp::ReadStreamReply reply;
   while (reader->Read(&reply)) {
     struct ServiceClient::Chirp client_chirp;
     GrpcChirpToClientChirp(reply.chirp(), &client_chirp);
-    if (chirps != nullptr) {
-      chirps->push_back(client_chirp);
+    if (!on_chirp(client_chirp, reply.depth())) {
+      context.TryCancel();
+      // Drain what is in flight so that `Finish` does not block
+      while (reader->Read(&reply)) {
+      }
+      reader->Finish();
+      return OK;
     }
   }
 
@@ -120,30 +163,193 @@ ServiceClient::ReturnCodes ServiceClient::SendMonitorRequest(
   return GrpcStatusToReturnCodes(status);
 }
 
-ServiceClient::ReturnCodes ServiceClient::SendStreamRequest(const std::string &tag,
-    std::vector<ServiceClient::Chirp> *const chirps) {
-  grpc::ClientContext context;
+ServiceClient::ReturnCodes ServiceClient::SendMonitorRequest(
+    const std::string &username, const OnStreamChirp &on_chirp,
+    std::string *const cursor) {
+  chirp::MonitorRequest request;
+  request.set_username(username);
+
+  std::cout << "Ctrl + C to terminate\n";
+
+  return ResumeChirpStream(
+      request,
+      [this](grpc::ClientContext *context,
+             const chirp::MonitorRequest &request) {
+        return stub_->monitor(context, request);
+      },
+      on_chirp, cursor);
+}
 
+ServiceClient::ReturnCodes ServiceClient::SendStreamRequest(
+    const std::string &tag, const OnStreamChirp &on_chirp,
+    std::string *const cursor) {
   chirp::StreamRequest request;
   request.set_tag(tag);
 
-  std::unique_ptr<grpc::ClientReader<chirp::StreamReply> > reader(
-      stub_->stream(&context, request));
+  std::cout << "Ctrl + C to terminate\n";
+
+  return ResumeChirpStream(
+      request,
+      [this](grpc::ClientContext *context,
+             const chirp::StreamRequest &request) {
+        return stub_->stream(context, request);
+      },
+      on_chirp, cursor);
+}
+
+ServiceClient::ReturnCodes ServiceClient::SendTrendingRequest(
+    const uint32_t &count,
+    std::vector<std::pair<std::string, double>> *const tags) {
+  grpc::ClientContext context;
+
+  chirp::TrendingRequest request;
+  request.set_count(count);
+
+  chirp::TrendingReply reply;
+
+  grpc::Status status = stub_->trending(&context, request, &reply);
+
+  if (tags != nullptr) {
+    for (const auto &tag : reply.tags()) {
+      tags->push_back(std::make_pair(tag.tag(), tag.score()));
+    }
+  }
+
+  return GrpcStatusToReturnCodes(status);
+}
+
+ServiceClient::ReturnCodes ServiceClient::SendStreamQueryRequest(
+    const std::string &query, const OnStreamChirp &on_chirp,
+    std::string *const cursor) {
+  chirp::StreamRequest request;
+  request.set_query(query);
 
   std::cout << "Ctrl + C to terminate\n";
 
-  chirp::StreamReply reply;
+  return ResumeChirpStream(
+      request,
+      [this](grpc::ClientContext *context,
+             const chirp::StreamRequest &request) {
+        return stub_->stream(context, request);
+      },
+      on_chirp, cursor);
+}
+
+ServiceClient::ReturnCodes ServiceClient::SendSearchRequest(
+    const std::string &query, const uint32_t &max_results,
+    std::string *const cursor,
+    std::vector<ServiceClient::Chirp> *const chirps) {
+  grpc::ClientContext context;
+
+  chirp::SearchRequest request;
+  request.set_query(query);
+  request.set_max_results(max_results);
+  if (cursor != nullptr) {
+    request.set_cursor(*cursor);
+  }
+
+  chirp::SearchReply reply;
+
+  grpc::Status status = stub_->search(&context, request, &reply);
+
+  if (chirps != nullptr) {
+    for (const auto &grpc_chirp : reply.chirps()) {
+      struct ServiceClient::Chirp client_chirp;
+      GrpcChirpToClientChirp(grpc_chirp, &client_chirp);
+      chirps->push_back(client_chirp);
+    }
+  }
+  if (cursor != nullptr && status.ok()) {
+    *cursor = reply.next_cursor();
+  }
+
+  return GrpcStatusToReturnCodes(status);
+}
+
+template <typename Request, typename Open>
+ServiceClient::ReturnCodes ServiceClient::ResumeChirpStream(
+    Request request, const Open &open, const OnStreamChirp &on_chirp,
+    std::string *const cursor) {
+  std::string resume_cursor = cursor != nullptr ? *cursor : "";
+  // A stream broken before its first chirp is reconnected from the time it
+  // was first opened, so that nothing posted meanwhile is missed
+  auto first_connected = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  bool reconnecting = false;
+  std::chrono::milliseconds wait = kInitialReconnectWait;
+  size_t num_of_failures = 0;
+  while (true) {
+    request.set_since(resume_cursor);
+    if (reconnecting && resume_cursor.empty()) {
+      request.mutable_since_time()->set_seconds(first_connected.count() /
+                                                1000000);
+      request.mutable_since_time()->set_useconds(first_connected.count() %
+                                                 1000000);
+    } else {
+      request.clear_since_time();
+    }
+    reconnecting = true;
+    grpc::ClientContext context;
+    auto reader = open(&context, request);
+
+    bool received = false;
+    // ServiceClient::ReturnCodes
+    auto ret = ReadChirpStream(&context, reader.get(), on_chirp, &received,
+                               &resume_cursor);
+    if (cursor != nullptr) {
+      *cursor = resume_cursor;
+    }
+    if (ret != SERVICE_LAYER_UNAVAILABLE && ret != STREAM_OVERFLOWED) {
+      return ret;
+    }
+
+    // Give up after a number of reconnections in a row with no chirp
+    if (received) {
+      num_of_failures = 0;
+      wait = kInitialReconnectWait;
+    }
+    if (++num_of_failures > kMaxReconnects) {
+      return ret;
+    }
+    // This returns as soon as the server is back
+    channel_->WaitForConnected(std::chrono::system_clock::now() + wait);
+    wait *= 2;
+  }
+}
+
+template <typename Reply>
+ServiceClient::ReturnCodes ServiceClient::ReadChirpStream(
+    grpc::ClientContext *const context,
+    grpc::ClientReader<Reply> *const reader, const OnStreamChirp &on_chirp,
+    bool *const received, std::string *const cursor) {
+  Reply reply;
   while (reader->Read(&reply)) {
+    *received = true;
+    *cursor = reply.cursor();
     struct ServiceClient::Chirp client_chirp;
     GrpcChirpToClientChirp(reply.chirp(), &client_chirp);
-    if (chirps != nullptr) {
-      chirps->push_back(client_chirp);
+    if (!on_chirp(client_chirp, reply.num_of_dropped())) {
+      context->TryCancel();
+      // Drain what is in flight so that `Finish` does not block
+      while (reader->Read(&reply)) {
+      }
+      reader->Finish();
+      return OK;
     }
   }
 
   grpc::Status status = reader->Finish();
 
-  return GrpcStatusToReturnCodes(status);
+  // ServiceClient::ReturnCodes
+  auto ret = GrpcStatusToReturnCodes(status);
+  if (ret == STREAM_OVERFLOWED) {
+    const auto &metadata = context->GetServerTrailingMetadata();
+    auto it = metadata.find("resume-cursor-bin");
+    if (it != metadata.end()) {
+      cursor->assign(it->second.data(), it->second.size());
+    }
+  }
+  return ret;
 }
 
 void ServiceClient::GrpcChirpToClientChirp(const chirp::Chirp &grpc_chirp,
@@ -190,6 +396,8 @@ ServiceClient::ReturnCodes ServiceClient::GrpcStatusToReturnCodes(
     return INTERNAL_BACKEND_ERROR;
   } else if (status.error_code() == grpc::UNAVAILABLE) {
     return SERVICE_LAYER_UNAVAILABLE;
+  } else if (status.error_code() == grpc::RESOURCE_EXHAUSTED) {
+    return STREAM_OVERFLOWED;
   } else {
     return UNKOWN_ERROR;
   }
@@ -1,8 +1,10 @@
 #ifndef CHIRP_SRC_SERVICE_CLIENT_LIB_H_
 #define CHIRP_SRC_SERVICE_CLIENT_LIB_H_
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <grpcpp/channel.h>
@@ -29,6 +31,7 @@ class ServiceClient : public GrpcClient<chirp::ServiceLayer::Stub> {
 
     INTERNAL_BACKEND_ERROR,
     SERVICE_LAYER_UNAVAILABLE,
+    STREAM_OVERFLOWED,
 
     UNKOWN_ERROR  // should always be the last
   };
@@ -44,6 +47,7 @@ class ServiceClient : public GrpcClient<chirp::ServiceLayer::Stub> {
       "User does not have the permission to do so.",   // PERMISSION_DENIED
       "Something goes wrong in the backend server.",   // INTERNAL_BACKEND_ERROR
       "Unable to communicate with service layer.",  // SERVICE_LAYER_UNAVAILABLE
+      "Disconnected for reading too slowly.",       // STREAM_OVERFLOWED
       "Unknown error."                              // UNKOWN_ERROR
   };
 
@@ -83,17 +87,90 @@ class ServiceClient : public GrpcClient<chirp::ServiceLayer::Stub> {
   ReturnCodes SendReadRequest(const uint64_t &chirp_id,
                               std::vector<struct Chirp> *const chirp);
 
-  // Send a monitor request to the server
+  // Send a read request to the server for a page of a thread
+  // The replies deeper than `max_depth` are left out, and at most
+  // `max_chirps` chirps will be appended to `chirps`. 0 means no limit.
+  // `cursor` is where to start from, or empty for the first page. It will be
+  // set to where the next page starts, or empty at the end of the thread.
   // returns OK if this operation succeeds
   // returns other error codes if this operation fails
+  ReturnCodes SendReadPageRequest(const uint64_t &chirp_id,
+                                  const uint32_t &max_depth,
+                                  const uint32_t &max_chirps,
+                                  std::string *const cursor,
+                                  std::vector<struct Chirp> *const chirps);
+
+  // Send a read request to the server and receive the thread as a stream
+  // `on_chirp` is called with each chirp and its depth as soon as it
+  // arrives, in the same order as `SendReadRequest`, so the thread is never
+  // held as a whole. It can return false to stop reading the thread.
+  // The replies deeper than `max_depth` are left out. 0 means no limit.
+  // returns OK if this operation succeeds or is stopped by `on_chirp`
+  // returns other error codes if this operation fails
+  ReturnCodes SendReadStreamRequest(
+      const uint64_t &chirp_id, const uint32_t &max_depth,
+      const std::function<bool(const Chirp &, const uint32_t &)> &on_chirp);
+
+  // Called with each chirp of a monitor or stream as soon as it arrives, and
+  // the number of chirps dropped before it because they were read too slowly
+  // It can return false to stop the stream.
+  typedef std::function<bool(const Chirp &, const uint64_t &)> OnStreamChirp;
+
+  // Send a monitor request to the server
+  // The chirps are passed to `on_chirp` instead of being collected, so that
+  // nothing is held however long the monitor runs.
+  // `cursor`, if given, is where to resume from, or empty to start from now.
+  // It will be set to where to resume after the last chirp received.
+  // A monitor broken by the network or for reading too slowly is reconnected
+  // from there, and the chirps posted meanwhile are received first.
+  // returns OK if this operation succeeds or is stopped by `on_chirp`
+  // returns STREAM_OVERFLOWED if the server keeps giving up on a slow reader
+  // returns other error codes if this operation fails
   ReturnCodes SendMonitorRequest(const std::string &username,
-                                 std::vector<Chirp> *const chirps);
+                                 const OnStreamChirp &on_chirp,
+                                 std::string *const cursor = nullptr);
 
   // Send a stream request to the server with the tag `tag`
-  // returns OK if this operation succeeds
+  // See `SendMonitorRequest` for `on_chirp` and `cursor`.
+  // returns OK if this operation succeeds or is stopped by `on_chirp`
+  // returns STREAM_OVERFLOWED if the server keeps giving up on a slow reader
   // returns other error codes if this operation fails
   ReturnCodes SendStreamRequest(const std::string &tag,
-                                 std::vector<Chirp> *const chirps);
+                                const OnStreamChirp &on_chirp,
+                                std::string *const cursor = nullptr);
+
+  // Send a trending request to the server for at most `count` tags
+  // The tags used the most recently and their decayed counts of uses will be
+  // set to `tags`, highest first.
+  // returns OK if this operation succeeds
+  // returns other error codes if this operation fails
+  ReturnCodes SendTrendingRequest(
+      const uint32_t &count,
+      std::vector<std::pair<std::string, double>> *const tags);
+
+  // Send a stream request to the server with a query on tags, such as
+  // "#a AND #b" or "#a OR #c -#d"
+  // See `SendMonitorRequest` for `on_chirp` and `cursor`.
+  // returns OK if this operation succeeds or is stopped by `on_chirp`
+  // returns INVALID_ARGUMENT if the query is not valid
+  // returns STREAM_OVERFLOWED if the server keeps giving up on a slow reader
+  // returns other error codes if this operation fails
+  ReturnCodes SendStreamQueryRequest(const std::string &query,
+                                     const OnStreamChirp &on_chirp,
+                                     std::string *const cursor = nullptr);
+
+  // Send a search request to the server for the chirps containing every
+  // word in `query`
+  // At most `max_results` chirps will be appended to `chirps`, newest first.
+  // `cursor` is where to start from, or empty for the first page. It will be
+  // set to where the next page starts, or empty if there are no more chirps.
+  // returns OK if this operation succeeds
+  // returns INVALID_ARGUMENT if the query has no words
+  // returns other error codes if this operation fails
+  ReturnCodes SendSearchRequest(const std::string &query,
+                                const uint32_t &max_results,
+                                std::string *const cursor,
+                                std::vector<Chirp> *const chirps);
 
   struct Chirp {
     struct Timestamp {
@@ -109,6 +186,25 @@ class ServiceClient : public GrpcClient<chirp::ServiceLayer::Stub> {
   };
 
  private:
+  // Open a monitor or stream with `open` for `request`, resuming after
+  // `cursor` if it is given, and reconnect it after the last chirp received,
+  // or from when it was first opened if none was, while it is broken by the
+  // network or for reading too slowly
+  template <typename Request, typename Open>
+  ReturnCodes ResumeChirpStream(Request request, const Open &open,
+                                const OnStreamChirp &on_chirp,
+                                std::string *const cursor);
+
+  // Read the chirps streamed by `reader` into `on_chirp` until the stream
+  // ends or `on_chirp` stops it
+  // `received` will be set to true if any chirp arrives, and `cursor` to
+  // where to resume after the last one.
+  template <typename Reply>
+  ReturnCodes ReadChirpStream(grpc::ClientContext *const context,
+                              grpc::ClientReader<Reply> *const reader,
+                              const OnStreamChirp &on_chirp,
+                              bool *const received, std::string *const cursor);
+
   // Translate grpc chirp to the chirp we define here
   void GrpcChirpToClientChirp(const chirp::Chirp &grpc_chirp,
                               struct Chirp *const client_chirp);
@@ -2,11 +2,20 @@
 
 #include <sys/time.h>
 #include <algorithm>
+#include <cctype>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <queue>
+#include <sstream>
+#include <unordered_set>
+#include <utility>
 
 #include <glog/logging.h>
 
 #include "backend_client_lib.h"
+#include "chirp_id_codec.h"
+#include "single_flight.h"
 #include "utility.h"
 
 ServiceDataStructure::User::User(const std::string &username) {
@@ -58,23 +67,403 @@ const std::string ServiceDataStructure::UserFollowingList::ExportBinary()
   return ret;
 }
 
-void ServiceDataStructure::UserChirpList::ImportBinary(
-    const std::string &input) {
-  // Temporary protobuf message to build this set
+namespace {
+// returns true if the chirp `chirp_id` posted at `time` is after `cursor` in
+// the (time, id) order
+bool IsAfter(const struct timeval &time, const uint64_t &chirp_id,
+             const ServiceDataStructure::ChirpIndex::Cursor &cursor) {
+  if (time != cursor.time) {
+    return cursor.time < time;
+  }
+  return cursor.chirp_id < chirp_id;
+}
+
+// returns the first position in [`first`, `last`) whose id is not less than
+// `id`
+// This gallops from `first` with doubling steps before the binary search, so
+// that a walk through a long list in small jumps costs the log of each jump
+// instead of the log of the whole list.
+std::vector<uint64_t>::const_iterator Gallop(
+    std::vector<uint64_t>::const_iterator first,
+    const std::vector<uint64_t>::const_iterator &last, const uint64_t &id) {
+  std::ptrdiff_t step = 1;
+  while (step < last - first && first[step] < id) {
+    first += step;
+    step *= 2;
+  }
+  return std::lower_bound(first, first + std::min(step, last - first), id);
+}
+
+// Keep the ids in `ids` that are in `other` if `keep_common` is true, or that
+// are not in `other` otherwise
+// Both lists should be sorted and `ids` should be the shorter one for speed.
+void FilterByGalloping(const std::vector<uint64_t> &other,
+                       const bool &keep_common,
+                       std::vector<uint64_t> *const ids) {
+  auto position = other.cbegin();
+  auto kept = ids->begin();
+  for (const uint64_t &id : *ids) {
+    position = Gallop(position, other.cend(), id);
+    bool common = position != other.cend() && *position == id;
+    if (common == keep_common) {
+      *kept++ = id;
+    }
+  }
+  ids->erase(kept, ids->end());
+}
+
+// The most time buckets of a tag read in one request
+const uint64_t kMaxBucketsPerRead = 60;
+
+// Set `entries` to the latest chirps with `tag` after `since` and posted
+// before `to`, in the (time, id) order
+// Only the time buckets of the last `ServiceDataStructure::kMaxBackfillSeconds`
+// before `to` are read, however far back `since` is. They are read newest
+// first, many in each request, until `max_length` chirps are found, and at
+// most the latest `max_length` chirps are kept.
+// returns true if this operation succeeds
+// returns false otherwise, including once the request bound on this thread
+// is done
+bool TaggedChirpsBetween(
+    const std::string &tag,
+    const ServiceDataStructure::ChirpIndex::Cursor &since,
+    const struct timeval &to, const size_t &max_length,
+    std::vector<ServiceDataStructure::ChirpIndex::Entry> *const entries) {
+  const time_t kBucketSeconds = ServiceDataStructure::kTagBucketSeconds;
+  time_t first_time =
+      std::max(since.time.tv_sec,
+               to.tv_sec - ServiceDataStructure::kMaxBackfillSeconds);
+  uint64_t first = std::max(first_time, time_t(0)) / kBucketSeconds;
+  uint64_t last = to.tv_sec / kBucketSeconds;
+
+  // The chirps found, newest first
+  std::vector<ServiceDataStructure::ChirpIndex::Entry> found;
+  while (first <= last && found.size() < max_length) {
+    // What is read for a request which is done would never be replied
+    if (BackendRequestScope::IsDone()) {
+      return false;
+    }
+    uint64_t read_first =
+        last - first >= kMaxBucketsPerRead ? last - kMaxBucketsPerRead + 1
+                                           : first;
+    std::vector<ServiceDataStructure::ChirpIndex> buckets;
+    if (!chirp_connect_backend::GetTagBuckets(tag, read_first, last,
+                                              &buckets)) {
+      return false;
+    }
+
+    for (auto bucket = buckets.rbegin(); bucket != buckets.rend(); ++bucket) {
+      std::vector<ServiceDataStructure::ChirpIndex::Entry> bucket_entries =
+          bucket->Since(since);
+      for (auto entry = bucket_entries.rbegin();
+           entry != bucket_entries.rend(); ++entry) {
+        if (entry->time < to) {
+          found.push_back(*entry);
+        }
+      }
+    }
+    if (read_first == first) {
+      break;
+    }
+    last = read_first - 1;
+  }
+
+  if (found.size() > max_length) {
+    found.resize(max_length);
+  }
+  entries->assign(found.rbegin(), found.rend());
+  return true;
+}
+
+// Set `chirp_ids` to the ids of the chirps with `tag` posted in
+// [`from`, `to`), sorted
+// Only the time buckets of the last `ServiceDataStructure::kMaxBackfillSeconds`
+// before `to` are read.
+// returns true if this operation succeeds
+// returns false otherwise
+bool TaggedChirpsBetween(const std::string &tag, const struct timeval &from,
+                         const struct timeval &to,
+                         std::vector<uint64_t> *const chirp_ids) {
+  std::vector<ServiceDataStructure::ChirpIndex::Entry> entries;
+  if (!TaggedChirpsBetween(tag,
+                           ServiceDataStructure::ChirpIndex::CursorAt(from),
+                           to, SIZE_MAX, &entries)) {
+    return false;
+  }
+  for (const auto &entry : entries) {
+    chirp_ids->push_back(entry.chirp_id);
+  }
+  std::sort(chirp_ids->begin(), chirp_ids->end());
+  return true;
+}
+
+// Keep the latest `ChirpIndex::kMaxLength` chirps of `entries`, which are in
+// the (time, id) order, and move `cursor` to the last one
+// returns the ids of the chirps kept, oldest first
+std::vector<uint64_t> TakeLatest(
+    std::vector<ServiceDataStructure::ChirpIndex::Entry> *const entries,
+    ServiceDataStructure::ChirpIndex::Cursor *const cursor) {
+  const size_t kMaxLength = ServiceDataStructure::ChirpIndex::kMaxLength;
+  if (entries->size() > kMaxLength) {
+    entries->erase(entries->begin(), entries->end() - kMaxLength);
+  }
+  if (!entries->empty()) {
+    *cursor = ServiceDataStructure::ChirpIndex::CursorOf(entries->back());
+  }
+
+  std::vector<uint64_t> ret;
+  for (const auto &entry : *entries) {
+    ret.push_back(entry.chirp_id);
+  }
+  return ret;
+}
+
+// Parse a serialized `ServiceData::UserChirpList` into `ids`, keeping the
+// order the ids are stored in
+// returns true if this operation succeeds
+// returns false otherwise
+bool ParseChirpIds(const std::string &input, std::vector<uint64_t> *const ids) {
   ServiceData::UserChirpList tmp;
+  if (!tmp.ParseFromString(input) ||
+      !chirp_id_codec::Decode(tmp.encoded_chirp_ids(), ids)) {
+    return false;
+  }
+  // Lists written before the codec
+  ids->insert(ids->end(), tmp.chirp_id().begin(), tmp.chirp_id().end());
+  return true;
+}
+
+// returns `ids` serialized as a `ServiceData::UserChirpList`
+std::string SerializeChirpIds(const std::vector<uint64_t> &ids) {
+  ServiceData::UserChirpList tmp;
+  chirp_id_codec::Encode(ids, tmp.mutable_encoded_chirp_ids());
+
+  std::string ret;
+  tmp.SerializeToString(&ret);
+  return ret;
+}
+
+// Put together the shape of the thread starting at `root_id` from the
+// children ids in its chirps, for the threads posted before their shapes
+// were stored
+// The chirps are read level by level, each level in one batch.
+// returns true if this operation succeeds
+bool BuildThreadFromChildren(const uint64_t &root_id,
+                             ServiceDataStructure::Thread *const shape) {
+  std::unordered_map<uint64_t, ServiceDataStructure::Chirp> chirps;
+  std::vector<uint64_t> level(1, root_id);
+  while (!level.empty()) {
+    std::map<uint64_t, ServiceDataStructure::Chirp> level_chirps;
+    if (!chirp_connect_backend::GetChirps(level, &level_chirps)) {
+      return false;
+    }
+    std::vector<uint64_t> next_level;
+    for (auto &it : level_chirps) {
+      for (const uint64_t &child_id : it.second.get_children_ids()) {
+        // A malformed thread should not be read forever
+        if (chirps.count(child_id) == 0 && level_chirps.count(child_id) == 0) {
+          next_level.push_back(child_id);
+        }
+      }
+      chirps[it.first] = std::move(it.second);
+    }
+    level.swap(next_level);
+  }
+
+  // Put the chirps in pre-order with a stack instead of recursion, so that a
+  // deep thread cannot overflow the call stack
+  std::vector<std::pair<uint64_t, uint32_t>> stack(1, {root_id, 0});
+  while (!stack.empty()) {
+    auto node = stack.back();
+    stack.pop_back();
+    auto it = chirps.find(node.first);
+    if (it == chirps.end()) {
+      // Deleted, or already put through a malformed thread
+      continue;
+    }
+    shape->Append({node.first, it->second.get_parent_id(), node.second, false});
+    const std::vector<uint64_t> &children_ids =
+        it->second.get_children_ids().get_ids();
+    for (auto child = children_ids.rbegin(); child != children_ids.rend();
+         ++child) {
+      stack.emplace_back(*child, node.second + 1);
+    }
+    chirps.erase(it);
+  }
+  return true;
+}
+
+// returns the id of the first chirp of the thread `chirp` is in
+// A chirp posted before the shapes of threads were stored has no root id,
+// which is found through its parents.
+uint64_t RootIdOf(const ServiceDataStructure::Chirp &chirp) {
+  if (chirp.get_root_id() > 0) {
+    return chirp.get_root_id();
+  }
+  ServiceDataStructure::Chirp current = chirp;
+  ServiceDataStructure::Chirp parent;
+  while (current.get_parent_id() > 0 &&
+         chirp_connect_backend::GetChirp(current.get_parent_id(), &parent)) {
+    current = parent;
+  }
+  return current.get_id();
+}
+
+// Fill the missing shape of the thread starting at `root_id` in `shape`
+// A thread posted before the shapes of threads were stored is put together
+// from the children of its chirps, and a thread without replies is just its
+// first chirp.
+// returns true if this operation succeeds
+bool FillMissingThread(const uint64_t &root_id, const bool &legacy,
+                       ServiceDataStructure::Thread *const shape) {
+  if (legacy) {
+    return BuildThreadFromChildren(root_id, shape);
+  }
+  shape->Append({root_id, 0, 0, false});
+  return true;
+}
+
+// Get the shape of the thread `chirp` is in, and the id of its first chirp
+// A thread posted before the shapes of threads were stored is put together
+// and stored the first time it is read, unless it has been stored since.
+// returns true if this operation succeeds
+bool GetThreadOf(const ServiceDataStructure::Chirp &chirp,
+                 uint64_t *const root_id,
+                 ServiceDataStructure::Thread *const shape) {
+  *root_id = RootIdOf(chirp);
+  if (!chirp_connect_backend::GetThread(*root_id, shape)) {
+    return false;
+  }
+  if (!shape->empty()) {
+    return true;
+  }
+  bool legacy = chirp.get_root_id() == 0;
+  if (!FillMissingThread(*root_id, legacy, shape)) {
+    return false;
+  }
+  // A shape put together from reads cut short by the request is not stored
+  if (!legacy || BackendRequestScope::IsDone()) {
+    return true;
+  }
+  bool updated;
+  return chirp_connect_backend::UpdateThread(
+      *root_id,
+      [shape](ServiceDataStructure::Thread *const stored) {
+        if (stored->empty()) {
+          *stored = *shape;
+          return true;
+        }
+        *shape = *stored;
+        return false;
+      },
+      &updated);
+}
+
+// Change the shape of the thread `chirp` is in by `update`, and set the id
+// of its first chirp to `root_id`
+// `update` is given the whole shape, and returns false to leave it as it
+// is. See `chirp_connect_backend::UpdateThread`.
+// Whether it has been changed will be set to `updated`.
+// returns true if this operation succeeds
+bool UpdateThreadOf(
+    const ServiceDataStructure::Chirp &chirp,
+    const std::function<bool(ServiceDataStructure::Thread *const)> &update,
+    uint64_t *const root_id, bool *const updated) {
+  *root_id = RootIdOf(chirp);
+  bool legacy = chirp.get_root_id() == 0;
+  uint64_t root = *root_id;
+  bool filled = true;
+  bool ok = chirp_connect_backend::UpdateThread(
+      root,
+      [&](ServiceDataStructure::Thread *const shape) {
+        if (shape->empty()) {
+          filled = FillMissingThread(root, legacy, shape);
+          if (!filled) {
+            return false;
+          }
+        }
+        return update(shape);
+      },
+      updated);
+  return ok && filled;
+}
+}  // Anonymous namespace
+
+const size_t ServiceDataStructure::ChirpIndex::kMaxLength;
+
+ServiceDataStructure::ChirpIndex::ChirpIndex(const size_t &max_length)
+    : max_length_(max_length) {}
+
+ServiceDataStructure::ChirpIndex::Cursor
+ServiceDataStructure::ChirpIndex::CursorAt(const struct timeval &time) {
+  // Chirp ids start from 1
+  Cursor cursor;
+  cursor.time = time;
+  cursor.chirp_id = 0;
+  return cursor;
+}
+
+ServiceDataStructure::ChirpIndex::Cursor
+ServiceDataStructure::ChirpIndex::CursorOf(const Entry &entry) {
+  Cursor cursor;
+  cursor.time = entry.time;
+  cursor.chirp_id = entry.chirp_id;
+  return cursor;
+}
+
+bool ServiceDataStructure::ChirpIndex::IsAfter(const Entry &entry,
+                                               const Cursor &cursor) {
+  return ::IsAfter(entry.time, entry.chirp_id, cursor);
+}
+
+std::string ServiceDataStructure::ChirpIndex::ExportCursor(
+    const Cursor &cursor) {
+  ServiceData::ChirpIndexCursor tmp;
+  tmp.set_seconds(cursor.time.tv_sec);
+  tmp.set_useconds(cursor.time.tv_usec);
+  tmp.set_chirp_id(cursor.chirp_id);
+
+  std::string ret;
+  tmp.SerializeToString(&ret);
+  return ret;
+}
+
+bool ServiceDataStructure::ChirpIndex::ImportCursor(const std::string &input,
+                                                    Cursor *const cursor) {
+  ServiceData::ChirpIndexCursor tmp;
+  if (!tmp.ParseFromString(input) || tmp.useconds() < 0 ||
+      tmp.useconds() >= 1000000) {
+    return false;
+  }
+  cursor->time.tv_sec = tmp.seconds();
+  cursor->time.tv_usec = tmp.useconds();
+  cursor->chirp_id = tmp.chirp_id();
+  return true;
+}
+
+void ServiceDataStructure::ChirpIndex::ImportBinary(const std::string &input) {
+  // Temporary protobuf message to build this index
+  ServiceData::ChirpIndex tmp;
   tmp.ParseFromString(input);
 
-  this->clear();
-  for (int i = 0; i < tmp.chirp_id_size(); ++i) {
-    this->insert(tmp.chirp_id(i));
+  entries_.clear();
+  for (const auto &entry : tmp.entries()) {
+    Entry new_entry;
+    new_entry.chirp_id = entry.chirp_id();
+    new_entry.time.tv_sec = entry.time().seconds();
+    new_entry.time.tv_usec = entry.time().useconds();
+    entries_.push_back(new_entry);
   }
 }
 
-const std::string ServiceDataStructure::UserChirpList::ExportBinary() const {
-  // Temporary protobuf message collecting all chirp ids in this set
-  ServiceData::UserChirpList tmp;
-  for (const uint64_t &chirp_id : *this) {
-    tmp.add_chirp_id(chirp_id);
+const std::string ServiceDataStructure::ChirpIndex::ExportBinary() const {
+  // Temporary protobuf message collecting all entries in this index
+  ServiceData::ChirpIndex tmp;
+  for (const Entry &entry : entries_) {
+    auto to_protobuf = tmp.add_entries();
+    to_protobuf->set_chirp_id(entry.chirp_id);
+    to_protobuf->mutable_time()->set_seconds(entry.time.tv_sec);
+    to_protobuf->mutable_time()->set_useconds(entry.time.tv_usec);
   }
 
   std::string ret;
@@ -82,6 +471,122 @@ const std::string ServiceDataStructure::UserChirpList::ExportBinary() const {
   return ret;
 }
 
+void ServiceDataStructure::ChirpIndex::Insert(const uint64_t &chirp_id,
+                                              const struct timeval &time) {
+  // Chirps mostly come in the order they are posted, so search from the back
+  Cursor cursor;
+  cursor.time = time;
+  cursor.chirp_id = chirp_id;
+  auto it = entries_.end();
+  while (it != entries_.begin() && IsAfter(*std::prev(it), cursor)) {
+    --it;
+  }
+  Entry entry;
+  entry.chirp_id = chirp_id;
+  entry.time = time;
+  entries_.insert(it, entry);
+
+  while (entries_.size() > max_length_) {
+    entries_.pop_front();
+  }
+}
+
+std::vector<ServiceDataStructure::ChirpIndex::Entry>
+ServiceDataStructure::ChirpIndex::Since(const Cursor &cursor) const {
+  // Find the first chirp after `cursor` by binary search
+  auto it = std::partition_point(
+      entries_.begin(), entries_.end(), [&cursor](const Entry &entry) {
+        return !IsAfter(entry, cursor);
+      });
+  return std::vector<Entry>(it, entries_.end());
+}
+
+std::vector<ServiceDataStructure::ChirpIndex::Entry>
+ServiceDataStructure::ChirpIndex::Merge(
+    const std::vector<const ChirpIndex *> &indexes, const Cursor &since,
+    const size_t &max_entries) {
+  typedef std::deque<Entry>::const_reverse_iterator Position;
+  // The latest chirp not merged yet in each index, and where it ends
+  typedef std::pair<Position, Position> Head;
+  auto later_first = [](const Head &lhs, const Head &rhs) {
+    return IsAfter(*rhs.first, CursorOf(*lhs.first));
+  };
+  std::priority_queue<Head, std::vector<Head>, decltype(later_first)> heads(
+      later_first);
+
+  for (const ChirpIndex *index : indexes) {
+    if (!index->entries_.empty()) {
+      heads.push(std::make_pair(index->entries_.rbegin(),
+                                index->entries_.rend()));
+    }
+  }
+
+  std::vector<Entry> ret;
+  // A chirp may be in more than one index, e.g. after its poster has crossed
+  // the fan-out threshold
+  std::unordered_set<uint64_t> merged_ids;
+  while (!heads.empty() && ret.size() < max_entries) {
+    Head head = heads.top();
+    heads.pop();
+    if (!IsAfter(*head.first, since)) {
+      // This is the latest chirp left, so the others are not after `since`
+      // either
+      break;
+    }
+
+    if (merged_ids.insert(head.first->chirp_id).second) {
+      ret.push_back(*head.first);
+    }
+    if (++head.first != head.second) {
+      heads.push(head);
+    }
+  }
+
+  std::reverse(ret.begin(), ret.end());
+  return ret;
+}
+
+const size_t ServiceDataStructure::UserChirpList::kChunkSize;
+
+void ServiceDataStructure::UserChirpList::ImportBinary(
+    const std::string &input) {
+  std::vector<uint64_t> ids;
+  ParseChirpIds(input, &ids);
+  assign(std::move(ids));
+}
+
+const std::string ServiceDataStructure::UserChirpList::ExportBinary() const {
+  return SerializeChirpIds(ids_);
+}
+
+void ServiceDataStructure::UserChirpList::assign(std::vector<uint64_t> ids) {
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  ids_.swap(ids);
+}
+
+bool ServiceDataStructure::UserChirpList::insert(const uint64_t &id) {
+  auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+  if (it != ids_.end() && *it == id) {
+    return false;
+  }
+  ids_.insert(it, id);
+  return true;
+}
+
+size_t ServiceDataStructure::UserChirpList::erase(const uint64_t &id) {
+  auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+  if (it == ids_.end() || *it != id) {
+    return 0;
+  }
+  ids_.erase(it);
+  return 1;
+}
+
+size_t ServiceDataStructure::UserChirpList::count(const uint64_t &id) const {
+  return std::binary_search(ids_.begin(), ids_.end(), id) ? 1 : 0;
+}
+
 ServiceDataStructure::Chirp::Chirp(const std::string &user,
                                    const uint64_t &parent_id,
                                    const std::string &text) {
@@ -98,9 +603,11 @@ void ServiceDataStructure::Chirp::ImportBinary(const std::string &input) {
   chirp_.ParseFromString(input);
 
   // fill in children ids from the proto message
-  for (int i = 0; i < chirp_.children_ids_size(); ++i) {
-    children_ids_.insert(chirp_.children_ids(i));
-  }
+  std::vector<uint64_t> children_ids;
+  chirp_id_codec::Decode(chirp_.encoded_children_ids(), &children_ids);
+  children_ids.insert(children_ids.end(), chirp_.children_ids().begin(),
+                      chirp_.children_ids().end());
+  children_ids_.assign(std::move(children_ids));
 
   // fill in `struct timeval`
   time_.tv_sec = chirp_.time().seconds();
@@ -111,11 +618,10 @@ const std::string ServiceDataStructure::Chirp::ExportBinary() const {
   // fill in children ids to the proto message
   // here discard qualifier since the need to copy the data from the maintained
   // `std::set` to the protobuf message
-  const_cast<ServiceDataStructure::Chirp *>(this)->chirp_.clear_children_ids();
-  for (const uint64_t &id : children_ids_) {
-    const_cast<ServiceDataStructure::Chirp *>(this)->chirp_.add_children_ids(
-        id);
-  }
+  auto mutable_chirp = const_cast<ServiceDataStructure::Chirp *>(this);
+  mutable_chirp->chirp_.clear_children_ids();
+  chirp_id_codec::Encode(children_ids_.get_ids(),
+                         mutable_chirp->chirp_.mutable_encoded_children_ids());
 
   std::string ret;
   chirp_.SerializeToString(&ret);
@@ -123,52 +629,296 @@ const std::string ServiceDataStructure::Chirp::ExportBinary() const {
   return ret;
 }
 
-ServiceDataStructure::UserSession::UserSession(const std::string &username) {
+const size_t ServiceDataStructure::Thread::kMaxSize;
+
+void ServiceDataStructure::Thread::ImportBinary(const std::string &input) {
+  ServiceData::Thread tmp;
+  tmp.ParseFromString(input);
+
+  std::vector<uint64_t> chirp_ids, parent_ids, deleted_ids;
+  chirp_id_codec::Decode(tmp.encoded_chirp_ids(), &chirp_ids);
+  chirp_id_codec::Decode(tmp.encoded_parent_ids(), &parent_ids);
+  chirp_id_codec::Decode(tmp.encoded_deleted_ids(), &deleted_ids);
+  size_t size = std::min(chirp_ids.size(), parent_ids.size());
+  size = std::min(size, size_t(tmp.depths_size()));
+
+  entries_.clear();
+  entries_.reserve(size);
+  for (size_t i = 0; i < size; ++i) {
+    bool deleted = std::binary_search(deleted_ids.begin(), deleted_ids.end(),
+                                      chirp_ids[i]);
+    entries_.push_back({chirp_ids[i], parent_ids[i], tmp.depths(i), deleted});
+  }
+}
+
+const std::string ServiceDataStructure::Thread::ExportBinary() const {
+  chirp_id_codec::Writer chirp_ids, parent_ids;
+  std::vector<uint64_t> deleted_ids;
+  ServiceData::Thread tmp;
+  for (const Entry &entry : entries_) {
+    chirp_ids.Append(entry.chirp_id);
+    parent_ids.Append(entry.parent_id);
+    tmp.add_depths(entry.depth);
+    if (entry.deleted) {
+      deleted_ids.push_back(entry.chirp_id);
+    }
+  }
+  std::sort(deleted_ids.begin(), deleted_ids.end());
+  *tmp.mutable_encoded_chirp_ids() = chirp_ids.Release();
+  *tmp.mutable_encoded_parent_ids() = parent_ids.Release();
+  chirp_id_codec::Encode(deleted_ids, tmp.mutable_encoded_deleted_ids());
+
+  std::string ret;
+  tmp.SerializeToString(&ret);
+  return ret;
+}
+
+void ServiceDataStructure::Thread::Append(const Entry &entry) {
+  entries_.push_back(entry);
+}
+
+bool ServiceDataStructure::Thread::InsertReply(const uint64_t &chirp_id,
+                                               const uint64_t &parent_id) {
+  size_t parent = Find(parent_id);
+  if (parent == entries_.size()) {
+    return false;
+  }
+  Entry entry = {chirp_id, parent_id, entries_[parent].depth + 1, false};
+  entries_.insert(entries_.begin() + SubtreeEnd(parent), entry);
+  return true;
+}
+
+bool ServiceDataStructure::Thread::Remove(const uint64_t &chirp_id) {
+  size_t position = Find(chirp_id);
+  if (position == entries_.size()) {
+    return false;
+  }
+  entries_[position].deleted = true;
+  return true;
+}
+
+size_t ServiceDataStructure::Thread::Find(const uint64_t &chirp_id) const {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].chirp_id == chirp_id) {
+      return i;
+    }
+  }
+  return entries_.size();
+}
+
+size_t ServiceDataStructure::Thread::SubtreeEnd(const size_t &position) const {
+  // The replies follow the chirp until a chirp as shallow as it
+  size_t end = position + 1;
+  while (end < entries_.size() &&
+         entries_[end].depth > entries_[position].depth) {
+    ++end;
+  }
+  return end;
+}
+
+bool ServiceDataStructure::TagQuery::Parse(const std::string &input,
+                                           TagQuery *const query) {
+  std::vector<Clause> clauses(1);
+  // Whether the last token is an operator, which needs a term after it
+  bool expect_term = true;
+
+  std::istringstream tokens(input);
+  std::string token;
+  while (tokens >> token) {
+    if (token == "OR" || token == "AND") {
+      if (expect_term) {
+        return false;
+      }
+      if (token == "OR") {
+        clauses.emplace_back();
+      }
+      expect_term = true;
+      continue;
+    }
+
+    bool excluded = token[0] == '-';
+    std::string::size_type start = excluded ? 2 : 1;
+    if (token.size() <= start || token[start - 1] != '#') {
+      return false;
+    }
+    if (excluded) {
+      clauses.back().excluded_tags.push_back(token.substr(start));
+    } else {
+      clauses.back().tags.push_back(token.substr(start));
+    }
+    expect_term = false;
+  }
+
+  if (expect_term) {
+    // An empty query or one ending with an operator
+    return false;
+  }
+  for (const auto &clause : clauses) {
+    if (clause.tags.empty()) {
+      // Nothing to exclude the tags from
+      return false;
+    }
+  }
+
+  query->clauses_.swap(clauses);
+  return true;
+}
+
+std::set<std::string> ServiceDataStructure::TagQuery::GetTags() const {
+  std::set<std::string> ret;
+  for (const auto &clause : clauses_) {
+    ret.insert(clause.tags.begin(), clause.tags.end());
+    ret.insert(clause.excluded_tags.begin(), clause.excluded_tags.end());
+  }
+  return ret;
+}
+
+std::vector<uint64_t> ServiceDataStructure::TagQuery::Evaluate(
+    const std::map<std::string, std::vector<uint64_t>> &postings) const {
+  const std::vector<uint64_t> kEmpty;
+  auto posting_of =
+      [&](const std::string &tag) -> const std::vector<uint64_t> & {
+    auto it = postings.find(tag);
+    return it != postings.end() ? it->second : kEmpty;
+  };
+
+  std::vector<uint64_t> ret;
+  for (const auto &clause : clauses_) {
+    // Start from the shortest list, which bounds the result of the clause
+    std::vector<const std::vector<uint64_t> *> lists;
+    for (const auto &tag : clause.tags) {
+      lists.push_back(&posting_of(tag));
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<uint64_t> *lhs,
+                 const std::vector<uint64_t> *rhs) {
+                return lhs->size() < rhs->size();
+              });
+
+    std::vector<uint64_t> matched = *lists[0];
+    for (size_t i = 1; i < lists.size() && !matched.empty(); ++i) {
+      FilterByGalloping(*lists[i], true, &matched);
+    }
+    for (const auto &tag : clause.excluded_tags) {
+      if (matched.empty()) {
+        break;
+      }
+      FilterByGalloping(posting_of(tag), false, &matched);
+    }
+
+    std::vector<uint64_t> merged;
+    std::set_union(ret.begin(), ret.end(), matched.begin(), matched.end(),
+                   std::back_inserter(merged));
+    ret.swap(merged);
+  }
+  return ret;
+}
+
+const size_t ServiceDataStructure::kDefaultFanOutThreshold;
+const time_t ServiceDataStructure::kTagBucketSeconds;
+const time_t ServiceDataStructure::kMaxBackfillSeconds;
+const time_t ServiceDataStructure::kDefaultTrendingHalfLifeSeconds;
+const size_t ServiceDataStructure::kMaxTrendingTags;
+const size_t ServiceDataStructure::kDefaultSearchResults;
+const size_t ServiceDataStructure::kMaxSearchResults;
+
+ServiceDataStructure::ServiceDataStructure(
+    const size_t &fan_out_threshold, const time_t &trending_half_life_seconds)
+    : fan_out_threshold_(fan_out_threshold),
+      // Keep more candidates than asked for, since the counts of the tags
+      // near the bottom are less accurate
+      trending_tags_(trending_half_life_seconds, kMaxTrendingTags * 10) {}
+
+ServiceDataStructure::UserSession::UserSession(
+    const std::string &username, ServiceDataStructure *const service)
+    : service_(service) {
   bool ok = chirp_connect_backend::GetUser(username, &(this->user_));
-  CHECK(ok) << "User `" << username << "` should exist.";
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "User `" << username << "` should exist.";
 }
 
 ServiceDataStructure::ReturnCodes ServiceDataStructure::UserSession::Follow(
     const std::string &username) {
-  UserFollowingList following_list;
-  bool ok = chirp_connect_backend::GetUserFollowingList(user_.get_username(),
-                                                        &following_list);
-  CHECK(ok) << "The user following list for user `" << username
-            << "` should exist.";
-
   bool user_found = chirp_connect_backend::GetUser(username, nullptr);
 
   if (!user_found) {
     return FOLLOWEE_NOT_FOUND;
   }
 
-  following_list.insert(username);
-  if (!chirp_connect_backend::SaveUserFollowingList(user_.get_username(),
-                                                    following_list)) {
+  // Both lists are swapped in, since others may follow or be followed at the
+  // same time
+  bool ok = chirp_connect_backend::UpdateUserFollowingList(
+      user_.get_username(),
+      [&username](UserFollowingList *const following_list) {
+        return following_list->insert(username).second;
+      });
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
+  }
+
+  // Record this user as a follower so that the chirps posted by `username`
+  // are pushed to the home timeline of this user
+  bool inserted = false;
+  size_t num_of_followers = 0;
+  ok = chirp_connect_backend::UpdateUserFollowerList(
+      username, [this, &inserted, &num_of_followers](
+                    UserFollowerList *const follower_list) {
+        inserted = follower_list->insert(user_.get_username()).second;
+        num_of_followers = follower_list->size();
+        return inserted;
+      });
+  if (!ok) {
     // if saving fails
     return INTERNAL_BACKEND_ERROR;
   }
+
+  // `username` is pulled from now on if this follow crosses the threshold
+  if (inserted &&
+      num_of_followers == service_->get_fan_out_threshold() + 1 &&
+      !UpdatePulledUsers(username)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
   return OK;
 }
 
 ServiceDataStructure::ReturnCodes ServiceDataStructure::UserSession::Unfollow(
     const std::string &username) {
-  UserFollowingList following_list;
-  bool ok = chirp_connect_backend::GetUserFollowingList(user_.get_username(),
-                                                        &following_list);
-  CHECK(ok) << "The user following list for user `" << username
-            << "` should exist.";
-
-  bool erased = following_list.erase(username);
-  if (!erased) {
+  bool erased = false;
+  bool ok = chirp_connect_backend::UpdateUserFollowingList(
+      user_.get_username(),
+      [&username, &erased](UserFollowingList *const following_list) {
+        erased = following_list->erase(username) > 0;
+        return erased;
+      });
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
+  } else if (!erased) {
     // if erasing fails
     return FOLLOWEE_NOT_FOUND;
-  } else if (!chirp_connect_backend::SaveUserFollowingList(user_.get_username(),
-                                                           following_list)) {
+  }
+
+  // Stop pushing the chirps posted by `username` to this user
+  erased = false;
+  size_t num_of_followers = 0;
+  ok = chirp_connect_backend::UpdateUserFollowerList(
+      username, [this, &erased, &num_of_followers](
+                    UserFollowerList *const follower_list) {
+        erased = follower_list->erase(user_.get_username()) > 0;
+        num_of_followers = follower_list->size();
+        return erased;
+      });
+  if (!ok) {
     // if saving fails
     return INTERNAL_BACKEND_ERROR;
   }
 
+  // `username` is pushed from now on if this unfollow crosses the threshold
+  if (erased && num_of_followers == service_->get_fan_out_threshold() &&
+      !UpdatePulledUsers(username)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
   return OK;
 }
 
@@ -178,74 +928,143 @@ ServiceDataStructure::ReturnCodes ServiceDataStructure::UserSession::PostChirp(
   Chirp chirp(user_.get_username(), parent_id, text);
 
   // If the `parent_id` is specified
+  Chirp parent_chirp;
   if (parent_id > 0) {
-    Chirp parent_chirp;
     bool parent_found =
         chirp_connect_backend::GetChirp(parent_id, &parent_chirp);
     if (!parent_found) {
       return REPLY_ID_NOT_FOUND;
     }
-
-    parent_chirp.insert_children_id(chirp.get_id());
-    bool ok =
-        chirp_connect_backend::SaveChirp(parent_chirp.get_id(), parent_chirp);
-    if (!ok) {
-      // if saving fails
-      return INTERNAL_BACKEND_ERROR;
-    }
+    chirp.set_root_id(RootIdOf(parent_chirp));
+  } else {
+    chirp.set_root_id(chirp.get_id());
   }
 
+  // A reply is saved before it is put in the shape of its thread, so that a
+  // thread never lists a chirp which cannot be read
   bool ok = chirp_connect_backend::SaveChirp(chirp.get_id(), chirp);
   if (!ok) {
     // if saving fails
     return INTERNAL_BACKEND_ERROR;
   }
 
-
-
-  // Parse the chirp text to find any tags
-  std::string::size_type start = text.find('#');
-  while (start != std::string::npos) {
-    start += 1;
-    std::string::size_type end = text.find(' ', start);
-    if ((end != std::string::npos && start < end )
-       || (end == std::string::npos && start != text.size())) {
-      // insert an entry
-      std::string::size_type count = end != std::string::npos ? end - start : text.size() - start;
-      UserChirpList chirp_tag_list;
-      ok = chirp_connect_backend::GetChirpTagList(text.substr(start, count),
-                                                   &chirp_tag_list);
-      chirp_tag_list.insert(chirp.get_id());
-      ok = chirp_connect_backend::SaveChirpTag(text.substr(start, count), chirp_tag_list);
-      start++;
+  if (parent_id > 0) {
+    // Only the shape of the thread is written, not the parent chirp
+    uint64_t root_id;
+    bool inserted;
+    bool full = false;
+    ok = UpdateThreadOf(
+        parent_chirp,
+        [&](Thread *const shape) {
+          full = shape->size() >= Thread::kMaxSize;
+          return !full && shape->InsertReply(chirp.get_id(), parent_id);
+        },
+        &root_id, &inserted);
+    if (!ok || (!inserted && !full)) {
+      // The reply is in no thread, so it is taken back
+      chirp_connect_backend::DeleteChirp(chirp.get_id());
+      return ok ? REPLY_ID_NOT_FOUND : INTERNAL_BACKEND_ERROR;
     }
-    if (end == std::string::npos) {
-      break;
+    if (full) {
+      // The reply starts a thread of its own
+      chirp.set_root_id(chirp.get_id());
+      ok = chirp_connect_backend::SaveChirp(chirp.get_id(), chirp);
+      if (!ok) {
+        // if saving fails
+        return INTERNAL_BACKEND_ERROR;
+      }
     }
-    start = text.find("#", end+1);
   }
 
-  // Update the information of this user
-  user_.set_last_update(chirp.get_time());
-  ok = chirp_connect_backend::SaveUser(user_.get_username(), user_);
-  if (!ok) {
-    // if saving fails
-    return INTERNAL_BACKEND_ERROR;
-  }
+  // Parse the chirp text to find any tags
+  for (const auto &tag : ParseTags(text)) {
+    // insert an entry
+    ok = chirp_connect_backend::AppendChirpTag(tag, chirp.get_id());
+    if (!ok) {
+      // if saving fails
+      return INTERNAL_BACKEND_ERROR;
+    }
 
-  UserChirpList chirp_list;
-  ok = chirp_connect_backend::GetUserChirpList(user_.get_username(),
-                                               &chirp_list);
-  CHECK(ok) << "The user chirp list for user `" << user_.get_username()
-            << "` should exist.";
-  chirp_list.insert(chirp.get_id());
-  ok = chirp_connect_backend::SaveUserChirpList(user_.get_username(),
-                                                chirp_list);
+    service_->trending_tags_.Add(
+        tag, chirp.get_time().tv_sec + chirp.get_time().tv_usec / 1e6);
+
+    // Index this chirp in the bucket of its posting time as well
+    uint64_t bucket = chirp.get_time().tv_sec / kTagBucketSeconds;
+    ok = chirp_connect_backend::UpdateTagBucket(
+        tag, bucket, [&chirp](ChirpIndex *const chirps) {
+          chirps->Insert(chirp.get_id(), chirp.get_time());
+          return true;
+        });
+    if (!ok) {
+      // if saving fails
+      return INTERNAL_BACKEND_ERROR;
+    }
+  }
+
+  // Index the words of this chirp for searching
+  for (const auto &term : Tokenize(text)) {
+    ok = chirp_connect_backend::AppendSearchTerm(term, chirp.get_id());
+    if (!ok) {
+      // if saving fails
+      return INTERNAL_BACKEND_ERROR;
+    }
+  }
+
+  // Update the information of this user
+  user_.set_last_update(chirp.get_time());
+  ok = chirp_connect_backend::SaveUser(user_.get_username(), user_);
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
+  }
+
+  ok = chirp_connect_backend::AppendUserChirp(user_.get_username(),
+                                             chirp.get_id());
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
+  }
+
+  // Keep the latest chirps of this user for the followers pulling them
+  ok = chirp_connect_backend::UpdateRecentChirps(
+      user_.get_username(), [&chirp](ChirpIndex *const recent_chirps) {
+        recent_chirps->Insert(chirp.get_id(), chirp.get_time());
+        return true;
+      });
   if (!ok) {
     // if saving fails
     return INTERNAL_BACKEND_ERROR;
   }
 
+  UserFollowerList follower_list;
+  ok = chirp_connect_backend::GetUserFollowerList(user_.get_username(),
+                                                  &follower_list);
+  if (!ok) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+
+  // Users with too many followers are pulled by their followers instead of
+  // being pushed to every one of them. They are added to the pulled users
+  // when a follow crosses the threshold.
+  if (follower_list.size() > service_->get_fan_out_threshold()) {
+    follower_list.clear();
+  }
+
+  // Push this chirp to the home timelines of the followers
+  // The timelines are swapped in, since others may push to them at the same
+  // time
+  for (const auto &follower : follower_list) {
+    ok = chirp_connect_backend::UpdateHomeTimeline(
+        follower, [&chirp](ChirpIndex *const timeline) {
+          timeline->Insert(chirp.get_id(), chirp.get_time());
+          return true;
+        });
+    if (!ok) {
+      // if saving fails
+      return INTERNAL_BACKEND_ERROR;
+    }
+  }
+
   if (chirp_id != nullptr) {
     *chirp_id = chirp.get_id();
   }
@@ -264,12 +1083,30 @@ ServiceDataStructure::ReturnCodes ServiceDataStructure::UserSession::EditChirp(
   }
 
   // If the chirp is found and its posting user is the user in this session
+  std::set<std::string> old_terms = Tokenize(chirp.get_text());
+  std::set<std::string> new_terms = Tokenize(text);
   chirp.set_text(text);
   ok = chirp_connect_backend::SaveChirp(id, chirp);
   if (!ok) {
     // if saving fails
     return INTERNAL_BACKEND_ERROR;
   }
+
+  // Only the words added or removed are indexed again
+  for (const auto &term : old_terms) {
+    if (new_terms.count(term) == 0) {
+      ok &= chirp_connect_backend::RemoveSearchTerm(term, id);
+    }
+  }
+  for (const auto &term : new_terms) {
+    if (old_terms.count(term) == 0) {
+      ok &= chirp_connect_backend::AppendSearchTerm(term, id);
+    }
+  }
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
+  }
   return OK;
 }
 
@@ -285,32 +1122,27 @@ ServiceDataStructure::UserSession::DeleteChirp(const uint64_t &id) {
   }
 
   // If the chirp is found and its posting user is the user in this session
-  UserChirpList chirp_list;
-  ok = chirp_connect_backend::GetUserChirpList(user_.get_username(),
-                                               &chirp_list);
-  CHECK(ok) << "The user chirp list for user `" << user_.get_username()
-            << "` should exist.";
-
-  // if parent id is specified
-  if (chirp.get_parent_id() > 0) {
-    Chirp parent_chirp;
-    bool parent_found =
-        chirp_connect_backend::GetChirp(chirp.get_parent_id(), &parent_chirp);
-    if (!parent_found) {
-      return REPLY_ID_NOT_FOUND;
-    }
-    parent_chirp.erase_children_id(chirp.get_id());
-    ok = chirp_connect_backend::SaveChirp(parent_chirp.get_id(), parent_chirp);
-    if (!ok) {
-      // if saving fails
-      return INTERNAL_BACKEND_ERROR;
-    }
+  // Mark it in the shape of its thread, so that its replies can still be
+  // read from them. A thread of a single chirp is not stored.
+  uint64_t root_id;
+  bool removed;
+  ok = UpdateThreadOf(
+      chirp,
+      [id](Thread *const shape) {
+        return shape->Remove(id) && shape->size() > 1;
+      },
+      &root_id, &removed);
+  if (!ok) {
+    // if saving fails
+    return INTERNAL_BACKEND_ERROR;
   }
 
-  chirp_list.erase(chirp.get_id());
   ok = chirp_connect_backend::DeleteChirp(id);
-  ok &= chirp_connect_backend::SaveUserChirpList(user_.get_username(),
-                                                 chirp_list);
+  ok &= chirp_connect_backend::RemoveUserChirp(user_.get_username(),
+                                               chirp.get_id());
+  for (const auto &term : Tokenize(chirp.get_text())) {
+    ok &= chirp_connect_backend::RemoveSearchTerm(term, chirp.get_id());
+  }
 
   if (!ok) {
     // if saving fails
@@ -319,164 +1151,1161 @@ ServiceDataStructure::UserSession::DeleteChirp(const uint64_t &id) {
   return OK;
 }
 
+bool ServiceDataStructure::UserSession::UpdatePulledUsers(
+    const std::string &username) {
+  UserFollowerList follower_list;
+  if (!chirp_connect_backend::GetUserFollowerList(username, &follower_list)) {
+    return false;
+  }
+  bool pulled = follower_list.size() > service_->get_fan_out_threshold();
+  PulledUserList pulled_users;
+  if (!chirp_connect_backend::GetPulledUsers(&pulled_users)) {
+    return false;
+  }
+  if (pulled == (pulled_users.count(username) > 0)) {
+    return true;
+  }
+
+  if (!pulled) {
+    // Push the latest chirps to the followers, leaving out the ones pushed
+    // before `username` was pulled
+    ChirpIndex recent_chirps;
+    if (!chirp_connect_backend::GetRecentChirps(username, &recent_chirps)) {
+      return false;
+    }
+    struct timeval epoch = {0, 0};
+    std::vector<ChirpIndex::Entry> entries =
+        recent_chirps.Since(ChirpIndex::CursorAt(epoch));
+    for (const auto &follower : follower_list) {
+      bool ok = chirp_connect_backend::UpdateHomeTimeline(
+          follower, [&entries](ChirpIndex *const timeline) {
+            if (entries.empty()) {
+              return false;
+            }
+            std::set<uint64_t> pushed;
+            for (const auto &entry : timeline->Since(
+                     ChirpIndex::CursorAt(entries.front().time))) {
+              pushed.insert(entry.chirp_id);
+            }
+            bool changed = false;
+            for (const auto &entry : entries) {
+              if (pushed.count(entry.chirp_id) == 0) {
+                timeline->Insert(entry.chirp_id, entry.time);
+                changed = true;
+              }
+            }
+            return changed;
+          });
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+
+  return chirp_connect_backend::UpdatePulledUsers(
+      [&username, pulled](PulledUserList *const pulled_users) {
+        if (pulled) {
+          return pulled_users->insert(username).second;
+        }
+        return pulled_users->erase(username) > 0;
+      });
+}
+
 std::set<uint64_t> ServiceDataStructure::UserSession::MonitorFrom(
     struct timeval *const from) {
   struct timeval now;
   gettimeofday(&now, nullptr);
 
-  std::set<uint64_t> ret;
+  std::vector<ChirpIndex::Entry> feed;
+  bool ok = CollectFeed(ChirpIndex::CursorAt(*from), &feed);
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "Get request should be successful.";
+  std::set<uint64_t> ret;
+  for (const auto &entry : feed) {
+    if (entry.time < now) {
+      ret.insert(entry.chirp_id);
+    }
+  }
+
+  *from = now;
+  return ret;
+}
+
+ServiceDataStructure::ReturnCodes
+ServiceDataStructure::UserSession::MonitorSince(
+    ChirpIndex::Cursor *const cursor, std::vector<uint64_t> *const chirp_ids) {
+  std::vector<ChirpIndex::Entry> feed;
+  if (!CollectFeed(*cursor, &feed)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+  if (!feed.empty()) {
+    *cursor = ChirpIndex::CursorOf(feed.back());
+  }
+
+  for (const auto &entry : feed) {
+    chirp_ids->push_back(entry.chirp_id);
+  }
+  return OK;
+}
+
+bool ServiceDataStructure::UserSession::CollectFeed(
+    const ChirpIndex::Cursor &since,
+    std::vector<ChirpIndex::Entry> *const feed) {
+  // The chirps of most following users have been pushed to the home timeline
+  ChirpIndex timeline;
+  if (!chirp_connect_backend::GetHomeTimeline(user_.get_username(),
+                                              &timeline)) {
+    return false;
+  }
+
+  UserFollowingList following_list;
+  if (!chirp_connect_backend::GetUserFollowingList(user_.get_username(),
+                                                   &following_list)) {
+    return false;
+  }
+  PulledUserList pulled_users;
+  if (!chirp_connect_backend::GetPulledUsers(&pulled_users)) {
+    return false;
+  }
+
+  // The chirps of the following users with too many followers are pulled
+  std::vector<ChirpIndex> pulled_indexes;
+  for (const auto &username : pulled_users) {
+    if (following_list.count(username) == 0) {
+      continue;
+    }
+    pulled_indexes.emplace_back();
+    if (!chirp_connect_backend::GetRecentChirps(username,
+                                                &pulled_indexes.back())) {
+      return false;
+    }
+  }
+
+  std::vector<const ChirpIndex *> indexes(1, &timeline);
+  for (const auto &pulled_index : pulled_indexes) {
+    indexes.push_back(&pulled_index);
+  }
+  *feed = ChirpIndex::Merge(indexes, since, ChirpIndex::kMaxLength);
+  return true;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::ReadChirps(
+    const std::vector<uint64_t> &ids, std::vector<Chirp> *const chirps) {
+  std::map<uint64_t, Chirp> found;
+  if (!ids.empty() && !chirp_connect_backend::GetChirps(ids, &found)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+  for (const uint64_t &id : ids) {
+    auto it = found.find(id);
+    if (it != found.end()) {
+      chirps->push_back(std::move(it->second));
+    }
+  }
+  return OK;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::ReadThread(
+    const uint64_t &id, std::vector<Chirp> *const thread) {
+  std::string cursor;
+  return ReadThreadPage(id, SIZE_MAX, SIZE_MAX, &cursor, thread);
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::ReadThreadPage(
+    const uint64_t &id, const size_t &max_depth, const size_t &max_chirps,
+    std::string *const cursor, std::vector<Chirp> *const thread,
+    std::vector<size_t> *const depths) {
+  if (max_chirps == 0) {
+    return INVALID_ARGUMENT;
+  }
+  Chirp first;
+  if (!chirp_connect_backend::GetChirp(id, &first)) {
+    return CHIRP_ID_NOT_FOUND;
+  }
+  uint64_t root_id;
+  Thread shape;
+  if (!GetThreadOf(first, &root_id, &shape)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+  const std::vector<Thread::Entry> &entries = shape.get_entries();
+  size_t begin = shape.Find(id);
+  if (begin == entries.size()) {
+    return CHIRP_ID_NOT_FOUND;
+  }
+  size_t end = shape.SubtreeEnd(begin);
+  uint32_t base_depth = entries[begin].depth;
+
+  // The path from the chirp `id` to the last chirp read
+  std::vector<uint64_t> path;
+  size_t position = begin;
+  if (!cursor->empty()) {
+    ServiceData::ThreadCursor last_read;
+    if (!last_read.ParseFromString(*cursor) || last_read.path_size() == 0 ||
+        last_read.path(0) != id) {
+      return INVALID_ARGUMENT;
+    }
+    path.assign(last_read.path().begin(), last_read.path().end());
+
+    // Next is the chirp after the last chirp read, or after the replies to
+    // the first chirp on the path deleted since
+    position = begin + 1;
+    for (size_t depth = 1; depth < path.size(); ++depth) {
+      size_t path_position = shape.Find(path[depth]);
+      if (path_position <= begin || path_position >= end) {
+        return INVALID_ARGUMENT;
+      }
+      if (entries[path_position].deleted) {
+        position = shape.SubtreeEnd(path_position);
+        path.resize(depth);
+        break;
+      }
+      position = path_position + 1;
+    }
+  }
+
+  // Pick the chirps of this page from the shape, leaving out deleted chirps
+  // and chirps too deep along with their replies
+  std::vector<uint64_t> ids;
+  std::vector<size_t> id_depths;
+  bool more = false;
+  while (position < end) {
+    const Thread::Entry &entry = entries[position];
+    size_t depth = entry.depth - base_depth;
+    if (entry.deleted || depth > max_depth) {
+      position = shape.SubtreeEnd(position);
+      continue;
+    }
+    if (ids.size() == max_chirps) {
+      more = true;
+      break;
+    }
+    path.resize(depth);
+    path.push_back(entry.chirp_id);
+    ids.push_back(entry.chirp_id);
+    id_depths.push_back(depth);
+    ++position;
+  }
+
+  // Read the chirps in one batch, except the chirp `id` already read
+  std::vector<uint64_t> batch_ids;
+  for (const uint64_t &chirp_id : ids) {
+    if (chirp_id != id) {
+      batch_ids.push_back(chirp_id);
+    }
+  }
+  std::map<uint64_t, Chirp> chirps;
+  if (!batch_ids.empty() &&
+      !chirp_connect_backend::GetChirps(batch_ids, &chirps)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+  chirps[id] = std::move(first);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    auto it = chirps.find(ids[i]);
+    if (it == chirps.end()) {
+      // Deleted after the shape was read
+      continue;
+    }
+    thread->push_back(std::move(it->second));
+    if (depths != nullptr) {
+      depths->push_back(id_depths[i]);
+    }
+  }
+
+  if (!more) {
+    cursor->clear();
+  } else {
+    ServiceData::ThreadCursor last_read;
+    for (const uint64_t &path_id : path) {
+      last_read.add_path(path_id);
+    }
+    last_read.SerializeToString(cursor);
+  }
+  return OK;
+}
+
+std::set<uint64_t> ServiceDataStructure::StreamFrom(
+    struct timeval *const from, const std::string& tag) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  // Only the buckets from `from` to now may hold chirps to be streamed,
+  // however long the history of the tag is
+  std::vector<uint64_t> chirp_ids;
+  bool ok = TaggedChirpsBetween(tag, *from, now, &chirp_ids);
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "Get request should be successful.";
+  std::set<uint64_t> ret(chirp_ids.begin(), chirp_ids.end());
+
+  *from = now;
+  return ret;
+}
+
+std::vector<std::pair<std::string, double>>
+ServiceDataStructure::GetTrendingTags(const size_t &count) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return trending_tags_.Top(std::min(count, kMaxTrendingTags),
+                            now.tv_sec + now.tv_usec / 1e6);
+}
+
+std::set<uint64_t> ServiceDataStructure::StreamQueryFrom(
+    struct timeval *const from, const TagQuery &query) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  std::map<std::string, std::vector<uint64_t>> postings;
+  for (const auto &tag : query.GetTags()) {
+    bool ok = TaggedChirpsBetween(tag, *from, now, &postings[tag]);
+    CHECK(ok || BackendRequestScope::IsDone())
+        << "Get request should be successful.";
+  }
+  std::vector<uint64_t> chirp_ids = query.Evaluate(postings);
+  std::set<uint64_t> ret(chirp_ids.begin(), chirp_ids.end());
+
+  *from = now;
+  return ret;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::StreamSince(
+    const std::string &tag, ChirpIndex::Cursor *const cursor,
+    std::vector<uint64_t> *const chirp_ids) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  std::vector<ChirpIndex::Entry> entries;
+  if (!TaggedChirpsBetween(tag, *cursor, now, ChirpIndex::kMaxLength,
+                           &entries)) {
+    return INTERNAL_BACKEND_ERROR;
+  }
+  *chirp_ids = TakeLatest(&entries, cursor);
+  return OK;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::StreamQuerySince(
+    const TagQuery &query, ChirpIndex::Cursor *const cursor,
+    std::vector<uint64_t> *const chirp_ids) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  // The postings of each tag, and the times of the chirps in them
+  // Every chirp of a tag in the window is read, since the latest chirps
+  // matching the query may be older than the latest chirps with the tag.
+  std::map<std::string, std::vector<uint64_t>> postings;
+  std::map<uint64_t, ChirpIndex::Entry> entries_by_id;
+  for (const auto &tag : query.GetTags()) {
+    std::vector<uint64_t> &tag_chirp_ids = postings[tag];
+    std::vector<ChirpIndex::Entry> tag_entries;
+    if (!TaggedChirpsBetween(tag, *cursor, now, SIZE_MAX, &tag_entries)) {
+      return INTERNAL_BACKEND_ERROR;
+    }
+    for (const auto &entry : tag_entries) {
+      tag_chirp_ids.push_back(entry.chirp_id);
+      entries_by_id[entry.chirp_id] = entry;
+    }
+    std::sort(tag_chirp_ids.begin(), tag_chirp_ids.end());
+  }
+
+  std::vector<ChirpIndex::Entry> entries;
+  for (const uint64_t &chirp_id : query.Evaluate(postings)) {
+    entries.push_back(entries_by_id.at(chirp_id));
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const ChirpIndex::Entry &lhs, const ChirpIndex::Entry &rhs) {
+              return ChirpIndex::IsAfter(rhs, ChirpIndex::CursorOf(lhs));
+            });
+  *chirp_ids = TakeLatest(&entries, cursor);
+  return OK;
+}
+
+std::vector<std::string> ServiceDataStructure::ParseTags(
+    const std::string &text) {
+  std::vector<std::string> ret;
+  std::string::size_type start = text.find('#');
+  while (start != std::string::npos) {
+    start += 1;
+    std::string::size_type end = text.find(' ', start);
+    if ((end != std::string::npos && start < end) ||
+        (end == std::string::npos && start != text.size())) {
+      std::string::size_type count =
+          end != std::string::npos ? end - start : text.size() - start;
+      ret.push_back(text.substr(start, count));
+    }
+    if (end == std::string::npos) {
+      break;
+    }
+    start = text.find('#', end + 1);
+  }
+  return ret;
+}
+
+std::set<std::string> ServiceDataStructure::Tokenize(const std::string &text) {
+  std::set<std::string> ret;
+  std::string word;
+  for (const char &c : text) {
+    unsigned char byte = c;
+    if (byte >= 0x80 || std::isalnum(byte)) {
+      word.push_back(std::tolower(byte));
+    } else if (!word.empty()) {
+      ret.insert(word);
+      word.clear();
+    }
+  }
+  if (!word.empty()) {
+    ret.insert(word);
+  }
+  return ret;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::Search(
+    const std::string &query, const size_t &max_results,
+    std::string *const cursor, std::vector<uint64_t> *const chirp_ids) {
+  // The most chirps read per chirp returned, so that a page ruled out by the
+  // other words still ends in bounded time
+  const size_t kMaxCandidatesPerResult = 8;
+
+  std::set<std::string> terms = Tokenize(query);
+  if (terms.empty()) {
+    return INVALID_ARGUMENT;
+  }
+  size_t page_size = max_results == 0
+                         ? kDefaultSearchResults
+                         : std::min(max_results, kMaxSearchResults);
+
+  ServiceData::SearchCursor position;
+  if (cursor->empty()) {
+    // Start from the newest chirps with the rarest word, which bounds the
+    // chirps matching every word
+    uint64_t min_size = UINT64_MAX;
+    for (const auto &term : terms) {
+      uint64_t size;
+      if (!chirp_connect_backend::GetSearchTermSize(term, &size)) {
+        return INTERNAL_BACKEND_ERROR;
+      }
+      if (size < min_size) {
+        min_size = size;
+        position.set_term(term);
+      }
+    }
+    if (min_size == 0) {
+      // Some word is in no chirps
+      return OK;
+    }
+    position.set_chunk_index(UserChirpList::Cursor().chunk_index);
+  } else if (!position.ParseFromString(*cursor) ||
+             terms.count(position.term()) == 0) {
+    return INVALID_ARGUMENT;
+  }
+
+  UserChirpList::Cursor page_cursor;
+  page_cursor.chunk_index = position.chunk_index();
+  page_cursor.offset = position.offset();
+  if (!cursor->empty()) {
+    // The position comes from the client
+    bool valid;
+    if (!chirp_connect_backend::CheckSearchTermCursor(position.term(),
+                                                      page_cursor, &valid)) {
+      return INTERNAL_BACKEND_ERROR;
+    }
+    if (!valid) {
+      return INVALID_ARGUMENT;
+    }
+  }
+  size_t num_of_results = 0;
+  size_t num_of_candidates = 0;
+  while (num_of_results < page_size &&
+         num_of_candidates < page_size * kMaxCandidatesPerResult &&
+         !page_cursor.at_end()) {
+    std::vector<uint64_t> candidates;
+    bool ok = chirp_connect_backend::GetSearchTermPage(
+        position.term(), page_size - num_of_results, &page_cursor,
+        &candidates);
+    if (!ok) {
+      return INTERNAL_BACKEND_ERROR;
+    }
+
+    // The texts of the page are read in one request to check the other words
+    std::map<uint64_t, Chirp> chirps;
+    if (terms.size() > 1 && !candidates.empty() &&
+        !chirp_connect_backend::GetChirps(candidates, &chirps)) {
+      return INTERNAL_BACKEND_ERROR;
+    }
+    for (const uint64_t &id : candidates) {
+      ++num_of_candidates;
+      if (terms.size() > 1) {
+        auto it = chirps.find(id);
+        if (it == chirps.end()) {
+          // The chirp has been deleted
+          continue;
+        }
+        std::set<std::string> words = Tokenize(it->second.get_text());
+        if (!std::includes(words.begin(), words.end(), terms.begin(),
+                           terms.end())) {
+          continue;
+        }
+      }
+      chirp_ids->push_back(id);
+      ++num_of_results;
+    }
+  }
+
+  if (page_cursor.at_end()) {
+    cursor->clear();
+  } else {
+    position.set_chunk_index(page_cursor.chunk_index);
+    position.set_offset(page_cursor.offset);
+    position.SerializeToString(cursor);
+  }
+  return OK;
+}
+
+ServiceDataStructure::ReturnCodes ServiceDataStructure::UserRegister(
+    const std::string &username) {
+  // Invalid username
+  if (username.empty()) {
+    return INVALID_ARGUMENT;
+  }
+
+  bool user_found = chirp_connect_backend::GetUser(username, nullptr);
+  if (user_found) {
+    return USER_EXISTS;
+  }
+
+  // If the specified username has not been registered
+  User new_user(username);
+  UserChirpList chirp_list;
+  UserFollowingList following_list;
+  bool ok =
+      chirp_connect_backend::SaveUser(username, new_user) &&
+      chirp_connect_backend::SaveUserChirpList(username, chirp_list) &&
+      chirp_connect_backend::SaveUserFollowingList(username, following_list);
+  if (!ok) {
+    // if saving fails
+    chirp_connect_backend::DeleteUser(username);
+    chirp_connect_backend::DeleteUserChirpList(username);
+    chirp_connect_backend::DeleteUserFollowingList(username);
+    return INTERNAL_BACKEND_ERROR;
+  }
+
+  return OK;
+}
+
+std::unique_ptr<ServiceDataStructure::UserSession>
+ServiceDataStructure::UserLogin(const std::string &username) {
+  bool user_found = chirp_connect_backend::GetUser(username, nullptr);
+
+  if (!user_found) {
+    return nullptr;
+  }
+  // If the specified username is found
+  return std::unique_ptr<ServiceDataStructure::UserSession>(
+      new UserSession(username, this));
+}
+
+// Type identifier for serializing data
+const std::string kTypeNextChirpId({0, 0, 0, char(1)});
+const std::string kTypeUsernameToUserPrefix({0, 0, 0, char(2)});
+const std::string kTypeUsernameToFollowingPrefix({0, 0, 0, char(3)});
+const std::string kTypeUsernameToChirpPrefix({0, 0, 0, char(4)});
+const std::string kTypeChirpidToChirpPrefix({0, 0, 0, char(5)});
+const std::string kTypeChirpTagPrefix({0, 0, 0, char(6)});
+const std::string kTypeUsernameToFollowerPrefix({0, 0, 0, char(7)});
+const std::string kTypeUsernameToHomeTimelinePrefix({0, 0, 0, char(8)});
+const std::string kTypeUsernameToRecentChirpsPrefix({0, 0, 0, char(9)});
+const std::string kTypePulledUsers({0, 0, 0, char(10)});
+const std::string kTypeUsernameToChirpChunkPrefix({0, 0, 0, char(11)});
+const std::string kTypeChirpTagChunkPrefix({0, 0, 0, char(12)});
+const std::string kTypeChirpTagBucketPrefix({0, 0, 0, char(13)});
+const std::string kTypeSearchTermPrefix({0, 0, 0, char(14)});
+const std::string kTypeSearchTermChunkPrefix({0, 0, 0, char(15)});
+const std::string kTypeChirpidToThreadPrefix({0, 0, 0, char(16)});
+const std::string kTypeChunkedListHintPrefix({0, 0, 0, char(17)});
+
+// Definition of `backend_client`
+// The default version for this will communicate through grpc
+std::unique_ptr<BackendClient> chirp_connect_backend::backend_client_(
+    new BackendClientStandard());
+
+// Definition of `chirp_id_generator_`
+// The default is to use the counter in the backend
+std::unique_ptr<ChirpIdGenerator> chirp_connect_backend::chirp_id_generator_;
+
+namespace {
+// Concurrent reads of the same key are coalesced through this group
+SingleFlightGroup single_flight_group;
+
+// Get the value of `key` from the backend
+// If there is a read of `key` in flight, this waits for it and shares its
+// result instead of sending another request.
+// returns true if this operation succeeds
+// returns false otherwise
+bool GetValue(const std::string &key, std::string *const value) {
+  auto get = [](const std::string &key, std::string *const value) {
+    std::vector<std::string> reply;
+    bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
+        std::vector<std::string>(1, key), &reply);
+    if (ok && !reply.empty()) {
+      *value = reply[0];
+    }
+    return ok;
+  };
+  if (single_flight_group.Do(key, get, value)) {
+    return true;
+  }
+  // A read shared from another request may have failed only because that
+  // request had been cancelled or its deadline had passed, which should not
+  // fail this one
+  return !BackendRequestScope::IsDone() && get(key, value);
+}
+
+// Put the `value` of `key` to the backend
+// returns true if this operation succeeds
+// returns false otherwise
+bool PutValue(const std::string &key, const std::string &value) {
+  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(key, value);
+  // reads coming after this write should not share a read issued before it
+  single_flight_group.Forget(key);
+  return ok;
+}
+
+// Delete `key` from the backend
+// returns true if this operation succeeds
+// returns false otherwise
+bool DeleteValue(const std::string &key) {
+  bool ok = chirp_connect_backend::backend_client_->SendDeleteKeyRequest(key);
+  single_flight_group.Forget(key);
+  return ok;
+}
+
+// The most times a record changed by others at the same time is read and
+// swapped again
+const int kMaxSwapAttempts = 100;
+
+// Set `key` to `value` if its value is still `expected`
+// An empty `expected` matches a key that does not exist. Whether `key` has
+// been set will be set to `swapped`, and if it has not, its current value
+// will be set to `expected` to try again with.
+// returns true if this operation succeeds
+// returns false otherwise
+bool SwapValue(const std::string &key, const std::string &value,
+               std::string *const expected, bool *const swapped) {
+  std::string current;
+  bool ok = chirp_connect_backend::backend_client_->SendCompareAndSwapRequest(
+      key, *expected, value, swapped, &current);
+  single_flight_group.Forget(key);
+  if (ok && !*swapped) {
+    *expected = current;
+  }
+  return ok;
+}
+
+// Update the record stored as `key` with `update` and swap it in
+// The record is read into a copy of `empty`, which is also what a missing
+// key is read as, and `update` returns false to leave it as it is. If
+// others change the record meanwhile, `update` is applied again to what they
+// have stored, so that no update is lost. Whether the record has been
+// changed will be set to `updated` if it is not nullptr.
+// returns true if this operation succeeds
+// returns false otherwise
+template <typename Record>
+bool UpdateRecord(const std::string &key, const Record &empty,
+                  const std::function<bool(Record *const)> &update,
+                  bool *const updated = nullptr) {
+  std::string binary;
+  if (!GetValue(key, &binary)) {
+    return false;
+  }
+
+  if (updated != nullptr) {
+    *updated = false;
+  }
+  for (int i = 0; i < kMaxSwapAttempts; ++i) {
+    Record record(empty);
+    record.ImportBinary(binary);
+    if (!update(&record)) {
+      return true;
+    }
+    bool swapped;
+    if (!SwapValue(key, record.ExportBinary(), &binary, &swapped)) {
+      return false;
+    }
+    if (swapped) {
+      if (updated != nullptr) {
+        *updated = true;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// A list of chirp ids stored in chunks of at most
+// `ServiceDataStructure::UserChirpList::kChunkSize` ids
+// The head record is kept under `head_key` and the chunk with index `i` under
+// `chunk_prefix` + the binary of `i` + `name`, so that the keys of different
+// chunks never collide whatever `name` is.
+class ChunkedIdList {
+ public:
+  ChunkedIdList(const std::string &head_key, const std::string &chunk_prefix,
+                const std::string &name)
+      : head_key_(head_key), chunk_prefix_(chunk_prefix), name_(name) {}
+
+  // Append `id` to the end of the list
+  // A slot is reserved by swapping the head, and `id` is then swapped into
+  // its chunk, so that concurrent appends to the same list never overwrite
+  // each other. The chunk it lands in is kept as its hint for `Remove`.
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool Append(const uint64_t &id) {
+    std::string binary;
+    if (!GetValue(head_key_, &binary)) {
+      return false;
+    }
+
+    ServiceData::ChunkedListHead head;
+    bool swapped = false;
+    for (int i = 0; i < kMaxSwapAttempts && !swapped; ++i) {
+      if (!head.ParseFromString(binary)) {
+        return false;
+      }
+      if (head.num_of_chunks() == 0 ||
+          head.last_chunk_size() >=
+              ServiceDataStructure::UserChirpList::kChunkSize) {
+        // Start a new chunk without reading the full one
+        head.set_num_of_chunks(head.num_of_chunks() + 1);
+        head.set_last_chunk_size(0);
+      }
+      head.set_last_chunk_size(head.last_chunk_size() + 1);
+      head.set_size(head.size() + 1);
+      if (!SwapValue(head_key_, head.SerializeAsString(), &binary,
+                     &swapped)) {
+        return false;
+      }
+    }
+    if (!swapped) {
+      return false;
+    }
+
+    uint64_t index = head.num_of_chunks() - 1;
+    uint64_t offset = head.last_chunk_size() - 1;
+    return SwapInChunk(index, [&](std::vector<uint64_t> *const chunk) {
+             // The slots before it may not have been written yet
+             if (chunk->size() <= offset) {
+               chunk->resize(offset + 1, 0);
+             }
+             (*chunk)[offset] = id;
+             return true;
+           }) &&
+           PutValue(HintKey(id), Uint64ToBinary(index));
+  }
+
+  // Remove `id` from the list by leaving 0 in its place, so that the
+  // positions of the other ids do not move under the readers' cursors
+  // Only the chunk in the hint of `id` is read. The chunks are searched
+  // from the newest one only for the ids appended before hints were kept.
+  // returns true if this operation succeeds or `id` is not in the list
+  // returns false otherwise
+  bool Remove(const uint64_t &id) {
+    std::string hint;
+    if (!GetValue(HintKey(id), &hint)) {
+      return false;
+    }
+    bool found = false;
+    auto clear = [&](std::vector<uint64_t> *const chunk) {
+      auto it = std::find(chunk->begin(), chunk->end(), id);
+      found = it != chunk->end();
+      if (found) {
+        *it = 0;
+      }
+      return found;
+    };
+
+    if (hint.size() == sizeof(uint64_t) &&
+        !SwapInChunk(BinaryToUint64(hint), clear)) {
+      return false;
+    }
+    if (!found) {
+      ServiceData::ChunkedListHead head;
+      if (!GetHead(&head)) {
+        return false;
+      }
+      for (uint64_t index = head.num_of_chunks(); index > 0 && !found;
+           --index) {
+        if (!SwapInChunk(index - 1, clear)) {
+          return false;
+        }
+      }
+      if (!found) {
+        return true;
+      }
+    }
+
+    return SwapHead([](ServiceData::ChunkedListHead *const head) {
+             head->set_size(head->size() - 1);
+           }) &&
+           DeleteValue(HintKey(id));
+  }
+
+  // Read the whole list into `ids`, in the order the ids were appended
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool ReadAll(std::vector<uint64_t> *const ids) {
+    ServiceData::ChunkedListHead head;
+    if (!GetHead(&head)) {
+      return false;
+    }
+    if (head.num_of_chunks() == 0) {
+      return true;
+    }
+
+    // All the chunks are read in one request
+    std::vector<std::string> keys;
+    for (uint64_t index = 0; index < head.num_of_chunks(); ++index) {
+      keys.push_back(ChunkKey(index));
+    }
+    std::vector<std::string> reply;
+    bool ok =
+        chirp_connect_backend::backend_client_->SendGetRequest(keys, &reply);
+    if (!ok) {
+      return false;
+    }
+
+    for (const auto &binary : reply) {
+      std::vector<uint64_t> chunk;
+      if (!ParseChirpIds(binary, &chunk)) {
+        return false;
+      }
+      std::copy_if(chunk.begin(), chunk.end(), std::back_inserter(*ids),
+                   [](const uint64_t &id) { return id != 0; });
+    }
+    return true;
+  }
+
+  // Read at most `max_ids` ids before `cursor` into `ids`, newest first, and
+  // move `cursor` past them
+  // returns true if this operation succeeds
+  // returns false if it fails or `cursor` is not a position in the list
+  bool ReadPage(const size_t &max_ids,
+                ServiceDataStructure::UserChirpList::Cursor *const cursor,
+                std::vector<uint64_t> *const ids) {
+    ServiceData::ChunkedListHead head;
+    if (!GetHead(&head)) {
+      return false;
+    }
+    if (cursor->chunk_index == UINT64_MAX) {
+      // Start from the newest end of the list
+      cursor->chunk_index =
+          head.num_of_chunks() > 0 ? head.num_of_chunks() - 1 : 0;
+      cursor->offset = head.num_of_chunks() > 0 ? head.last_chunk_size() : 0;
+    } else if (!IsPosition(head, *cursor)) {
+      // A cursor from a client could make this walk chunks that do not exist
+      return false;
+    }
+
+    size_t num_of_read = 0;
+    while (num_of_read < max_ids && !cursor->at_end()) {
+      if (cursor->offset == 0) {
+        // Move to the end of the previous chunk, which is always full
+        --cursor->chunk_index;
+        cursor->offset = ServiceDataStructure::UserChirpList::kChunkSize;
+      }
+
+      std::vector<uint64_t> chunk;
+      if (!GetChunk(cursor->chunk_index, &chunk)) {
+        return false;
+      }
+      uint64_t offset = std::min<uint64_t>(cursor->offset, chunk.size());
+      for (; offset > 0 && num_of_read < max_ids; --offset) {
+        if (chunk[offset - 1] != 0) {
+          ids->push_back(chunk[offset - 1]);
+          ++num_of_read;
+        }
+      }
+      cursor->offset = offset;
+    }
+    return true;
+  }
+
+  // Read whether `cursor` is a position in the list into `valid`
+  // The default cursor, at the newest end, is always one.
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool CheckCursor(const ServiceDataStructure::UserChirpList::Cursor &cursor,
+                   bool *const valid) {
+    ServiceData::ChunkedListHead head;
+    if (!GetHead(&head)) {
+      return false;
+    }
+    *valid = cursor.chunk_index == UINT64_MAX || IsPosition(head, cursor);
+    return true;
+  }
+
+  // Read the number of ids in the list into `size`
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool GetSize(uint64_t *const size) {
+    ServiceData::ChunkedListHead head;
+    if (!GetHead(&head)) {
+      return false;
+    }
+    *size = head.size();
+    return true;
+  }
+
+  // Replace the whole list with `ids`
+  // The hints of the ids no longer in the list are deleted, and the ones of
+  // `ids` point to their new chunks.
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool Reset(const std::vector<uint64_t> &ids) {
+    ServiceData::ChunkedListHead old_head;
+    std::vector<uint64_t> old_ids;
+    if (!GetHead(&old_head) || !ReadAll(&old_ids)) {
+      return false;
+    }
+
+    const size_t kChunkSize = ServiceDataStructure::UserChirpList::kChunkSize;
+    ServiceData::ChunkedListHead head;
+    std::vector<uint64_t> chunk;
+    bool ok = true;
+    for (const uint64_t &id : ids) {
+      ok &= PutValue(HintKey(id), Uint64ToBinary(head.num_of_chunks()));
+      chunk.push_back(id);
+      if (chunk.size() == kChunkSize) {
+        ok &= PutChunk(head.num_of_chunks(), chunk);
+        head.set_num_of_chunks(head.num_of_chunks() + 1);
+        chunk.clear();
+      }
+    }
+    if (!chunk.empty()) {
+      ok &= PutChunk(head.num_of_chunks(), chunk);
+      head.set_num_of_chunks(head.num_of_chunks() + 1);
+    }
+    if (head.num_of_chunks() > 0) {
+      head.set_last_chunk_size(ids.size() -
+                               (head.num_of_chunks() - 1) * kChunkSize);
+    }
+    head.set_size(ids.size());
+    ok &= PutHead(head);
+
+    // Chunks beyond the new end are no longer used
+    for (uint64_t index = head.num_of_chunks();
+         index < old_head.num_of_chunks(); ++index) {
+      DeleteValue(ChunkKey(index));
+    }
+    std::set<uint64_t> kept(ids.begin(), ids.end());
+    for (const uint64_t &id : old_ids) {
+      if (kept.count(id) == 0) {
+        DeleteValue(HintKey(id));
+      }
+    }
+    return ok;
+  }
+
+  // Delete the head, all the chunks, and the hints of the list
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool Delete() {
+    ServiceData::ChunkedListHead head;
+    std::vector<uint64_t> ids;
+    if (!GetHead(&head) || !ReadAll(&ids)) {
+      return false;
+    }
+    for (const uint64_t &id : ids) {
+      DeleteValue(HintKey(id));
+    }
+    for (uint64_t index = 0; index < head.num_of_chunks(); ++index) {
+      DeleteValue(ChunkKey(index));
+    }
+    return DeleteValue(head_key_);
+  }
+
+ private:
+  // returns true if `cursor` is within the list `head` is the head of
+  static bool IsPosition(
+      const ServiceData::ChunkedListHead &head,
+      const ServiceDataStructure::UserChirpList::Cursor &cursor) {
+    if (cursor.at_end()) {
+      return true;
+    }
+    if (cursor.chunk_index >= head.num_of_chunks()) {
+      return false;
+    }
+    return cursor.offset <=
+           (cursor.chunk_index + 1 == head.num_of_chunks()
+                ? head.last_chunk_size()
+                : ServiceDataStructure::UserChirpList::kChunkSize);
+  }
 
-  UserFollowingList user_following_list;
-  bool ok = chirp_connect_backend::GetUserFollowingList(user_.get_username(),
-                                                        &user_following_list);
-  CHECK(ok) << "The user following list for user `" << user_.get_username()
-            << "` should exist.";
-
-  for (const auto &username : user_following_list) {
-    User user;
-    ok = chirp_connect_backend::GetUser(username, &user);
-    CHECK(ok) << "User `" << username << "` should exist.";
-
-    // to check if the `user.last_update_` is later or equal to the
-    // `from`
-    if (user.get_last_update() >= *from) {
-      // Do push_backs
-      UserChirpList user_chirp_list;
-      ok = chirp_connect_backend::GetUserChirpList(user.get_username(),
-                                                   &user_chirp_list);
-      CHECK(ok) << "The user chirp list for user `" << user_.get_username()
-                << "` should exist.";
-
-      for (const auto &chirp_id : user_chirp_list) {
-        Chirp chirp;
-        ok = chirp_connect_backend::GetChirp(chirp_id, &chirp);
-        CHECK(ok) << "The chirp with chirp_id `" << chirp_id
-                  << "` should exist.";
-
-        // to check if the `chirp.time` is later or equal to the `from` and
-        // `chirp.time` is earlier than `now`
-        if (chirp.get_time() >= *from && chirp.get_time() < now) {
-          ret.insert(chirp_id);
-        }
-      }
+  // A missing head is read as the one of an empty list
+  bool GetHead(ServiceData::ChunkedListHead *const head) {
+    std::string reply;
+    if (!GetValue(head_key_, &reply)) {
+      return false;
     }
+    return head->ParseFromString(reply);
   }
 
-  *from = now;
-  return ret;
-}
+  bool PutHead(const ServiceData::ChunkedListHead &head) {
+    std::string binary;
+    head.SerializeToString(&binary);
+    return PutValue(head_key_, binary);
+  }
 
-std::set<uint64_t> ServiceDataStructure::StreamFrom(
-    struct timeval *const from, const std::string& tag) {
-  struct timeval now;
-  gettimeofday(&now, nullptr);
+  bool GetChunk(const uint64_t &index, std::vector<uint64_t> *const chunk) {
+    std::string reply;
+    if (!GetValue(ChunkKey(index), &reply)) {
+      return false;
+    }
+    return ParseChirpIds(reply, chunk);
+  }
 
-  std::set<uint64_t> ret;
+  bool PutChunk(const uint64_t &index, const std::vector<uint64_t> &chunk) {
+    return PutValue(ChunkKey(index), SerializeChirpIds(chunk));
+  }
 
-  // get a list of tagged chirp
-  UserChirpList chirp_tag_list;
-  bool ok = chirp_connect_backend::GetChirpTagList(tag,
-                                               &chirp_tag_list);
-  for (const auto &chirp_id : chirp_tag_list) {
-    Chirp chirp;
-    ok = chirp_connect_backend::GetChirp(chirp_id, &chirp);
-    CHECK(ok) << "The chirp with chirp_id `" << chirp_id
-              << "` should exist.";
+  inline std::string ChunkKey(const uint64_t &index) const {
+    return chunk_prefix_ + Uint64ToBinary(index) + name_;
+  }
 
-    // to check if the `chirp.time` is later or equal to the `from` and
-    // `chirp.time` is earlier than `now`
-    if (chirp.get_time() >= *from && chirp.get_time() < now) {
-      ret.insert(chirp_id);
+  // Change the head by `update` until it is swapped in
+  bool SwapHead(
+      const std::function<void(ServiceData::ChunkedListHead *const)> &update) {
+    std::string binary;
+    if (!GetValue(head_key_, &binary)) {
+      return false;
     }
+    bool swapped = false;
+    for (int i = 0; i < kMaxSwapAttempts && !swapped; ++i) {
+      ServiceData::ChunkedListHead head;
+      if (!head.ParseFromString(binary)) {
+        return false;
+      }
+      update(&head);
+      if (!SwapValue(head_key_, head.SerializeAsString(), &binary,
+                     &swapped)) {
+        return false;
+      }
+    }
+    return swapped;
   }
-  *from = now;
-  return ret;
-}
 
-ServiceDataStructure::ReturnCodes ServiceDataStructure::UserRegister(
-    const std::string &username) {
-  // Invalid username
-  if (username.empty()) {
-    return INVALID_ARGUMENT;
+  // Change the chunk `index` by `update` until it is swapped in
+  // Nothing is written if `update` returns false.
+  bool SwapInChunk(
+      const uint64_t &index,
+      const std::function<bool(std::vector<uint64_t> *const)> &update) {
+    std::string binary;
+    if (!GetValue(ChunkKey(index), &binary)) {
+      return false;
+    }
+    bool swapped = false;
+    for (int i = 0; i < kMaxSwapAttempts && !swapped; ++i) {
+      std::vector<uint64_t> chunk;
+      if (!ParseChirpIds(binary, &chunk)) {
+        return false;
+      }
+      if (!update(&chunk)) {
+        return true;
+      }
+      if (!SwapValue(ChunkKey(index), SerializeChirpIds(chunk), &binary,
+                     &swapped)) {
+        return false;
+      }
+    }
+    return swapped;
   }
 
-  bool user_found = chirp_connect_backend::GetUser(username, nullptr);
-  if (user_found) {
-    return USER_EXISTS;
+  // The hint of `id` is the index of the chunk it has been appended to
+  // The head key comes last, so that hints of different lists never
+  // collide.
+  inline std::string HintKey(const uint64_t &id) const {
+    return kTypeChunkedListHintPrefix + Uint64ToBinary(id) + head_key_;
   }
 
-  // If the specified username has not been registered
-  User new_user(username);
-  UserChirpList chirp_list;
-  UserFollowingList following_list;
-  bool ok =
-      chirp_connect_backend::SaveUser(username, new_user) &&
-      chirp_connect_backend::SaveUserChirpList(username, chirp_list) &&
-      chirp_connect_backend::SaveUserFollowingList(username, following_list);
-  if (!ok) {
-    // if saving fails
-    chirp_connect_backend::DeleteUser(username);
-    chirp_connect_backend::DeleteUserChirpList(username);
-    chirp_connect_backend::DeleteUserFollowingList(username);
-    return INTERNAL_BACKEND_ERROR;
-  }
+  const std::string head_key_;
+  const std::string chunk_prefix_;
+  const std::string name_;
+};
 
-  return OK;
+// returns the stored chirp list of `username`
+ChunkedIdList UserChirpList(const std::string &username) {
+  return ChunkedIdList(kTypeUsernameToChirpPrefix + username,
+                       kTypeUsernameToChirpChunkPrefix, username);
 }
 
-std::unique_ptr<ServiceDataStructure::UserSession>
-ServiceDataStructure::UserLogin(const std::string &username) {
-  bool user_found = chirp_connect_backend::GetUser(username, nullptr);
-
-  if (!user_found) {
-    return nullptr;
-  }
-  // If the specified username is found
-  return std::unique_ptr<ServiceDataStructure::UserSession>(
-      new UserSession(username));
+// returns the stored chirp list with `tag`
+ChunkedIdList ChirpTagList(const std::string &tag) {
+  return ChunkedIdList(kTypeChirpTagPrefix + tag, kTypeChirpTagChunkPrefix,
+                       tag);
 }
 
-// Type identifier for serializing data
-const std::string kTypeNextChirpId({0, 0, 0, char(1)});
-const std::string kTypeUsernameToUserPrefix({0, 0, 0, char(2)});
-const std::string kTypeUsernameToFollowingPrefix({0, 0, 0, char(3)});
-const std::string kTypeUsernameToChirpPrefix({0, 0, 0, char(4)});
-const std::string kTypeChirpidToChirpPrefix({0, 0, 0, char(5)});
-const std::string kTypeChirpTagPrefix({0, 0, 0, char(6)});
-
-// Definition of `backend_client`
-// The default version for this will communicate through grpc
-std::unique_ptr<BackendClient> chirp_connect_backend::backend_client_(
-    new BackendClientStandard());
+// returns the stored chirps with the search term `term`
+ChunkedIdList SearchTermList(const std::string &term) {
+  return ChunkedIdList(kTypeSearchTermPrefix + term,
+                       kTypeSearchTermChunkPrefix, term);
+}
+}  // Anonymous namespace
 
 // Wrapper functions
+// Wrapper function to get the number of reads coalesced into another read
+uint64_t chirp_connect_backend::GetCollapsedRequestCount() {
+  return single_flight_group.get_collapsed_count();
+}
+
 // Wrapper function to get `next_chirp_id`
 uint64_t chirp_connect_backend::GetNextChirpId() {
+  if (chirp_connect_backend::chirp_id_generator_ != nullptr) {
+    return chirp_connect_backend::chirp_id_generator_->NextId();
+  }
+
+  uint64_t ret;
+  bool ok = chirp_connect_backend::LeaseChirpIds(1, &ret);
+  CHECK(ok) << "Leasing a chirp id should be successful.";
+  return ret;
+}
+
+// Wrapper function to reserve a range of chirp ids from the counter
+bool chirp_connect_backend::LeaseChirpIds(const uint64_t &count,
+                                          uint64_t *const first_id) {
+  // Other service servers may move the counter at the same time, so retry
+  // with the value they have set a few times
+  const int kMaxAttempts = 100;
+
   std::vector<std::string> reply;
   bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
       std::vector<std::string>({kTypeNextChirpId}), &reply);
-  CHECK(ok) << "Get request should be successful.";
+  if (!ok || reply.size() != 1) {
+    return false;
+  }
 
-  // Get the next chirp id from backend
-  uint64_t ret;
-  ServiceData::NowChirpId tmp;
-  if (!reply[0].empty()) {
-    tmp.ParseFromString(reply[0]);
-    ret = tmp.now_id();
-  } else {
-    // No previous chirps
-    ret = 0;
+  std::string expected = reply[0];
+  for (int i = 0; i < kMaxAttempts; ++i) {
+    // No previous chirps if the counter is empty
+    ServiceData::NowChirpId tmp;
+    if (!tmp.ParseFromString(expected)) {
+      return false;
+    }
+    uint64_t now_id = tmp.now_id();
+
+    // The ids up to `now_id` have been taken
+    tmp.set_now_id(now_id + count);
+    std::string binary;
+    tmp.SerializeToString(&binary);
+
+    bool swapped;
+    std::string current;
+    ok = chirp_connect_backend::backend_client_->SendCompareAndSwapRequest(
+        kTypeNextChirpId, expected, binary, &swapped, &current);
+    if (!ok) {
+      return false;
+    }
+    if (swapped) {
+      *first_id = now_id + 1;
+      return true;
+    }
+    expected = current;
   }
 
-  // update the next chirp id to the backend
-  ++ret;
-  tmp.set_now_id(ret);
-  std::string binary;
-  tmp.SerializeToString(&binary);
-  ok = chirp_connect_backend::backend_client_->SendPutRequest(kTypeNextChirpId,
-                                                              binary);
-  CHECK(ok) << "Put request should be successful.";
-  return ret;
+  return false;
 }
 
 // Wrapper function to get a specified user object
@@ -484,16 +2313,16 @@ bool chirp_connect_backend::GetUser(
     const std::string &username,
     ServiceDataStructure::User *const user) {
   std::string key = kTypeUsernameToUserPrefix + username;
-  std::vector<std::string> reply;
-  bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
-      std::vector<std::string>(1, key), &reply);
-  CHECK(ok) << "Get request should be successful.";
-  if (reply[0].empty()) {
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "Get request should be successful.";
+  if (reply.empty()) {
     return false;
   }
 
   if (user != nullptr) {
-    user->ImportBinary(reply[0]);
+    user->ImportBinary(reply);
   }
   return true;
 }
@@ -503,15 +2332,14 @@ bool chirp_connect_backend::SaveUser(
     const std::string &username,
     const ServiceDataStructure::User &user) {
   std::string key = kTypeUsernameToUserPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(
-      key, user.ExportBinary());
+  bool ok = PutValue(key, user.ExportBinary());
   return ok;
 }
 
 // Wrapper function to delete a specified user object
 bool chirp_connect_backend::DeleteUser(const std::string &username) {
   std::string key = kTypeUsernameToUserPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendDeleteKeyRequest(key);
+  bool ok = DeleteValue(key);
   return ok;
 }
 
@@ -520,16 +2348,15 @@ bool chirp_connect_backend::GetUserFollowingList(
     const std::string &username,
     ServiceDataStructure::UserFollowingList *const following_list) {
   std::string key = kTypeUsernameToFollowingPrefix + username;
-  std::vector<std::string> reply;
-  bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
-      std::vector<std::string>(1, key), &reply);
+  std::string reply;
+  bool ok = GetValue(key, &reply);
 
   if (!ok) {
     return false;
   }
 
   if (following_list != nullptr) {
-    following_list->ImportBinary(reply[0]);
+    following_list->ImportBinary(reply);
   }
   return true;
 }
@@ -539,16 +2366,176 @@ bool chirp_connect_backend::SaveUserFollowingList(
     const std::string &username,
     const ServiceDataStructure::UserFollowingList &following_list) {
   std::string key = kTypeUsernameToFollowingPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(
-      key, following_list.ExportBinary());
+  bool ok = PutValue(key, following_list.ExportBinary());
   return ok;
 }
 
+// Wrapper function to update the following list of a specified user
+bool chirp_connect_backend::UpdateUserFollowingList(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::UserFollowingList *const)>
+        &update) {
+  std::string key = kTypeUsernameToFollowingPrefix + username;
+  return UpdateRecord(key, ServiceDataStructure::UserFollowingList(), update);
+}
+
 // Wrapper function to delete the following list of a specified user
 bool chirp_connect_backend::DeleteUserFollowingList(
     const std::string &username) {
   std::string key = kTypeUsernameToFollowingPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendDeleteKeyRequest(key);
+  bool ok = DeleteValue(key);
+  return ok;
+}
+
+// Wrapper function to get the follower list of a specified user
+bool chirp_connect_backend::GetUserFollowerList(
+    const std::string &username,
+    ServiceDataStructure::UserFollowerList *const follower_list) {
+  std::string key = kTypeUsernameToFollowerPrefix + username;
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  // A missing list is read as an empty one
+  if (follower_list != nullptr) {
+    follower_list->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to save the follower list of a specified user
+bool chirp_connect_backend::SaveUserFollowerList(
+    const std::string &username,
+    const ServiceDataStructure::UserFollowerList &follower_list) {
+  std::string key = kTypeUsernameToFollowerPrefix + username;
+  bool ok = PutValue(key, follower_list.ExportBinary());
+  return ok;
+}
+
+// Wrapper function to update the follower list of a specified user
+bool chirp_connect_backend::UpdateUserFollowerList(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::UserFollowerList *const)>
+        &update) {
+  std::string key = kTypeUsernameToFollowerPrefix + username;
+  return UpdateRecord(key, ServiceDataStructure::UserFollowerList(), update);
+}
+
+// Wrapper function to delete the follower list of a specified user
+bool chirp_connect_backend::DeleteUserFollowerList(
+    const std::string &username) {
+  std::string key = kTypeUsernameToFollowerPrefix + username;
+  bool ok = DeleteValue(key);
+  return ok;
+}
+
+// Wrapper function to get the home timeline of a specified user
+bool chirp_connect_backend::GetHomeTimeline(
+    const std::string &username,
+    ServiceDataStructure::ChirpIndex *const timeline) {
+  std::string key = kTypeUsernameToHomeTimelinePrefix + username;
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  // A missing timeline is read as an empty one
+  if (timeline != nullptr) {
+    timeline->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to save the home timeline of a specified user
+bool chirp_connect_backend::SaveHomeTimeline(
+    const std::string &username,
+    const ServiceDataStructure::ChirpIndex &timeline) {
+  std::string key = kTypeUsernameToHomeTimelinePrefix + username;
+  bool ok = PutValue(key, timeline.ExportBinary());
+  return ok;
+}
+
+// Wrapper function to update the home timeline of a specified user
+bool chirp_connect_backend::UpdateHomeTimeline(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update) {
+  std::string key = kTypeUsernameToHomeTimelinePrefix + username;
+  return UpdateRecord(key, ServiceDataStructure::ChirpIndex(), update);
+}
+
+// Wrapper function to delete the home timeline of a specified user
+bool chirp_connect_backend::DeleteHomeTimeline(const std::string &username) {
+  std::string key = kTypeUsernameToHomeTimelinePrefix + username;
+  bool ok = DeleteValue(key);
+  return ok;
+}
+
+// Wrapper function to get the latest chirps posted by a specified user
+bool chirp_connect_backend::GetRecentChirps(
+    const std::string &username,
+    ServiceDataStructure::ChirpIndex *const timeline) {
+  std::string key = kTypeUsernameToRecentChirpsPrefix + username;
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  if (timeline != nullptr) {
+    timeline->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to update the latest chirps posted by a specified user
+bool chirp_connect_backend::UpdateRecentChirps(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update) {
+  std::string key = kTypeUsernameToRecentChirpsPrefix + username;
+  return UpdateRecord(key, ServiceDataStructure::ChirpIndex(), update);
+}
+
+// Wrapper function to save the latest chirps posted by a specified user
+bool chirp_connect_backend::SaveRecentChirps(
+    const std::string &username,
+    const ServiceDataStructure::ChirpIndex &timeline) {
+  std::string key = kTypeUsernameToRecentChirpsPrefix + username;
+  bool ok = PutValue(key, timeline.ExportBinary());
+  return ok;
+}
+
+// Wrapper function to get the users whose chirps are pulled
+bool chirp_connect_backend::GetPulledUsers(
+    ServiceDataStructure::PulledUserList *const pulled_users) {
+  std::string reply;
+  bool ok = GetValue(kTypePulledUsers, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  if (pulled_users != nullptr) {
+    pulled_users->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to update the users whose chirps are pulled
+bool chirp_connect_backend::UpdatePulledUsers(
+    const std::function<bool(ServiceDataStructure::PulledUserList *const)>
+        &update) {
+  return UpdateRecord(kTypePulledUsers, ServiceDataStructure::PulledUserList(),
+                      update);
+}
+
+// Wrapper function to save the users whose chirps are pulled
+bool chirp_connect_backend::SavePulledUsers(
+    const ServiceDataStructure::PulledUserList &pulled_users) {
+  bool ok = PutValue(kTypePulledUsers, pulled_users.ExportBinary());
   return ok;
 }
 
@@ -556,50 +2543,169 @@ bool chirp_connect_backend::DeleteUserFollowingList(
 bool chirp_connect_backend::GetUserChirpList(
     const std::string &username,
     ServiceDataStructure::UserChirpList *const chirp_list) {
-  std::string key = kTypeUsernameToChirpPrefix + username;
-  std::vector<std::string> reply;
-  bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
-      std::vector<std::string>(1, key), &reply);
+  std::vector<uint64_t> ids;
+  bool ok = UserChirpList(username).ReadAll(&ids);
   if (!ok) {
     return false;
   }
 
   if (chirp_list != nullptr) {
-    chirp_list->ImportBinary(reply[0]);
+    chirp_list->assign(std::move(ids));
   }
   return true;
 }
 
+// Wrapper funtion to get the chirp list with the `tag`
 bool chirp_connect_backend::GetChirpTagList(const std::string &tag,
                       ServiceDataStructure::UserChirpList *const chirp_list) {
-  std::string key = kTypeChirpTagPrefix + tag;
-  std::vector<std::string> reply;
-  bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
-      std::vector<std::string>(1, key), &reply);
+  std::vector<uint64_t> ids;
+  bool ok = ChirpTagList(tag).ReadAll(&ids);
   if (!ok) {
     return false;
   }
 
   if (chirp_list != nullptr) {
-    chirp_list->ImportBinary(reply[0]);
+    chirp_list->assign(std::move(ids));
   }
   return true;
 }
 
+// Wrapper function to read a page of the chirp list of a specified user
+bool chirp_connect_backend::GetUserChirpPage(
+    const std::string &username, const size_t &max_ids,
+    ServiceDataStructure::UserChirpList::Cursor *const cursor,
+    std::vector<uint64_t> *const ids) {
+  return UserChirpList(username).ReadPage(max_ids, cursor, ids);
+}
+
+// Wrapper function to read a page of the chirp list with the `tag`
+bool chirp_connect_backend::GetChirpTagPage(
+    const std::string &tag, const size_t &max_ids,
+    ServiceDataStructure::UserChirpList::Cursor *const cursor,
+    std::vector<uint64_t> *const ids) {
+  return ChirpTagList(tag).ReadPage(max_ids, cursor, ids);
+}
+
+// Wrapper function to append a chirp to the chirp list of a specified user
+bool chirp_connect_backend::AppendUserChirp(const std::string &username,
+                                            const uint64_t &chirp_id) {
+  return UserChirpList(username).Append(chirp_id);
+}
+
+// Wrapper function to append a chirp to the chirp list with the `tag`
+bool chirp_connect_backend::AppendChirpTag(const std::string &tag,
+                                           const uint64_t &chirp_id) {
+  return ChirpTagList(tag).Append(chirp_id);
+}
+
+// Wrapper function to remove a chirp from the chirp list of a specified user
+bool chirp_connect_backend::RemoveUserChirp(const std::string &username,
+                                            const uint64_t &chirp_id) {
+  return UserChirpList(username).Remove(chirp_id);
+}
+
+// Wrapper function to get the number of chirps with the search term `term`
+bool chirp_connect_backend::GetSearchTermSize(const std::string &term,
+                                              uint64_t *const size) {
+  return SearchTermList(term).GetSize(size);
+}
+
+// Wrapper function to read a page of the chirps with the search term `term`
+bool chirp_connect_backend::GetSearchTermPage(
+    const std::string &term, const size_t &max_ids,
+    ServiceDataStructure::UserChirpList::Cursor *const cursor,
+    std::vector<uint64_t> *const ids) {
+  return SearchTermList(term).ReadPage(max_ids, cursor, ids);
+}
+
+// Wrapper function to check a cursor into the chirps with the search term
+// `term`
+bool chirp_connect_backend::CheckSearchTermCursor(
+    const std::string &term,
+    const ServiceDataStructure::UserChirpList::Cursor &cursor,
+    bool *const valid) {
+  return SearchTermList(term).CheckCursor(cursor, valid);
+}
+
+// Wrapper function to add a chirp to the chirps with the search term `term`
+bool chirp_connect_backend::AppendSearchTerm(const std::string &term,
+                                             const uint64_t &chirp_id) {
+  return SearchTermList(term).Append(chirp_id);
+}
+
+// Wrapper function to remove a chirp from the chirps with the search term
+bool chirp_connect_backend::RemoveSearchTerm(const std::string &term,
+                                             const uint64_t &chirp_id) {
+  return SearchTermList(term).Remove(chirp_id);
+}
+
 // Wrapper function to save the chirp list of a specified user
 bool chirp_connect_backend::SaveUserChirpList(
     const std::string &username,
     const ServiceDataStructure::UserChirpList &chirp_list) {
-  std::string key = kTypeUsernameToChirpPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(
-      key, chirp_list.ExportBinary());
-  return ok;
+  return UserChirpList(username).Reset(chirp_list.get_ids());
 }
 
 // Wrapper function to delete the chirp list of a specified user
 bool chirp_connect_backend::DeleteUserChirpList(const std::string &username) {
-  std::string key = kTypeUsernameToChirpPrefix + username;
-  bool ok = chirp_connect_backend::backend_client_->SendDeleteKeyRequest(key);
+  return UserChirpList(username).Delete();
+}
+
+// Wrapper function to get a time bucket of the chirps with the `tag`
+bool chirp_connect_backend::GetTagBucket(
+    const std::string &tag, const uint64_t &bucket,
+    ServiceDataStructure::ChirpIndex *const chirps) {
+  std::string key = kTypeChirpTagBucketPrefix + Uint64ToBinary(bucket) + tag;
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  if (chirps != nullptr) {
+    chirps->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to get the time buckets of the chirps with the `tag` from
+// `first` to `last`
+bool chirp_connect_backend::GetTagBuckets(
+    const std::string &tag, const uint64_t &first, const uint64_t &last,
+    std::vector<ServiceDataStructure::ChirpIndex> *const chirps) {
+  std::vector<std::string> keys;
+  for (uint64_t bucket = first; bucket <= last; ++bucket) {
+    keys.push_back(kTypeChirpTagBucketPrefix + Uint64ToBinary(bucket) + tag);
+  }
+  std::vector<std::string> reply;
+  bool ok =
+      chirp_connect_backend::backend_client_->SendGetRequest(keys, &reply);
+  if (!ok || reply.size() != keys.size()) {
+    return false;
+  }
+
+  for (const auto &value : reply) {
+    chirps->emplace_back(SIZE_MAX);
+    chirps->back().ImportBinary(value);
+  }
+  return true;
+}
+
+// Wrapper function to update a time bucket of the chirps with the `tag`
+bool chirp_connect_backend::UpdateTagBucket(
+    const std::string &tag, const uint64_t &bucket,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update) {
+  std::string key = kTypeChirpTagBucketPrefix + Uint64ToBinary(bucket) + tag;
+  return UpdateRecord(key, ServiceDataStructure::ChirpIndex(SIZE_MAX), update);
+}
+
+// Wrapper function to save a time bucket of the chirps with the `tag`
+bool chirp_connect_backend::SaveTagBucket(
+    const std::string &tag, const uint64_t &bucket,
+    const ServiceDataStructure::ChirpIndex &chirps) {
+  std::string key = kTypeChirpTagBucketPrefix + Uint64ToBinary(bucket) + tag;
+  bool ok = PutValue(key, chirps.ExportBinary());
   return ok;
 }
 
@@ -607,16 +2713,40 @@ bool chirp_connect_backend::DeleteUserChirpList(const std::string &username) {
 bool chirp_connect_backend::GetChirp(
     const uint64_t &chirp_id, ServiceDataStructure::Chirp *const chirp) {
   std::string key = kTypeChirpidToChirpPrefix + Uint64ToBinary(chirp_id);
-  std::vector<std::string> reply;
-  bool ok = chirp_connect_backend::backend_client_->SendGetRequest(
-      std::vector<std::string>(1, key), &reply);
-  CHECK(ok) << "Get request should be successful.";
-  if (reply[0].empty()) {
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "Get request should be successful.";
+  if (reply.empty()) {
     return false;
   }
 
   if (chirp != nullptr) {
-    chirp->ImportBinary(reply[0]);
+    chirp->ImportBinary(reply);
+  }
+  return true;
+}
+
+// Wrapper function to get chirps in one batch
+bool chirp_connect_backend::GetChirps(
+    const std::vector<uint64_t> &chirp_ids,
+    std::map<uint64_t, ServiceDataStructure::Chirp> *const chirps) {
+  std::vector<std::string> keys;
+  for (const uint64_t &chirp_id : chirp_ids) {
+    keys.push_back(kTypeChirpidToChirpPrefix + Uint64ToBinary(chirp_id));
+  }
+  std::vector<std::string> reply;
+  bool ok =
+      chirp_connect_backend::backend_client_->SendGetRequest(keys, &reply);
+  if (!ok || reply.size() != keys.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < reply.size(); ++i) {
+    // A missing chirp is read as an empty value
+    if (!reply[i].empty()) {
+      (*chirps)[chirp_ids[i]].ImportBinary(reply[i]);
+    }
   }
   return true;
 }
@@ -625,22 +2755,61 @@ bool chirp_connect_backend::GetChirp(
 bool chirp_connect_backend::SaveChirp(
     const uint64_t &chirp_id, const ServiceDataStructure::Chirp &chirp) {
   std::string key = kTypeChirpidToChirpPrefix + Uint64ToBinary(chirp_id);
-  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(
-      key, chirp.ExportBinary());
+  bool ok = PutValue(key, chirp.ExportBinary());
   return ok;
 }
 
 // Wrapper function to delete a chirp
 bool chirp_connect_backend::DeleteChirp(const uint64_t &chirp_id) {
   std::string key = kTypeChirpidToChirpPrefix + Uint64ToBinary(chirp_id);
-  bool ok = chirp_connect_backend::backend_client_->SendDeleteKeyRequest(key);
+  bool ok = DeleteValue(key);
   return ok;
 }
 
-bool chirp_connect_backend::SaveChirpTag(const std::string& tag,     
+// Wrapper function to get the shape of a thread
+bool chirp_connect_backend::GetThread(
+    const uint64_t &root_id, ServiceDataStructure::Thread *const thread) {
+  std::string key = kTypeChirpidToThreadPrefix + Uint64ToBinary(root_id);
+  std::string reply;
+  bool ok = GetValue(key, &reply);
+  if (!ok) {
+    return false;
+  }
+
+  thread->ImportBinary(reply);
+  return true;
+}
+
+// Wrapper function to change the shape of a thread
+bool chirp_connect_backend::UpdateThread(
+    const uint64_t &root_id,
+    const std::function<bool(ServiceDataStructure::Thread *const)> &update,
+    bool *const updated) {
+  std::string key = kTypeChirpidToThreadPrefix + Uint64ToBinary(root_id);
+  std::string binary;
+  if (!GetValue(key, &binary)) {
+    return false;
+  }
+
+  *updated = false;
+  for (int i = 0; i < kMaxSwapAttempts; ++i) {
+    ServiceDataStructure::Thread thread;
+    thread.ImportBinary(binary);
+    if (!update(&thread)) {
+      return true;
+    }
+    if (!SwapValue(key, thread.ExportBinary(), &binary, updated)) {
+      return false;
+    }
+    if (*updated) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Wrapper function to save the chirp list with the `tag`
+bool chirp_connect_backend::SaveChirpTag(const std::string& tag,
   const ServiceDataStructure::UserChirpList &chirp_tag_list) {
-  std::string key = kTypeChirpTagPrefix + tag;
-  bool ok = chirp_connect_backend::backend_client_->SendPutRequest(
-      key, chirp_tag_list.ExportBinary());
-  return ok;
+  return ChirpTagList(tag).Reset(chirp_tag_list.get_ids());
 }
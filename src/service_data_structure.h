@@ -4,6 +4,8 @@
 #include <sys/time.h>
 #include <climits>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
 #include <set>
@@ -14,7 +16,9 @@
 #include <glog/logging.h>
 
 #include "backend_client_lib.h"
+#include "chirp_id_generator.h"
 #include "service_data.pb.h"
+#include "trending_tags.h"
 #include "utility.h"
 
 // The data structure for the service layer
@@ -38,6 +42,38 @@ class ServiceDataStructure {
     UNKOWN_ERROR = INT_MAX
   };
 
+  // The default number of followers above which a user's chirps are pulled
+  // by the followers instead of being pushed to them
+  static const size_t kDefaultFanOutThreshold = 10000;
+
+  // The chirps with a tag are indexed in buckets of this many seconds by the
+  // time they are posted, so that streaming a tag reads only the buckets of
+  // the time being streamed
+  static const time_t kTagBucketSeconds = 10;
+  // Streaming a tag from further back than this many seconds ago reads the
+  // chirps of the last this many seconds only
+  static const time_t kMaxBackfillSeconds = 3600;
+
+  // The default half-life of the uses of tags counted for trending tags
+  static const time_t kDefaultTrendingHalfLifeSeconds = 600;
+  // The most trending tags that can be asked for
+  static const size_t kMaxTrendingTags = 100;
+
+  // The number of chirps in a page of search results if not specified, and
+  // the most that can be asked for
+  static const size_t kDefaultSearchResults = 20;
+  static const size_t kMaxSearchResults = 100;
+
+  // Users with more than `fan_out_threshold` followers are not pushed to the
+  // home timelines of their followers. Their latest chirps are pulled and
+  // merged when the followers read their feeds instead.
+  // A use of a tag counts half as much for trending tags after
+  // `trending_half_life_seconds`.
+  explicit ServiceDataStructure(
+      const size_t &fan_out_threshold = kDefaultFanOutThreshold,
+      const time_t &trending_half_life_seconds =
+          kDefaultTrendingHalfLifeSeconds);
+
   class User {
    public:
     // Constructor that initializes the `username`.
@@ -88,14 +124,126 @@ class ServiceDataStructure {
     const std::string ExportBinary() const;
   };
 
-  // This inherits from set<uint64_t>. Use protobuf only on deserialization and
-  // serialization.
-  class UserChirpList : public std::set<uint64_t> {
+  // The users following a user, and the users whose chirps are pulled, share
+  // the same representation as the users a user follows
+  typedef UserFollowingList UserFollowerList;
+  typedef UserFollowingList PulledUserList;
+
+  // Chirps ordered by (time, id), oldest first
+  // This serves as the home timeline of a user, which the chirps of the
+  // following users are pushed to, as the index of the latest chirps posted
+  // by a user, and as a time bucket of the chirps with a tag. Only the latest
+  // `max_length` chirps are kept.
+  class ChirpIndex {
    public:
+    static const size_t kMaxLength = 800;
+
+    struct Entry {
+      uint64_t chirp_id;
+      struct timeval time;
+    };
+
+    // A position in the (time, id) order
+    // A poller keeping the cursor of the last chirp it has seen reads only
+    // the chirps after it.
+    struct Cursor {
+      struct timeval time;
+      uint64_t chirp_id;
+    };
+
+    // returns the cursor right before the chirps posted at `time`
+    static Cursor CursorAt(const struct timeval &time);
+
+    // returns the cursor at `entry`
+    static Cursor CursorOf(const Entry &entry);
+
+    // returns true if `entry` is after `cursor` in the (time, id) order
+    static bool IsAfter(const Entry &entry, const Cursor &cursor);
+
+    // Serialization of a cursor, e.g. to be handed to a client
+    static std::string ExportCursor(const Cursor &cursor);
+    // Deserialization of a cursor
+    // returns true if `input` is a cursor exported by `ExportCursor`
+    static bool ImportCursor(const std::string &input, Cursor *const cursor);
+
+    explicit ChirpIndex(const size_t &max_length = kMaxLength);
+
     // Deserialization
     void ImportBinary(const std::string &input);
     // Serialization
     const std::string ExportBinary() const;
+
+    // Insert a chirp posted at `time`
+    // The oldest chirps are dropped if there are more than `max_length`.
+    void Insert(const uint64_t &chirp_id, const struct timeval &time);
+
+    // returns the chirps after `cursor`, oldest first
+    std::vector<Entry> Since(const Cursor &cursor) const;
+
+    // Merge the chirps after `since` in `indexes`
+    // This walks the indexes from their latest chirps at the same time and
+    // stops after the latest `max_entries` distinct chirps.
+    // returns the merged chirps, oldest first
+    static std::vector<Entry> Merge(
+        const std::vector<const ChirpIndex *> &indexes, const Cursor &since,
+        const size_t &max_entries);
+
+    inline size_t size() const { return entries_.size(); }
+
+   private:
+    size_t max_length_;
+    std::deque<Entry> entries_;
+  };
+
+  // This keeps chirp ids sorted without duplicates in a flat vector, which
+  // takes a fraction of the memory of a node per id. Ids are serialized with
+  // `chirp_id_codec`.
+  // In the backend, a list is stored in chunks of at most `kChunkSize` ids
+  // under keys of their own plus a small head record, so that appending to it
+  // touches only the head and the last chunk however long the list is.
+  class UserChirpList {
+   public:
+    typedef std::vector<uint64_t>::const_iterator const_iterator;
+
+    static const size_t kChunkSize = 256;
+
+    // A position in a stored list for reading it page by page, newest first
+    // The ids before `offset` in the chunk `chunk_index` have not been read.
+    // The default one is at the newest end of the list.
+    struct Cursor {
+      uint64_t chunk_index = UINT64_MAX;
+      uint64_t offset = 0;
+
+      // returns true if all the ids have been read
+      inline bool at_end() const { return chunk_index == 0 && offset == 0; }
+    };
+
+    // Deserialization
+    void ImportBinary(const std::string &input);
+    // Serialization
+    const std::string ExportBinary() const;
+
+    // Replace the ids in this list with `ids` in any order
+    void assign(std::vector<uint64_t> ids);
+
+    // returns true if `id` has been inserted
+    // returns false if it is already in this list
+    bool insert(const uint64_t &id);
+    // returns the number of ids erased
+    size_t erase(const uint64_t &id);
+    // returns the number of `id` in this list
+    size_t count(const uint64_t &id) const;
+
+    inline const_iterator begin() const { return ids_.begin(); }
+    inline const_iterator end() const { return ids_.end(); }
+    inline size_t size() const { return ids_.size(); }
+    inline bool empty() const { return ids_.empty(); }
+    inline void clear() { ids_.clear(); }
+    inline void swap(UserChirpList &other) { ids_.swap(other.ids_); }
+    inline const std::vector<uint64_t> &get_ids() const { return ids_; }
+
+   private:
+    std::vector<uint64_t> ids_;
   };
 
   class Chirp {
@@ -115,10 +263,16 @@ class ServiceDataStructure {
       chirp_.set_username(username);
     }
     inline const uint64_t get_parent_id() const { return chirp_.parent_id(); }
+    // The first chirp of the thread of this chirp
+    // 0 for the chirps posted before the shapes of threads were stored
+    inline const uint64_t get_root_id() const { return chirp_.root_id(); }
+    inline void set_root_id(const uint64_t &id) { chirp_.set_root_id(id); }
     inline const std::string &get_text() const { return chirp_.text(); }
     inline void set_text(const std::string &text) { chirp_.set_text(text); }
     inline const struct timeval &get_time() const { return time_; }
-    inline const std::set<uint64_t> &get_children_ids() const {
+    // The replies to this chirp are recorded in its `Thread` instead. These
+    // are only read to put together the threads posted before that.
+    inline const UserChirpList &get_children_ids() const {
       return children_ids_;
     }
     inline void insert_children_id(const uint64_t &id) {
@@ -132,7 +286,99 @@ class ServiceDataStructure {
     ServiceData::Chirp chirp_;
     // The timestamp of this chirp
     struct timeval time_;
-    std::set<uint64_t> children_ids_;
+    UserChirpList children_ids_;
+  };
+
+  // The shape of a thread: the chirps replying to its first chirp, directly
+  // or not, in pre-order, i.e. each chirp is followed by its replies in the
+  // order they were posted, each followed by its own replies
+  // This is stored once per thread under the id of its first chirp, so the
+  // shape of a thread is read at once and a reply does not rewrite the chirp
+  // it replies to. A deleted chirp is kept in place and marked, so that its
+  // replies can still be read from them.
+  // A reply rewrites the whole shape, so a thread is kept to `kMaxSize`
+  // chirps. A reply to a full thread starts a thread of its own, which is
+  // read from it rather than from the thread it replies to.
+  class Thread {
+   public:
+    static const size_t kMaxSize = 1024;
+
+    struct Entry {
+      uint64_t chirp_id;
+      uint64_t parent_id;
+      // 0 for the first chirp of the thread
+      uint32_t depth;
+      bool deleted;
+    };
+
+    // Deserialization
+    void ImportBinary(const std::string &input);
+    // Serialization
+    const std::string ExportBinary() const;
+
+    // Append `entry` to the end
+    // Entries should be appended in pre-order.
+    void Append(const Entry &entry);
+
+    // Insert the chirp `chirp_id` replying to `parent_id` after the other
+    // replies to it
+    // returns true if this operation succeeds
+    // returns false if `parent_id` is not in this thread
+    bool InsertReply(const uint64_t &chirp_id, const uint64_t &parent_id);
+
+    // Mark the chirp `chirp_id` as deleted
+    // returns true if this operation succeeds
+    // returns false if `chirp_id` is not in this thread
+    bool Remove(const uint64_t &chirp_id);
+
+    // returns the position of the chirp `chirp_id`, or `size()` if it is not
+    // in this thread
+    size_t Find(const uint64_t &chirp_id) const;
+
+    // returns the position right after the replies to the chirp at
+    // `position`, directly or not
+    size_t SubtreeEnd(const size_t &position) const;
+
+    inline const std::vector<Entry> &get_entries() const { return entries_; }
+    inline size_t size() const { return entries_.size(); }
+    inline bool empty() const { return entries_.empty(); }
+
+   private:
+    std::vector<Entry> entries_;
+  };
+
+  // A query on tags, such as `#a AND #b` or `#a OR #c -#d`
+  // A query is clauses joined by `OR`. A clause is terms joined by `AND` or
+  // just by spaces, where a term is `#tag` for the chirps with the tag or
+  // `-#tag` for the chirps without it. `AND` binds tighter than `OR`. Every
+  // clause needs a term that is not negated.
+  class TagQuery {
+   public:
+    struct Clause {
+      std::vector<std::string> tags;
+      std::vector<std::string> excluded_tags;
+    };
+
+    // Parse `input` into `query`
+    // returns true if this operation succeeds
+    // returns false if `input` is not a valid query
+    static bool Parse(const std::string &input, TagQuery *const query);
+
+    // returns every tag in this query
+    std::set<std::string> GetTags() const;
+
+    // Evaluate this query on `postings`, which maps every tag in this query
+    // to the ids of the chirps with it, sorted
+    // The lists are intersected from the shortest one with galloping search,
+    // so a rare tag costs little however common the tags with it are.
+    // returns the sorted ids of the chirps matching this query
+    std::vector<uint64_t> Evaluate(
+        const std::map<std::string, std::vector<uint64_t>> &postings) const;
+
+    inline const std::vector<Clause> &get_clauses() const { return clauses_; }
+
+   private:
+    std::vector<Clause> clauses_;
   };
 
   // This user session is used for a user that has logged in
@@ -170,10 +416,22 @@ class ServiceDataStructure {
     ReturnCodes DeleteChirp(const uint64_t &id);
 
     // Monitor from a specified time to now
+    // This merges the home timeline of this user with the latest chirps of the
+    // following users whose chirps are pulled.
     // returns a set containing chirp ids
     // the `struct timeval` passing in will be changed to the current time
     std::set<uint64_t> MonitorFrom(struct timeval *const from);
 
+    // Monitor the chirps after `cursor`
+    // Only the chirps after `cursor` are read from the indexes, so polling
+    // with the returned cursor costs the number of new chirps.
+    // `cursor` will be moved to the last chirp set to `chirp_ids`, oldest
+    // first.
+    // returns OK if this operation succeeds
+    // returns other return codes otherwise
+    ReturnCodes MonitorSince(ChirpIndex::Cursor *const cursor,
+                             std::vector<uint64_t> *const chirp_ids);
+
     // This returns the username
     inline const std::string &SessionGetUsername() {
       return this->user_.get_username();
@@ -188,14 +446,34 @@ class ServiceDataStructure {
    private:
     // Private constructor
     // This initializes the member data `user_`
-    UserSession(const std::string &username);
+    UserSession(const std::string &username,
+                ServiceDataStructure *const service);
 
     // Befriend with `ServiceDataStructure`
     // so that it can call its constructor
     friend class ServiceDataStructure;
 
+    // Set `feed` to the chirps after `since` in the home timeline of this
+    // user and in the indexes of the following users whose chirps are pulled
+    // returns true if this operation succeeds
+    // returns false otherwise
+    bool CollectFeed(const ChirpIndex::Cursor &since,
+                     std::vector<ChirpIndex::Entry> *const feed);
+
+    // Add `username` to the pulled users if it has more followers than the
+    // fan-out threshold now, or remove it otherwise
+    // This is called only when a follow or an unfollow crosses the
+    // threshold, so that posts never touch the list shared by all users. A
+    // user removed has its latest chirps pushed to its followers first,
+    // since the ones posted while it was pulled have never been pushed.
+    // returns true if this operation succeeds
+    // returns false otherwise
+    bool UpdatePulledUsers(const std::string &username);
+
     // The `User` that logs in in this session
     User user_;
+    // The data structure that creates this session
+    ServiceDataStructure *const service_;
   };
 
   // User register operation
@@ -213,19 +491,148 @@ class ServiceDataStructure {
   // returns other return codes otherwise
   ReturnCodes ReadChirp(const uint64_t &id, Chirp *const chirp);
 
+  // Read the chirps `ids` in one request to the backend
+  // The chirps are appended to `chirps` in the order of `ids`, leaving out
+  // the ones that have been deleted.
+  // returns OK if this operation succeeds
+  // returns other return codes otherwise
+  ReturnCodes ReadChirps(const std::vector<uint64_t> &ids,
+                         std::vector<Chirp> *const chirps);
+
+  // returns the tags in `text` in the order they appear
+  // A tag is a `#` followed by anything up to the next space.
+  static std::vector<std::string> ParseTags(const std::string &text);
+
+  // returns the distinct words of `text` to be searched by, lowercased
+  // Words are runs of letters, digits, and non-ASCII bytes, so the tag
+  // `#word` is found by `word` as well.
+  static std::set<std::string> Tokenize(const std::string &text);
+
+  // Search the chirps containing every word in `query`, newest first
+  // The chirps are found through the inverted index of the rarest word in
+  // `query`, so a page costs the chirps it returns rather than the number of
+  // chirps posted. The other words are checked on the texts of the chirps
+  // found.
+  // `cursor` is where to start from, or empty for the first page. It will be
+  // moved past the chirps returned, or set to empty if there are no more.
+  // At most `max_results` chirp ids, or `kDefaultSearchResults` if it is 0,
+  // will be appended to `chirp_ids`, up to `kMaxSearchResults`. A page may
+  // have fewer even if `cursor` is not at the end, when the other words rule
+  // out many chirps.
+  // returns OK if this operation succeeds
+  // returns INVALID_ARGUMENT if `query` has no words or `cursor` is not one
+  // returned for `query`
+  // returns other return codes otherwise
+  ReturnCodes Search(const std::string &query, const size_t &max_results,
+                     std::string *const cursor,
+                     std::vector<uint64_t> *const chirp_ids);
+
+  // Read the thread of chirps replying to the chirp `id`, directly or not
+  // The chirps are appended to `thread` in pre-order: each chirp is followed
+  // by its replies in the order they were posted, each followed by its own
+  // replies. The shape of the thread is read in one request and the chirps
+  // in another, so this costs three round trips to the backend however deep
+  // and large the thread is. The shape is one record with an entry per
+  // chirp, though, so the bytes read grow with the thread.
+  // returns OK if this operation succeeds
+  // returns CHIRP_ID_NOT_FOUND if a chirp in the thread is not found
+  // returns other return codes otherwise
+  ReturnCodes ReadThread(const uint64_t &id, std::vector<Chirp> *const thread);
+
+  // Read a page of the thread of chirps replying to the chirp `id`
+  // This reads the thread in the same order as `ReadThread`, leaving out the
+  // replies deeper than `max_depth`, where the chirp `id` is at depth 0.
+  // At most `max_chirps` chirps will be appended to `thread`, which should
+  // be more than 0.
+  // `cursor` is where to start from, or empty for the first page. It will be
+  // moved past the chirps read, or set to empty at the end of the thread.
+  // It holds the path from the chirp `id` to the last chirp read. A page
+  // costs the same three round trips as `ReadThread` and reads only the
+  // chirps in it, but the whole shape of the thread. The replies to a chirp
+  // on the path that has been deleted since are skipped.
+  // The depths of the chirps will be appended to `depths` if it is given.
+  // returns OK if this operation succeeds
+  // returns INVALID_ARGUMENT if `cursor` is not one returned for `id`
+  // returns CHIRP_ID_NOT_FOUND if a chirp in the thread is not found
+  // returns other return codes otherwise
+  ReturnCodes ReadThreadPage(const uint64_t &id, const size_t &max_depth,
+                             const size_t &max_chirps,
+                             std::string *const cursor,
+                             std::vector<Chirp> *const thread,
+                             std::vector<size_t> *const depths = nullptr);
+
   // Stream `tag` from a specified time to now
+  // Only the time buckets from `from` to now are read, and none from before
+  // `kMaxBackfillSeconds` ago.
   // returns a set containing chirp ids
   // the `struct timeval` passing in will be changed to the current time
   std::set<uint64_t> StreamFrom(struct timeval *const from, const std::string& tag);
+
+  // Stream the chirps matching `query` from a specified time to now
+  // Each tag in `query` is read once however many times it appears.
+  // returns a set containing chirp ids
+  // the `struct timeval` passing in will be changed to the current time
+  std::set<uint64_t> StreamQueryFrom(struct timeval *const from,
+                                     const TagQuery &query);
+
+  // Stream the chirps with `tag` after `cursor`
+  // Only the time buckets from `cursor` to now are read, so a stream
+  // resuming after a short break reads only the chirps it has missed. They
+  // are read newest first, many in each request, and none from before
+  // `kMaxBackfillSeconds` ago. At most the latest `ChirpIndex::kMaxLength`
+  // chirps are set to `chirp_ids`, oldest first.
+  // `cursor` will be moved to the last chirp set.
+  // returns OK if this operation succeeds
+  // returns other return codes otherwise
+  ReturnCodes StreamSince(const std::string &tag,
+                          ChirpIndex::Cursor *const cursor,
+                          std::vector<uint64_t> *const chirp_ids);
+
+  // Stream the chirps matching `query` after `cursor`
+  // This reads the same buckets as `StreamSince` for each tag in `query`.
+  // `cursor` will be moved to the last chirp set to `chirp_ids`.
+  // returns OK if this operation succeeds
+  // returns other return codes otherwise
+  ReturnCodes StreamQuerySince(const TagQuery &query,
+                               ChirpIndex::Cursor *const cursor,
+                               std::vector<uint64_t> *const chirp_ids);
+
+  // Get the tags used the most recently on this server
+  // returns at most `count` tags and their decayed counts of uses, highest
+  // first
+  std::vector<std::pair<std::string, double>> GetTrendingTags(
+      const size_t &count);
+
+  inline size_t get_fan_out_threshold() const { return fan_out_threshold_; }
+
+ private:
+  const size_t fan_out_threshold_;
+  // The uses of tags in the chirps posted through this data structure
+  TrendingTags trending_tags_;
 };
 
 namespace chirp_connect_backend {
 // Declaration for the `BackendClient` object
 extern std::unique_ptr<BackendClient> backend_client_;
 
+// Wrapper function to get the number of reads that have been coalesced into
+// another in-flight read of the same key instead of going to the backend
+uint64_t GetCollapsedRequestCount();
+
+// Declaration for the generator of chirp ids
+// If this is nullptr, chirp ids are taken from the counter in the backend.
+extern std::unique_ptr<ChirpIdGenerator> chirp_id_generator_;
+
 // Wrapper function to get `next_chirp_id`
 uint64_t GetNextChirpId();
 
+// Wrapper function to reserve `count` chirp ids from the counter in the
+// backend in one atomic step
+// The first id of the range will be set to `first_id`.
+// returns true if this operation succeeds
+// returns false otherwise
+bool LeaseChirpIds(const uint64_t &count, uint64_t *const first_id);
+
 // Wrapper function to get a specified user object
 bool GetUser(const std::string &username,
              ServiceDataStructure::User *const user);
@@ -247,9 +654,85 @@ bool SaveUserFollowingList(
     const std::string &username,
     const ServiceDataStructure::UserFollowingList &following_list);
 
+// Wrapper function to update the following list of a specified user
+// `update` returns false to leave the list as it is. It is applied again to
+// what others have stored if they change the list at the same time.
+bool UpdateUserFollowingList(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::UserFollowingList *const)>
+        &update);
+
 // Wrapper function to delete the following list of a specified user
 bool DeleteUserFollowingList(const std::string &username);
 
+// Wrapper function to get the follower list of a specified user
+// A user without followers gets an empty list.
+bool GetUserFollowerList(
+    const std::string &username,
+    ServiceDataStructure::UserFollowerList *const follower_list);
+
+// Wrapper function to save the follower list of a specified user
+bool SaveUserFollowerList(
+    const std::string &username,
+    const ServiceDataStructure::UserFollowerList &follower_list);
+
+// Wrapper function to update the follower list of a specified user
+// This is applied the same way as `UpdateUserFollowingList`.
+bool UpdateUserFollowerList(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::UserFollowerList *const)>
+        &update);
+
+// Wrapper function to delete the follower list of a specified user
+bool DeleteUserFollowerList(const std::string &username);
+
+// Wrapper function to get the home timeline of a specified user
+// A user without a home timeline gets an empty one.
+bool GetHomeTimeline(const std::string &username,
+                     ServiceDataStructure::ChirpIndex *const timeline);
+
+// Wrapper function to save the home timeline of a specified user
+bool SaveHomeTimeline(const std::string &username,
+                      const ServiceDataStructure::ChirpIndex &timeline);
+
+// Wrapper function to update the home timeline of a specified user
+// This is applied the same way as `UpdateUserFollowingList`.
+bool UpdateHomeTimeline(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update);
+
+// Wrapper function to delete the home timeline of a specified user
+bool DeleteHomeTimeline(const std::string &username);
+
+// Wrapper function to get the latest chirps posted by a specified user
+// A user without chirps gets an empty timeline.
+bool GetRecentChirps(const std::string &username,
+                     ServiceDataStructure::ChirpIndex *const timeline);
+
+// Wrapper function to update the latest chirps posted by a specified user
+// This is applied the same way as `UpdateUserFollowingList`.
+bool UpdateRecentChirps(
+    const std::string &username,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update);
+
+// Wrapper function to save the latest chirps posted by a specified user
+bool SaveRecentChirps(const std::string &username,
+                      const ServiceDataStructure::ChirpIndex &timeline);
+
+// Wrapper function to get the users whose chirps are pulled
+bool GetPulledUsers(ServiceDataStructure::PulledUserList *const pulled_users);
+
+// Wrapper function to update the users whose chirps are pulled
+// This is applied the same way as `UpdateUserFollowingList`.
+bool UpdatePulledUsers(
+    const std::function<bool(ServiceDataStructure::PulledUserList *const)>
+        &update);
+
+// Wrapper function to save the users whose chirps are pulled
+bool SavePulledUsers(const ServiceDataStructure::PulledUserList &pulled_users);
+
 // Wrapper function to get the chirp list of a specified user
 bool GetUserChirpList(const std::string &username,
                       ServiceDataStructure::UserChirpList *const chirp_list);
@@ -258,7 +741,64 @@ bool GetUserChirpList(const std::string &username,
 bool GetChirpTagList(const std::string &tag,
                       ServiceDataStructure::UserChirpList *const chirp_list);
 
+// Wrapper function to read a page of the chirp list of a specified user,
+// newest first
+// At most `max_ids` ids older than `cursor` are appended to `ids`, and
+// `cursor` is moved past them.
+// returns true if this operation succeeds
+// returns false if it fails or `cursor` is not a position in the list
+bool GetUserChirpPage(const std::string &username, const size_t &max_ids,
+                      ServiceDataStructure::UserChirpList::Cursor *const cursor,
+                      std::vector<uint64_t> *const ids);
+
+// Wrapper function to read a page of the chirp list with the `tag`, newest
+// first
+// This works like `GetUserChirpPage`.
+bool GetChirpTagPage(const std::string &tag, const size_t &max_ids,
+                     ServiceDataStructure::UserChirpList::Cursor *const cursor,
+                     std::vector<uint64_t> *const ids);
+
+// Wrapper function to append a chirp to the chirp list of a specified user
+// Only the head and the last chunk of the list are read and written, by
+// compare and swap, and the chunk is kept as the hint of the chirp.
+bool AppendUserChirp(const std::string &username, const uint64_t &chirp_id);
+
+// Wrapper function to append a chirp to the chirp list with the `tag`
+bool AppendChirpTag(const std::string &tag, const uint64_t &chirp_id);
+
+// Wrapper function to remove a chirp from the chirp list of a specified user
+// Only the chunk in the hint of the chirp and the head are read and written.
+bool RemoveUserChirp(const std::string &username, const uint64_t &chirp_id);
+
+// Wrapper function to get the number of chirps with the search term `term`
+bool GetSearchTermSize(const std::string &term, uint64_t *const size);
+
+// Wrapper function to read a page of the chirps with the search term `term`,
+// newest first
+// This works like `GetUserChirpPage`.
+bool GetSearchTermPage(
+    const std::string &term, const size_t &max_ids,
+    ServiceDataStructure::UserChirpList::Cursor *const cursor,
+    std::vector<uint64_t> *const ids);
+
+// Wrapper function to check whether `cursor` is a position in the chirps
+// with the search term `term`, which is set to `valid`
+// returns true if this operation succeeds
+// returns false otherwise
+bool CheckSearchTermCursor(
+    const std::string &term,
+    const ServiceDataStructure::UserChirpList::Cursor &cursor,
+    bool *const valid);
+
+// Wrapper function to add a chirp to the chirps with the search term `term`
+bool AppendSearchTerm(const std::string &term, const uint64_t &chirp_id);
+
+// Wrapper function to remove a chirp from the chirps with the search term
+// `term`
+bool RemoveSearchTerm(const std::string &term, const uint64_t &chirp_id);
+
 // Wrapper function to save the chirp list of a specified user
+// This rewrites every chunk of the list.
 bool SaveUserChirpList(const std::string &username,
                        const ServiceDataStructure::UserChirpList &chirp_list);
 
@@ -269,10 +809,63 @@ bool SaveChirpTag(const std::string& tag,
 // Wrapper function to delete the chirp list of a specified user
 bool DeleteUserChirpList(const std::string &username);
 
+// Wrapper function to get a time bucket of the chirps with the `tag`
+// `bucket` is the posting time in seconds divided by
+// `ServiceDataStructure::kTagBucketSeconds`. A missing bucket is read as an
+// empty one.
+bool GetTagBucket(const std::string &tag, const uint64_t &bucket,
+                  ServiceDataStructure::ChirpIndex *const chirps);
+
+// Wrapper function to get the time buckets of the chirps with the `tag` from
+// `first` to `last` in one request
+// The bucket `first + i` is appended to `chirps` as its `i`-th one.
+bool GetTagBuckets(const std::string &tag, const uint64_t &first,
+                   const uint64_t &last,
+                   std::vector<ServiceDataStructure::ChirpIndex> *const chirps);
+
+// Wrapper function to update a time bucket of the chirps with the `tag`
+// `update` returns false to leave the bucket as it is. It is applied again
+// to what others have stored if they change the bucket at the same time.
+bool UpdateTagBucket(
+    const std::string &tag, const uint64_t &bucket,
+    const std::function<bool(ServiceDataStructure::ChirpIndex *const)>
+        &update);
+
+// Wrapper function to save a time bucket of the chirps with the `tag`
+bool SaveTagBucket(const std::string &tag, const uint64_t &bucket,
+                   const ServiceDataStructure::ChirpIndex &chirps);
+
 // Wrapper function to get a chirp
 bool GetChirp(const uint64_t &chirp_id,
               ServiceDataStructure::Chirp *const chirp);
 
+// Wrapper function to get the shape of the thread starting at `root_id`
+// A missing thread is read as an empty one.
+bool GetThread(const uint64_t &root_id,
+               ServiceDataStructure::Thread *const thread);
+
+// Wrapper function to change the shape of the thread starting at `root_id`
+// by `update`
+// `update` is given the stored shape, which is empty if there is none, and
+// returns false to leave it as it is. The shape is written by compare and
+// swap, and `update` is called again on the new shape if another request
+// has changed it in between, so that concurrent replies are never lost.
+// Whether it has been changed will be set to `updated`.
+// returns true if this operation succeeds
+// returns false otherwise
+bool UpdateThread(
+    const uint64_t &root_id,
+    const std::function<bool(ServiceDataStructure::Thread *const)> &update,
+    bool *const updated);
+
+// Wrapper function to get the chirps `chirp_ids` in one batch
+// The chirps found are inserted to `chirps` by their ids, and the missing
+// ones are left out.
+// returns true if this operation succeeds
+// returns false otherwise
+bool GetChirps(const std::vector<uint64_t> &chirp_ids,
+               std::map<uint64_t, ServiceDataStructure::Chirp> *const chirps);
+
 // Wrapper function to save a chirp
 bool SaveChirp(const uint64_t &chirp_id,
                const ServiceDataStructure::Chirp &chirp);
@@ -286,8 +879,9 @@ ServiceDataStructure::UserSession::SessionGetUserFollowingList() {
   ServiceDataStructure::UserFollowingList ret;
   bool ok =
       chirp_connect_backend::GetUserFollowingList(user_.get_username(), &ret);
-  CHECK(ok) << "The user following list for user `" << user_.get_username()
-            << "` should exist.";
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "The user following list for user `" << user_.get_username()
+      << "` should exist.";
   return ret;
 }
 
@@ -295,8 +889,9 @@ inline const ServiceDataStructure::UserChirpList
 ServiceDataStructure::UserSession::SessionGetUserChirpList() {
   ServiceDataStructure::UserChirpList ret;
   bool ok = chirp_connect_backend::GetUserChirpList(user_.get_username(), &ret);
-  CHECK(ok) << "The user chirp list for user `" << user_.get_username()
-            << "` should exist.";
+  CHECK(ok || BackendRequestScope::IsDone())
+      << "The user chirp list for user `" << user_.get_username()
+      << "` should exist.";
   return ret;
 }
 
@@ -1,17 +1,639 @@
 #include "service_server.h"
 
 #include <sys/time.h>
+#include <algorithm>
 #include <chrono>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
-#include <thread>
+#include <tuple>
 #include <vector>
 
+#include <gflags/gflags.h>
+
+#include "backend_client_lib.h"
 #include "utility.h"
 
-ServiceImpl::ServiceImpl() : service_data_structure_() {}
+DEFINE_bool(embedded_backend, false,
+            "Run the key-value store inside this process instead of talking "
+            "to a backend_server through grpc.");
+DEFINE_string(backend_shm_name, "",
+              "Send requests to the backend_server on this host through the "
+              "shared memory segment with this name, e.g. /chirp_backend. "
+              "Requests fall back to grpc while it is unavailable.");
+DEFINE_string(chirp_id, "leased",
+              "How chirp ids are generated. `counter` takes them from the "
+              "counter in the backend one at a time. `leased` takes them from "
+              "the same counter a block at a time. `snowflake` generates "
+              "time-ordered ids locally, which needs a distinct --worker_id "
+              "for each service server.");
+DEFINE_uint64(chirp_id_block_size, 1000,
+              "The number of chirp ids leased at a time by "
+              "--chirp_id=leased.");
+DEFINE_uint32(worker_id, 0,
+              "The worker id of this service server, from 0 to 1023, used "
+              "by --chirp_id=snowflake.");
+DEFINE_uint64(fan_out_threshold, ServiceDataStructure::kDefaultFanOutThreshold,
+              "Users with more followers than this are not pushed to the home "
+              "timelines of their followers. Their chirps are pulled when the "
+              "followers read their feeds instead.");
+DEFINE_uint64(trending_half_life_seconds,
+              ServiceDataStructure::kDefaultTrendingHalfLifeSeconds,
+              "A use of a tag counts half as much for trending tags after "
+              "this many seconds.");
+DEFINE_uint64(write_batch_window_us, 0,
+              "How long in microseconds writes to the backend are collected "
+              "before being sent as one batch. Every write waits up to this "
+              "long, which only pays off with many concurrent writers. 0 "
+              "disables batching.");
+DEFINE_uint64(write_batch_max_ops, 64,
+              "The number of writes that makes a batch be sent right away.");
+DEFINE_uint64(stream_queue_capacity, EventBus::kDefaultCapacity,
+              "The most chirps queued for a monitor or stream which reads "
+              "slower than chirps are posted.");
+DEFINE_string(stream_overflow_policy, "drop_oldest",
+              "What a full queue of a monitor or stream does with a new "
+              "chirp. `drop_oldest` drops the oldest chirp queued. "
+              "`coalesce` drops the chirp queued for the same user, so that "
+              "the latest chirp of each user is kept. `disconnect` ends the "
+              "stream with RESOURCE_EXHAUSTED and a resume cursor.");
+DEFINE_uint64(stream_setup_threads, ServiceImpl::kDefaultSetupThreads,
+              "The number of threads setting up monitors and reading the "
+              "chirps a resuming stream has missed.");
+DEFINE_uint64(stream_setup_queue_capacity,
+              ServiceImpl::kDefaultMaxQueuedSetups,
+              "The most monitors and resuming streams waiting for those "
+              "threads. The ones beyond are refused with UNAVAILABLE, and "
+              "the clients retry them later.");
+DEFINE_uint64(monitor_poll_interval_ms,
+              ServiceImpl::kDefaultMonitorPollIntervalMilliseconds,
+              "How often a monitor reads the home timeline for the chirps "
+              "posted through other servers. 0 leaves it to the chirps "
+              "posted through this server.");
+
+namespace {
+typedef ServiceDataStructure::ChirpIndex ChirpIndex;
+
+// The trailing metadata with the cursor of the last chirp written to a
+// stream disconnected for reading too slowly
+const char kResumeCursorKey[] = "resume-cursor-bin";
+
+// returns the entry of `chirp` in the (time, id) order of the indexes
+ChirpIndex::Entry EntryOf(const chirp::Chirp &chirp) {
+  ChirpIndex::Entry entry;
+  entry.chirp_id = BinaryToUint64(chirp.id());
+  entry.time.tv_sec = chirp.timestamp().seconds();
+  entry.time.tv_usec = chirp.timestamp().useconds();
+  return entry;
+}
+
+// The position of a chirp or a cursor in the (time, id) order, which sorts
+// the same way
+typedef std::tuple<time_t, suseconds_t, uint64_t> OrderKey;
+
+OrderKey OrderKeyOf(const ChirpIndex::Entry &entry) {
+  return OrderKey(entry.time.tv_sec, entry.time.tv_usec, entry.chirp_id);
+}
+
+OrderKey OrderKeyOf(const ChirpIndex::Cursor &cursor) {
+  return OrderKey(cursor.time.tv_sec, cursor.time.tv_usec, cursor.chirp_id);
+}
+
+// Set `start` to where the stream asked for by `request` starts: after its
+// `since` cursor, from its `since_time`, or from now if it has neither
+// `resuming` will be set to true if the stream starts before now.
+// returns false if `since` is not a cursor
+template <typename Request>
+bool StartOf(const Request &request, ChirpIndex::Cursor *const start,
+             bool *const resuming) {
+  *resuming = true;
+  if (!request.since().empty()) {
+    return ChirpIndex::ImportCursor(request.since(), start);
+  }
+
+  struct timeval time;
+  if (request.has_since_time()) {
+    time.tv_sec = request.since_time().seconds();
+    time.tv_usec = request.since_time().useconds();
+  } else {
+    gettimeofday(&time, nullptr);
+    *resuming = false;
+  }
+  *start = ChirpIndex::CursorAt(time);
+  return true;
+}
+
+// Set `status` to what ends the request bound on this thread if it has been
+// cancelled or its deadline has passed, after which its backend requests
+// fail and what they read should not be replied
+// returns true if it is done
+bool IsRequestDone(grpc::Status *const status) {
+  if (!BackendRequestScope::IsDone()) {
+    return false;
+  }
+  if (BackendRequestScope::Current()->deadline() <=
+      std::chrono::system_clock::now()) {
+    *status = grpc::Status(grpc::DEADLINE_EXCEEDED, "Deadline exceeded.");
+  } else {
+    *status = grpc::Status(grpc::CANCELLED, "Cancelled.");
+  }
+  return true;
+}
+
+// This writes the chirps published to some topics to a stream as they are
+// published, without holding a thread while there are none
+// A write is started from the publishing thread when the stream is idle,
+// and the next one from the completion of the last one. It deletes itself
+// when the stream is done.
+// The chirps wait in a queue bounded by `limit` while a write is in flight,
+// and each reply tells how many were dropped before it and how many are
+// still queued behind it. A stream whose queue overflows with `DISCONNECT`
+// finishes with RESOURCE_EXHAUSTED and the resume cursor.
+// Each reply carries the cursor of the latest chirp written so far, which a
+// client reconnects with to resume the stream.
+// The chirps read from the indexes by a poller can be added with `Append`,
+// leaving out the ones published here and written already.
+template <typename Reply>
+class ChirpWriteReactor : public grpc::ServerWriteReactor<Reply> {
+ public:
+  // returns true if the chirp of `event` should be written
+  typedef std::function<bool(const EventBus::Event &event)> Filter;
+
+  // The chirps published after `start` are written once `Start` is called.
+  // `filter`, if given, decides which chirps are written
+  // `polled` should be true if `Append` is going to be called, so that the
+  // chirps written are remembered until then.
+  ChirpWriteReactor(grpc::CallbackServerContext *const context,
+                    EventBus *const bus, const std::vector<std::string> &topics,
+                    const EventBus::QueueLimit &limit,
+                    const ChirpIndex::Cursor &start,
+                    const Filter &filter = nullptr, const bool &polled = false)
+      : context_(context),
+        filter_(filter),
+        start_(start),
+        polled_(polled),
+        cursor_(start),
+        started_(false),
+        writing_(false),
+        finished_(false) {
+    // The chirps published from now on are queued until `Start`
+    // `WriteNext` runs on the publishing thread, which is fine as
+    // `StartWrite` and `Finish` only schedule the reactions
+    auto subscription =
+        bus->Subscribe(topics, [this]() { WriteNext(); }, limit);
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscription_ = std::move(subscription);
+  }
+
+  // Start writing, beginning with `backlog`
+  // `backlog` is the chirps after the start read from the indexes after
+  // this has subscribed, oldest first. The chirps published meanwhile are
+  // written after it, leaving out the ones already in it.
+  // This may be deleted as soon as this or `Abort` is called, and not
+  // before.
+  void Start(std::vector<chirp::Chirp> *const backlog) {
+    bool finished;
+    grpc::Status status;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      started_ = true;
+      finished = finished_;
+      status = finish_status_;
+      for (auto &chirp : *backlog) {
+        seen_.insert(OrderKeyOf(EntryOf(chirp)));
+        backlog_.push_back(std::move(chirp));
+      }
+    }
+    if (finished) {
+      // The stream has been cancelled while the backlog was read
+      this->Finish(status);
+      return;
+    }
+    WriteNext();
+  }
+
+  // Write the chirps of `chirps` which have been neither written nor queued
+  // after the ones queued
+  // `chirps` are the chirps after `since`, which never moves back, so the
+  // chirps up to it are no longer remembered.
+  // returns false if this has not started, when nothing is queued
+  bool Append(std::vector<chirp::Chirp> *const chirps,
+              const ChirpIndex::Cursor &since) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!started_) {
+        return false;
+      }
+      seen_.erase(seen_.begin(), seen_.upper_bound(OrderKeyOf(since)));
+      for (auto &chirp : *chirps) {
+        ChirpIndex::Entry entry = EntryOf(chirp);
+        if (ChirpIndex::IsAfter(entry, start_) &&
+            seen_.insert(OrderKeyOf(entry)).second) {
+          backlog_.push_back(std::move(chirp));
+        }
+      }
+    }
+    WriteNext();
+    return true;
+  }
+
+  // Subscribe to `topics` instead, keeping the chirps queued
+  // This should be called before `OnDone`.
+  void SetTopics(const std::vector<std::string> &topics) {
+    EventBus::Subscription *subscription;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      subscription = subscription_.get();
+    }
+    subscription->SetTopics(topics);
+  }
+
+  // Call `on_done` when the stream is done, right before this is deleted
+  // This should be called before `Start` or `Abort`.
+  void SetOnDone(const std::function<void()> &on_done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    on_done_ = on_done;
+  }
+
+  // Finish the stream with `status` instead of starting it
+  void Abort(const grpc::Status &status) {
+    grpc::Status finish_status;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      started_ = true;
+      if (!finished_) {
+        finished_ = true;
+        finish_status_ = status;
+      }
+      finish_status = finish_status_;
+    }
+    this->Finish(finish_status);
+  }
+
+  void OnWriteDone(bool ok) override {
+    bool finished;
+    grpc::Status status;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writing_ = false;
+      if (!ok && !finished_) {
+        // The client has gone
+        finished_ = true;
+        finish_status_ = grpc::Status::OK;
+      }
+      finished = finished_;
+      status = finish_status_;
+    }
+    if (finished) {
+      // The stream has been finished during the write, or the write failed
+      this->Finish(status);
+      return;
+    }
+    WriteNext();
+  }
+
+  void OnCancel() override { FinishOnce(grpc::Status::OK); }
+
+  void OnDone() override {
+    std::function<void()> on_done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      on_done.swap(on_done_);
+    }
+    if (on_done) {
+      on_done();
+    }
+
+    // No more writes are started once this returns
+    std::unique_ptr<EventBus::Subscription> subscription;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      subscription.swap(subscription_);
+    }
+    subscription.reset();
+    delete this;
+  }
+
+ private:
+  // returns true if the chirp of `event` has not been queued from the
+  // indexes or written before the start
+  // This should be called with `mutex_` held.
+  bool IsNew(const EventBus::Event &event) {
+    ChirpIndex::Entry entry = EntryOf(*event.chirp);
+    return ChirpIndex::IsAfter(entry, start_) &&
+           seen_.count(OrderKeyOf(entry)) == 0;
+  }
+
+  // Start writing the next chirp queued if no write is in flight
+  void WriteNext() {
+    bool overflowed;
+    std::string resume_cursor;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!started_ || writing_ || finished_ || subscription_ == nullptr) {
+        return;
+      }
+      overflowed = subscription_->IsOverflowed();
+      if (overflowed) {
+        finished_ = true;
+        resume_cursor = ChirpIndex::ExportCursor(cursor_);
+      } else if (!backlog_.empty()) {
+        *reply_.mutable_chirp() = std::move(backlog_.front());
+        backlog_.pop_front();
+        reply_.set_num_of_dropped(0);
+      } else {
+        EventBus::Event event;
+        // The chirps filtered out are not counted as dropped
+        uint64_t num_of_dropped = 0;
+        bool found = false;
+        while (!found) {
+          uint64_t num_of_newly_dropped = 0;
+          if (!subscription_->Poll(&event, &num_of_newly_dropped)) {
+            return;
+          }
+          num_of_dropped += num_of_newly_dropped;
+          found = IsNew(event) && (!filter_ || filter_(event));
+        }
+        *reply_.mutable_chirp() = *event.chirp;
+        reply_.set_num_of_dropped(num_of_dropped);
+        if (polled_) {
+          // The poller reads it again from the indexes
+          seen_.insert(OrderKeyOf(EntryOf(reply_.chirp())));
+        }
+      }
+
+      if (!overflowed) {
+        reply_.set_lag(backlog_.size() + subscription_->GetNumOfQueued());
+        // Chirps posted at the same time may be published out of order, so
+        // the cursor never moves back
+        ChirpIndex::Entry entry = EntryOf(reply_.chirp());
+        if (ChirpIndex::IsAfter(entry, cursor_)) {
+          cursor_ = ChirpIndex::CursorOf(entry);
+        }
+        reply_.set_cursor(ChirpIndex::ExportCursor(cursor_));
+        writing_ = true;
+      }
+    }
+
+    if (overflowed) {
+      // No write is in flight, so the stream can be finished here
+      context_->AddTrailingMetadata(kResumeCursorKey, resume_cursor);
+      this->Finish(grpc::Status(grpc::RESOURCE_EXHAUSTED, "slow consumer"));
+      return;
+    }
+    this->StartWrite(&reply_);
+  }
+
+  // Finish the stream with `status` unless it has been finished
+  // A write in flight is never followed by `Finish` before it completes, so
+  // the stream is finished by `OnWriteDone` instead while there is one, and
+  // by `Start` or `Abort` before this has started.
+  void FinishOnce(const grpc::Status &status) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) {
+        return;
+      }
+      finished_ = true;
+      finish_status_ = status;
+      if (writing_ || !started_) {
+        return;
+      }
+    }
+    this->Finish(status);
+  }
+
+  grpc::CallbackServerContext *const context_;
+  const Filter filter_;
+  // The chirps up to here were written before this stream
+  const ChirpIndex::Cursor start_;
+  const bool polled_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  std::unique_ptr<EventBus::Subscription> subscription_;
+  // The chirps read from the indexes to be written first
+  std::deque<chirp::Chirp> backlog_;
+  // The chirps queued from the indexes, and the ones written if `polled_`,
+  // which are left out when they come again
+  std::set<OrderKey> seen_;
+  std::function<void()> on_done_;
+  // The reply being written, which should be kept until it is written
+  Reply reply_;
+  // The latest chirp written, which is where to resume from
+  ChirpIndex::Cursor cursor_;
+  bool started_;
+  bool writing_;
+  // No write is started once this is set, and the stream is finished with
+  // `finish_status_` as soon as it has started and no write is in flight
+  bool finished_;
+  grpc::Status finish_status_;
+};
+
+// This finishes a stream with `status` right away
+template <typename Reply>
+class FinishedWriteReactor : public grpc::ServerWriteReactor<Reply> {
+ public:
+  explicit FinishedWriteReactor(const grpc::Status &status) {
+    this->Finish(status);
+  }
+
+  void OnDone() override { delete this; }
+};
+
+// Start `reactor` with the backlog set by `read_backlog`, which is called on
+// a thread of `pool` bound to the request of `context`
+// Reading the backlog of a stream resuming from long ago takes many backend
+// requests, which should not hold the thread the reactor is created on. The
+// stream is refused with UNAVAILABLE if too many are waiting already.
+// `read_backlog` may also set up the subscription of `reactor`, which is
+// started only after it returns.
+template <typename Reply>
+void StartInBackground(
+    WorkerPool *const pool, grpc::CallbackServerContext *const context,
+    ChirpWriteReactor<Reply> *const reactor,
+    const std::function<grpc::Status(std::vector<chirp::Chirp> *const)>
+        &read_backlog) {
+  bool queued = pool->Submit([context, reactor, read_backlog]() {
+    BackendRequestScope scope(context);
+    std::vector<chirp::Chirp> backlog;
+    grpc::Status status = read_backlog(&backlog);
+    // The backlog fails to be read once the request is done
+    if (IsRequestDone(&status) || !status.ok()) {
+      reactor->Abort(status);
+    } else {
+      reactor->Start(&backlog);
+    }
+  });
+  if (!queued) {
+    reactor->Abort(grpc::Status(grpc::UNAVAILABLE,
+                                "Too many streams are being set up."));
+  }
+}
+}  // Anonymous namespace
+
+// This is a `monitor` open on this server
+// It is subscribed again when its user follows someone through this server,
+// and polls the home timeline for the chirps published elsewhere. Each poll
+// reads from one poll interval before the last one, so that the chirps
+// pushed to the timeline late are not missed.
+class ServiceImpl::Monitor {
+ public:
+  // The chirps after `start` are written to `reactor`
+  Monitor(ServiceImpl *const service,
+          const std::shared_ptr<ServiceDataStructure::UserSession> &session,
+          ChirpWriteReactor<chirp::MonitorReply> *const reactor,
+          const ChirpIndex::Cursor &start)
+      : service_(service),
+        session_(session),
+        reactor_(reactor),
+        polling_(false),
+        poll_cursor_(start) {}
+
+  // Subscribe to the users followed now
+  void Resubscribe() {
+    // The topics read last are the ones set last
+    std::lock_guard<std::mutex> resubscribe_lock(resubscribe_mutex_);
+    std::vector<std::string> topics;
+    for (const auto &username : session_->SessionGetUserFollowingList()) {
+      topics.push_back(EventBus::UserTopic(username));
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reactor_ != nullptr) {
+      reactor_->SetTopics(topics);
+    }
+  }
+
+  // returns true if no poll is queued or running, in which case one should
+  // be queued and either run by `Poll` or given up by `CancelPoll`
+  bool TryStartPoll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (polling_) {
+      return false;
+    }
+    polling_ = true;
+    return true;
+  }
+
+  // Write the chirps in the home timeline since the last poll which have not
+  // been written, and move on unless they fail to be read
+  void Poll() {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    // `poll_cursor_` is only changed by the poll running
+    ChirpIndex::Cursor cursor = poll_cursor_;
+    std::vector<uint64_t> chirp_ids;
+    std::vector<chirp::Chirp> chirps;
+    bool ok = session_->MonitorSince(&cursor, &chirp_ids) ==
+                  ServiceDataStructure::OK &&
+              service_->ReadBacklog(chirp_ids, &chirps).ok();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    polling_ = false;
+    if (!ok || reactor_ == nullptr ||
+        !reactor_->Append(&chirps, poll_cursor_)) {
+      return;
+    }
+    int64_t from = static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_usec -
+                   service_->monitor_poll_interval_.count() * 1000;
+    struct timeval from_time;
+    from_time.tv_sec = from / 1000000;
+    from_time.tv_usec = from % 1000000;
+    ChirpIndex::Cursor next = ChirpIndex::CursorAt(from_time);
+    if (OrderKeyOf(poll_cursor_) < OrderKeyOf(next)) {
+      poll_cursor_ = next;
+    }
+  }
+
+  // Give up the poll `TryStartPoll` has started
+  void CancelPoll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    polling_ = false;
+  }
+
+  // Stop writing to the reactor, which is being deleted
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reactor_ = nullptr;
+  }
+
+ private:
+  ServiceImpl *const service_;
+  const std::shared_ptr<ServiceDataStructure::UserSession> session_;
+  std::mutex resubscribe_mutex_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  // Set to nullptr once the stream is done
+  ChirpWriteReactor<chirp::MonitorReply> *reactor_;
+  bool polling_;
+  ChirpIndex::Cursor poll_cursor_;
+};
+
+const size_t ServiceImpl::kDefaultSetupThreads;
+const size_t ServiceImpl::kDefaultMaxQueuedSetups;
+const uint64_t ServiceImpl::kDefaultMonitorPollIntervalMilliseconds;
+
+ServiceImpl::ServiceImpl(const size_t &fan_out_threshold,
+                         const time_t &trending_half_life_seconds,
+                         const EventBus::QueueLimit &stream_queue_limit,
+                         const size_t &num_of_setup_threads,
+                         const size_t &max_queued_setups,
+                         const uint64_t &monitor_poll_interval_milliseconds)
+    : service_data_structure_(fan_out_threshold, trending_half_life_seconds),
+      stream_queue_limit_(stream_queue_limit),
+      stopping_(false),
+      monitor_poll_interval_(monitor_poll_interval_milliseconds),
+      setup_pool_(num_of_setup_threads, max_queued_setups) {
+  if (monitor_poll_interval_.count() > 0) {
+    monitor_poller_ = std::thread(&ServiceImpl::PollMonitors, this);
+  }
+}
+
+ServiceImpl::~ServiceImpl() {
+  {
+    std::lock_guard<std::mutex> lock(monitors_mutex_);
+    stopping_ = true;
+  }
+  stopping_cv_.notify_all();
+  if (monitor_poller_.joinable()) {
+    monitor_poller_.join();
+  }
+}
+
+void ServiceImpl::ResubscribeMonitors(const std::string &username) {
+  std::vector<std::shared_ptr<Monitor>> monitors;
+  {
+    std::lock_guard<std::mutex> lock(monitors_mutex_);
+    auto range = monitors_.equal_range(username);
+    for (auto it = range.first; it != range.second; ++it) {
+      monitors.push_back(it->second);
+    }
+  }
+  for (const auto &monitor : monitors) {
+    monitor->Resubscribe();
+  }
+}
+
+void ServiceImpl::PollMonitors() {
+  std::unique_lock<std::mutex> lock(monitors_mutex_);
+  while (!stopping_cv_.wait_for(lock, monitor_poll_interval_,
+                                [this]() { return stopping_; })) {
+    for (const auto &it : monitors_) {
+      std::shared_ptr<Monitor> monitor = it.second;
+      // A monitor still polling since the last interval is skipped
+      if (monitor->TryStartPoll() &&
+          !setup_pool_.Submit([monitor]() { monitor->Poll(); })) {
+        monitor->CancelPoll();
+      }
+    }
+  }
+}
 
 grpc::Status ServiceImpl::registeruser(grpc::ServerContext *context,
                                        const chirp::RegisterRequest *request,
@@ -59,6 +681,15 @@ grpc::Status ServiceImpl::chirp(grpc::ServerContext *context,
   InternalChirpToGrpcChirp(internal_chirp, grpc_chirp);
   reply->set_allocated_chirp(grpc_chirp);
 
+  // Deliver the chirp to the monitors of its user and the streams of its
+  // tags on this server
+  std::vector<std::string> topics(
+      1, EventBus::UserTopic(internal_chirp.get_username()));
+  for (const auto &tag : ServiceDataStructure::ParseTags(request->text())) {
+    topics.push_back(EventBus::TagTopic(tag));
+  }
+  event_bus_.Publish(topics, *grpc_chirp);
+
   return grpc::Status::OK;
 }
 
@@ -77,6 +708,9 @@ grpc::Status ServiceImpl::follow(grpc::ServerContext *context,
 
   // ServiceDataStructure::ReturnCodes
   auto ret = user_session->Follow(request->to_follow());
+  if (ret == ServiceDataStructure::OK) {
+    ResubscribeMonitors(request->username());
+  }
 
   return ReturnCodesToGrpcStatus(ret);
 }
@@ -89,129 +723,304 @@ grpc::Status ServiceImpl::read(grpc::ServerContext *context,
         grpc::FAILED_PRECONDITION,
         "`ServerContext`, `RegisterRequest`, or `reply` is nullptr.");
   }
+  BackendRequestScope scope(context);
 
+  // 0 means no limit
+  size_t max_depth = request->max_depth() > 0 ? request->max_depth() : SIZE_MAX;
+  size_t max_chirps =
+      request->max_chirps() > 0 ? request->max_chirps() : SIZE_MAX;
+  std::string cursor = request->cursor();
+  std::vector<ServiceDataStructure::Chirp> thread;
   // ServiceDataStructure::ReturnCodes
-  auto ret = DfsScanChirps(reply, BinaryToUint64(request->chirp_id()));
-  return ReturnCodesToGrpcStatus(ret);
+  auto ret = service_data_structure_.ReadThreadPage(
+      BinaryToUint64(request->chirp_id()), max_depth, max_chirps, &cursor,
+      &thread);
+  grpc::Status status;
+  if (IsRequestDone(&status)) {
+    return status;
+  }
+  if (ret != ServiceDataStructure::OK) {
+    return ReturnCodesToGrpcStatus(ret);
+  }
+
+  // The chirps are in the DFS order the client prints them in
+  for (const auto &internal_chirp : thread) {
+    InternalChirpToGrpcChirp(internal_chirp, reply->add_chirps());
+  }
+  reply->set_next_cursor(cursor);
+  return grpc::Status::OK;
 }
 
-grpc::Status ServiceImpl::monitor(
-    grpc::ServerContext *context, const chirp::MonitorRequest *request,
-    grpc::ServerWriter<chirp::MonitorReply> *writer) {
+grpc::Status ServiceImpl::readstream(
+    grpc::ServerContext *context, const chirp::ReadRequest *request,
+    grpc::ServerWriter<chirp::ReadStreamReply> *writer) {
   if (context == nullptr || request == nullptr || writer == nullptr) {
     return grpc::Status(
         grpc::FAILED_PRECONDITION,
-        "`ServerContext`, `RegisterRequest`, or `writer` is nullptr.");
+        "`ServerContext`, `ReadRequest`, or `writer` is nullptr.");
   }
+  BackendRequestScope scope(context);
 
-  const int mseconds_per_wait = 50;
-  const int times_count = INT_MAX;
+  // Pages double from a single chirp up to this size
+  const size_t kMaxPageSize = 256;
 
-  struct timeval start_time;
-  gettimeofday(&start_time, nullptr);
+  // 0 means no limit
+  size_t max_depth = request->max_depth() > 0 ? request->max_depth() : SIZE_MAX;
+  size_t num_of_left =
+      request->max_chirps() > 0 ? request->max_chirps() : SIZE_MAX;
+  uint64_t chirp_id = BinaryToUint64(request->chirp_id());
+  std::string cursor = request->cursor();
+  size_t page_size = 1;
+  do {
+    std::vector<ServiceDataStructure::Chirp> thread;
+    std::vector<size_t> depths;
+    // ServiceDataStructure::ReturnCodes
+    auto ret = service_data_structure_.ReadThreadPage(
+        chirp_id, max_depth, std::min(page_size, num_of_left), &cursor,
+        &thread, &depths);
+    grpc::Status status;
+    if (IsRequestDone(&status)) {
+      return status;
+    }
+    if (ret != ServiceDataStructure::OK) {
+      return ReturnCodesToGrpcStatus(ret);
+    }
 
-  auto user_session = service_data_structure_.UserLogin(request->username());
-  if (user_session == nullptr) {
-    return grpc::Status(grpc::NOT_FOUND, "Failed to login.");
+    for (size_t i = 0; i < thread.size(); ++i) {
+      chirp::ReadStreamReply reply;
+      InternalChirpToGrpcChirp(thread[i], reply.mutable_chirp());
+      reply.set_depth(depths[i]);
+      if (!writer->Write(reply)) {
+        // The client has gone
+        return grpc::Status::OK;
+      }
+    }
+    num_of_left -= thread.size();
+    page_size = std::min(page_size * 2, kMaxPageSize);
+  } while (!cursor.empty() && num_of_left > 0 &&
+           !BackendRequestScope::IsDone());
+
+  return grpc::Status::OK;
+}
+
+grpc::ServerWriteReactor<chirp::MonitorReply> *ServiceImpl::monitor(
+    grpc::CallbackServerContext *context,
+    const chirp::MonitorRequest *request) {
+  if (context == nullptr || request == nullptr) {
+    return new FinishedWriteReactor<chirp::MonitorReply>(
+        grpc::Status(grpc::FAILED_PRECONDITION,
+                     "`ServerContext` or `RegisterRequest` is nullptr."));
   }
 
-  // This indicates that the stream is still on
-  int cnt = 0;
-  bool flag = true;
+  ChirpIndex::Cursor start;
+  bool resuming;
+  if (!StartOf(*request, &start, &resuming)) {
+    return new FinishedWriteReactor<chirp::MonitorReply>(
+        grpc::Status(grpc::INVALID_ARGUMENT, "since"));
+  }
 
-  while (flag && cnt < times_count) {
-    // sleep a while to avoid busy polling
-    std::this_thread::sleep_for(std::chrono::milliseconds(mseconds_per_wait));
+  // The user logs in and subscribes to the users it follows on the setup
+  // pool, since that takes backend requests, which should not hold the
+  // thread of the callback
+  auto reactor = new ChirpWriteReactor<chirp::MonitorReply>(
+      context, &event_bus_, std::vector<std::string>(), stream_queue_limit_,
+      start, nullptr, monitor_poll_interval_.count() > 0);
+  std::string username = request->username();
+  StartInBackground<chirp::MonitorReply>(
+      &setup_pool_, context, reactor,
+      [this, reactor, username,
+       start](std::vector<chirp::Chirp> *const backlog) -> grpc::Status {
+        auto user_session = service_data_structure_.UserLogin(username);
+        if (user_session == nullptr) {
+          return grpc::Status(grpc::NOT_FOUND, "Failed to login.");
+        }
 
-    // `start_time` will be modified to the time backend collects the chirps
-    std::set<uint64_t> chirps_collector =
-        user_session->MonitorFrom(&start_time);
+        // The monitor is subscribed again and polled until the stream is
+        // done
+        std::shared_ptr<ServiceDataStructure::UserSession> session(
+            std::move(user_session));
+        std::shared_ptr<Monitor> monitor(
+            new Monitor(this, session, reactor, start));
+        std::multimap<std::string, std::shared_ptr<Monitor>>::iterator
+            registered;
+        {
+          std::lock_guard<std::mutex> lock(monitors_mutex_);
+          registered = monitors_.emplace(username, monitor);
+        }
+        reactor->SetOnDone([this, monitor, registered]() {
+          {
+            std::lock_guard<std::mutex> lock(monitors_mutex_);
+            monitors_.erase(registered);
+          }
+          monitor->Close();
+        });
+        monitor->Resubscribe();
 
-    // May use a thread to do the following things
-    if (chirps_collector.size() > 0) {
-      for (const auto &chirp_id : chirps_collector) {
-        ServiceDataStructure::Chirp internal_chirp;
+        // The chirps posted since `start` are read from the home timeline
+        // after subscribing, so that none is lost in between
+        ChirpIndex::Cursor cursor = start;
+        std::vector<uint64_t> backlog_ids;
         // ServiceDataStructure::ReturnCodes
-        auto ret = service_data_structure_.ReadChirp(chirp_id, &internal_chirp);
-        // ignore errors here
+        auto ret = session->MonitorSince(&cursor, &backlog_ids);
         if (ret != ServiceDataStructure::OK) {
-          continue;
+          return ReturnCodesToGrpcStatus(ret);
         }
+        return ReadBacklog(backlog_ids, backlog);
+      });
+  return reactor;
+}
 
-        chirp::MonitorReply reply;
-        chirp::Chirp *grpc_chirp = new chirp::Chirp();
-        InternalChirpToGrpcChirp(internal_chirp, grpc_chirp);
-        reply.set_allocated_chirp(grpc_chirp);
+grpc::ServerWriteReactor<chirp::StreamReply> *ServiceImpl::stream(
+    grpc::CallbackServerContext *context,
+    const chirp::StreamRequest *request) {
+  if (context == nullptr || request == nullptr) {
+    return new FinishedWriteReactor<chirp::StreamReply>(
+        grpc::Status(grpc::FAILED_PRECONDITION,
+                     "`ServerContext` or `StreamRequest` is nullptr."));
+  }
+  BackendRequestScope scope(context);
 
-        if (!writer->Write(reply)) {
-          flag = false;
-          break;
-        }
-      }
+  // A query, if any, is used instead of the single tag
+  ServiceDataStructure::TagQuery query;
+  bool use_query = !request->query().empty();
+  if (use_query &&
+      !ServiceDataStructure::TagQuery::Parse(request->query(), &query)) {
+    return new FinishedWriteReactor<chirp::StreamReply>(
+        grpc::Status(grpc::INVALID_ARGUMENT, "query"));
+  }
+  ChirpIndex::Cursor start;
+  bool resuming;
+  if (!StartOf(*request, &start, &resuming)) {
+    return new FinishedWriteReactor<chirp::StreamReply>(
+        grpc::Status(grpc::INVALID_ARGUMENT, "since"));
+  }
 
-      cnt = 0;
-    } else {
-      ++cnt;
+  // The tags of the topics subscribed to
+  std::map<std::string, std::string> topic_tags;
+  if (use_query) {
+    for (const auto &tag : query.GetTags()) {
+      topic_tags[EventBus::TagTopic(tag)] = tag;
     }
+  } else {
+    topic_tags[EventBus::TagTopic(request->tag())] = request->tag();
+  }
+  std::vector<std::string> topics;
+  for (const auto &it : topic_tags) {
+    topics.push_back(it.first);
+  }
+  ChirpWriteReactor<chirp::StreamReply>::Filter filter;
+  if (use_query) {
+    // The query is evaluated on the tags of each chirp alone
+    filter = [query, topic_tags](const EventBus::Event &event) {
+      std::map<std::string, std::vector<uint64_t>> postings;
+      for (const auto &topic : *event.topics) {
+        postings[topic_tags.at(topic)].push_back(0);
+      }
+      return !query.Evaluate(postings).empty();
+    };
+  }
+  auto reactor = new ChirpWriteReactor<chirp::StreamReply>(
+      context, &event_bus_, topics, stream_queue_limit_, start, filter);
+  if (!resuming) {
+    std::vector<chirp::Chirp> backlog;
+    reactor->Start(&backlog);
+    return reactor;
   }
 
-  return grpc::Status::OK;
+  // The chirps missed since `start` are read from the time buckets of the
+  // tags after subscribing, so that none is lost in between
+  std::string tag = request->tag();
+  StartInBackground<chirp::StreamReply>(
+      &setup_pool_, context, reactor,
+      [this, use_query, query, tag,
+       start](std::vector<chirp::Chirp> *const backlog) -> grpc::Status {
+        ChirpIndex::Cursor cursor = start;
+        std::vector<uint64_t> backlog_ids;
+        // ServiceDataStructure::ReturnCodes
+        auto ret =
+            use_query ? service_data_structure_.StreamQuerySince(
+                            query, &cursor, &backlog_ids)
+                      : service_data_structure_.StreamSince(tag, &cursor,
+                                                            &backlog_ids);
+        if (ret != ServiceDataStructure::OK) {
+          return ReturnCodesToGrpcStatus(ret);
+        }
+        return ReadBacklog(backlog_ids, backlog);
+      });
+  return reactor;
 }
-grpc::Status ServiceImpl::stream(
-    grpc::ServerContext *context, const chirp::StreamRequest *request,
-    grpc::ServerWriter<chirp::StreamReply> *writer) {
-  if (context == nullptr || request == nullptr || writer == nullptr) {
+
+grpc::Status ServiceImpl::trending(grpc::ServerContext *context,
+                                   const chirp::TrendingRequest *request,
+                                   chirp::TrendingReply *reply) {
+  if (context == nullptr || request == nullptr || reply == nullptr) {
     return grpc::Status(
         grpc::FAILED_PRECONDITION,
-        "`ServerContext`, `StreamRequest`, or `writer` is nullptr.");
+        "`ServerContext`, `TrendingRequest`, or `reply` is nullptr.");
   }
 
-  const int mseconds_per_wait = 50;
-  const int times_count = INT_MAX;
-
-  struct timeval start_time;
-  gettimeofday(&start_time, nullptr);
-
-  // This indicates that the stream is still on
-  int cnt = 0;
-  bool flag = true;
-
-  while (flag && cnt < times_count) {
-    // sleep a while to avoid busy polling
-    std::this_thread::sleep_for(std::chrono::milliseconds(mseconds_per_wait));
-
-    // `start_time` will be modified to the time backend collects the chirps
-    std::set<uint64_t> chirps_collector =
-        service_data_structure_.StreamFrom(&start_time, request->tag());
-
-    // May use a thread to do the following things
-    if (chirps_collector.size() > 0) {
-      for (const auto &chirp_id : chirps_collector) {
-        ServiceDataStructure::Chirp internal_chirp;
-        // ServiceDataStructure::ReturnCodes
-        auto ret = service_data_structure_.ReadChirp(chirp_id, &internal_chirp);
-        // ignore errors here
-        if (ret != ServiceDataStructure::OK) {
-          continue;
-        }
+  for (const auto &tag :
+       service_data_structure_.GetTrendingTags(request->count())) {
+    chirp::TrendingTag *grpc_tag = reply->add_tags();
+    grpc_tag->set_tag(tag.first);
+    grpc_tag->set_score(tag.second);
+  }
+  return grpc::Status::OK;
+}
 
-        chirp::StreamReply reply;
-        chirp::Chirp *grpc_chirp = new chirp::Chirp();
-        InternalChirpToGrpcChirp(internal_chirp, grpc_chirp);
-        reply.set_allocated_chirp(grpc_chirp);
+grpc::Status ServiceImpl::search(grpc::ServerContext *context,
+                                 const chirp::SearchRequest *request,
+                                 chirp::SearchReply *reply) {
+  if (context == nullptr || request == nullptr || reply == nullptr) {
+    return grpc::Status(
+        grpc::FAILED_PRECONDITION,
+        "`ServerContext`, `SearchRequest`, or `reply` is nullptr.");
+  }
+  BackendRequestScope scope(context);
 
-        if (!writer->Write(reply)) {
-          flag = false;
-          break;
-        }
-      }
+  std::string cursor = request->cursor();
+  std::vector<uint64_t> chirp_ids;
+  // ServiceDataStructure::ReturnCodes
+  auto ret = service_data_structure_.Search(
+      request->query(), request->max_results(), &cursor, &chirp_ids);
+  grpc::Status status;
+  if (IsRequestDone(&status)) {
+    return status;
+  }
+  if (ret != ServiceDataStructure::OK) {
+    return ReturnCodesToGrpcStatus(ret);
+  }
 
-      cnt = 0;
-    } else {
-      ++cnt;
+  for (const auto &chirp_id : chirp_ids) {
+    ServiceDataStructure::Chirp internal_chirp;
+    // ignore the chirps deleted since they were found
+    if (service_data_structure_.ReadChirp(chirp_id, &internal_chirp) !=
+        ServiceDataStructure::OK) {
+      continue;
     }
+    InternalChirpToGrpcChirp(internal_chirp, reply->add_chirps());
+  }
+  if (IsRequestDone(&status)) {
+    return status;
+  }
+  reply->set_next_cursor(cursor);
+  return grpc::Status::OK;
+}
+
+grpc::Status ServiceImpl::ReadBacklog(
+    const std::vector<uint64_t> &chirp_ids,
+    std::vector<chirp::Chirp> *const backlog) {
+  std::vector<ServiceDataStructure::Chirp> internal_chirps;
+  // ServiceDataStructure::ReturnCodes
+  auto ret = service_data_structure_.ReadChirps(chirp_ids, &internal_chirps);
+  if (ret != ServiceDataStructure::OK) {
+    return ReturnCodesToGrpcStatus(ret);
   }
 
+  for (const auto &internal_chirp : internal_chirps) {
+    backlog->emplace_back();
+    InternalChirpToGrpcChirp(internal_chirp, &backlog->back());
+  }
   return grpc::Status::OK;
 }
 
@@ -233,29 +1042,6 @@ void ServiceImpl::InternalChirpToGrpcChirp(
   grpc_chirp->set_allocated_timestamp(timestamp);
 }
 
-ServiceDataStructure::ReturnCodes ServiceImpl::DfsScanChirps(
-    chirp::ReadReply *const reply, const uint64_t &chirp_id) {
-  ServiceDataStructure::Chirp internal_chirp;
-  // ServiceDataStructure::ReturnCodes
-  auto ret = service_data_structure_.ReadChirp(chirp_id, &internal_chirp);
-  if (ret != ServiceDataStructure::OK) {
-    return ServiceDataStructure::CHIRP_ID_NOT_FOUND;
-  }
-
-  chirp::Chirp *grpc_chirp = reply->add_chirps();
-  InternalChirpToGrpcChirp(internal_chirp, grpc_chirp);
-
-  for (const auto &id : internal_chirp.get_children_ids()) {
-    // ServiceDataStructure::ReturnCodes
-    auto ret = DfsScanChirps(reply, id);
-    if (ret != ServiceDataStructure::OK) {
-      return ret;
-    }
-  }
-
-  return ServiceDataStructure::OK;
-}
-
 grpc::Status ServiceImpl::ReturnCodesToGrpcStatus(
     const ServiceDataStructure::ReturnCodes &ret) {
   switch (ret) {
@@ -282,7 +1068,28 @@ grpc::Status ServiceImpl::ReturnCodesToGrpcStatus(
 
 void run_server() {
   const char *server_address = "0.0.0.0:50002";
-  ServiceImpl service;
+  CHECK(FLAGS_stream_queue_capacity > 0)
+      << "--stream_queue_capacity should be more than 0.";
+  EventBus::QueueLimit stream_queue_limit = {FLAGS_stream_queue_capacity,
+                                             EventBus::DROP_OLDEST};
+  if (FLAGS_stream_overflow_policy == "coalesce") {
+    stream_queue_limit.policy = EventBus::COALESCE;
+  } else if (FLAGS_stream_overflow_policy == "disconnect") {
+    stream_queue_limit.policy = EventBus::DISCONNECT;
+  } else {
+    CHECK(FLAGS_stream_overflow_policy == "drop_oldest")
+        << "Unknown --stream_overflow_policy `"
+        << FLAGS_stream_overflow_policy << "`.";
+  }
+  CHECK(FLAGS_stream_setup_threads > 0)
+      << "--stream_setup_threads should be more than 0.";
+  CHECK(FLAGS_stream_setup_queue_capacity > 0)
+      << "--stream_setup_queue_capacity should be more than 0.";
+  ServiceImpl service(FLAGS_fan_out_threshold,
+                      FLAGS_trending_half_life_seconds, stream_queue_limit,
+                      FLAGS_stream_setup_threads,
+                      FLAGS_stream_setup_queue_capacity,
+                      FLAGS_monitor_poll_interval_ms);
 
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
@@ -294,6 +1101,37 @@ void run_server() {
 }
 
 int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_embedded_backend) {
+    chirp_connect_backend::backend_client_.reset(new BackendClientEmbedded());
+  } else if (!FLAGS_backend_shm_name.empty()) {
+    // Writes through shared memory are cheap enough not to be batched
+    chirp_connect_backend::backend_client_.reset(
+        new BackendClientSharedMemory(FLAGS_backend_shm_name));
+  } else {
+    BackendClientStandard *backend_client = new BackendClientStandard();
+    if (FLAGS_write_batch_window_us > 0) {
+      backend_client->EnableWriteBatching(
+          std::chrono::microseconds(FLAGS_write_batch_window_us),
+          FLAGS_write_batch_max_ops);
+    }
+    chirp_connect_backend::backend_client_.reset(backend_client);
+  }
+
+  if (FLAGS_chirp_id == "leased") {
+    // Lease the next block once a tenth of the current one is left
+    chirp_connect_backend::chirp_id_generator_.reset(new BlockLeasedIdAllocator(
+        chirp_connect_backend::LeaseChirpIds, FLAGS_chirp_id_block_size,
+        FLAGS_chirp_id_block_size / 10));
+  } else if (FLAGS_chirp_id == "snowflake") {
+    chirp_connect_backend::chirp_id_generator_.reset(
+        new SnowflakeIdGenerator(FLAGS_worker_id));
+  } else {
+    CHECK(FLAGS_chirp_id == "counter")
+        << "Unknown --chirp_id `" << FLAGS_chirp_id << "`.";
+  }
+
   run_server();
 
   return 0;
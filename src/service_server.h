@@ -1,21 +1,75 @@
 #ifndef CHIRP_SRC_SERVICE_SERVER_H_
 #define CHIRP_SRC_SERVICE_SERVER_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include <grpc/grpc.h>
 #include <grpcpp/security/server_credentials.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
 
+#include "event_bus.h"
 #include "service.grpc.pb.h"
 #include "service_data_structure.h"
+#include "worker_pool.h"
+
+// The long-lived streams `monitor` and `stream` use the callback API, so that
+// an open stream holds no thread while it waits for chirps. The other
+// operations are served by the synchronous API.
+// The operations which only read, i.e. `read`, `readstream`, `monitor`,
+// `stream`, and `search`, bind their backend requests to the request being
+// served, so that they stop with it when it is cancelled or its deadline
+// passes. The others run to the end once started, so that a write is not
+// left half done.
+typedef chirp::ServiceLayer::WithCallbackMethod_monitor<
+    chirp::ServiceLayer::WithCallbackMethod_stream<
+        chirp::ServiceLayer::Service>>
+    ServiceBase;
 
 // Service implementation inherits from `chirp::ServiceLayer::Service`
-// It implements `registeruser`, `chirp`, `follow`, `read`, and `monitor`
-// operations
-class ServiceImpl final : public chirp::ServiceLayer::Service {
+// It implements `registeruser`, `chirp`, `follow`, `read`, `readstream`,
+// `monitor`, `stream`, `trending`, and `search` operations
+class ServiceImpl final : public ServiceBase {
  public:
-  explicit ServiceImpl();
+  // See `ServiceDataStructure` for `fan_out_threshold` and
+  // `trending_half_life_seconds`
+  // `stream_queue_limit` bounds the chirps queued for each `monitor` and
+  // `stream` which reads slower than chirps are posted.
+  // Each `monitor` is set up, and the backlogs of resuming `stream` are read,
+  // by `num_of_setup_threads` threads, and at most `max_queued_setups` of them
+  // wait for a thread. The ones beyond are refused with UNAVAILABLE for the
+  // clients to retry.
+  // Every `monitor` reads the home timeline each
+  // `monitor_poll_interval_milliseconds` on those threads too, or never if
+  // it is 0.
+  explicit ServiceImpl(
+      const size_t &fan_out_threshold =
+          ServiceDataStructure::kDefaultFanOutThreshold,
+      const time_t &trending_half_life_seconds =
+          ServiceDataStructure::kDefaultTrendingHalfLifeSeconds,
+      const EventBus::QueueLimit &stream_queue_limit = EventBus::QueueLimit{
+          EventBus::kDefaultCapacity, EventBus::DROP_OLDEST},
+      const size_t &num_of_setup_threads = kDefaultSetupThreads,
+      const size_t &max_queued_setups = kDefaultMaxQueuedSetups,
+      const uint64_t &monitor_poll_interval_milliseconds =
+          kDefaultMonitorPollIntervalMilliseconds);
+
+  // Stops polling for the monitors
+  ~ServiceImpl();
+
+  // The default number of threads setting up streams
+  static const size_t kDefaultSetupThreads = 4;
+  // The default number of streams waiting to be set up
+  static const size_t kDefaultMaxQueuedSetups = 1024;
+  // The default interval of the monitors reading their home timelines
+  static const uint64_t kDefaultMonitorPollIntervalMilliseconds = 2000;
 
   // This accepts registeruser request
   // returns grpc::Status::Ok if this operation succeeds
@@ -41,23 +95,91 @@ class ServiceImpl final : public chirp::ServiceLayer::Service {
                     const chirp::ReadRequest *request,
                     chirp::ReadReply *reply) override;
 
-  // This accepts monitor request
+  // This accepts readstream request
+  // The thread is read in pages growing from a single chirp, so the first
+  // chirp is written after one round trip to the backend and only a page is
+  // held at a time.
   // returns grpc::Status::Ok if this operation succeeds
-  grpc::Status monitor(
-      grpc::ServerContext *context, const chirp::MonitorRequest *request,
-      grpc::ServerWriter<chirp::MonitorReply> *writer) override;
+  grpc::Status readstream(
+      grpc::ServerContext *context, const chirp::ReadRequest *request,
+      grpc::ServerWriter<chirp::ReadStreamReply> *writer) override;
+
+  // This accepts monitor request
+  // The chirps of the users followed are written as they are posted through
+  // this server, and the monitor subscribes again when its user follows
+  // someone through this server. The chirps posted through other servers,
+  // or of the users followed through them, are read from the home timeline
+  // every poll interval. A monitor given `since` or `since_time` first
+  // writes the chirps posted since then from the home timeline.
+  // returns the reactor writing the stream, which finishes with
+  // grpc::Status::Ok when the client cancels it, or RESOURCE_EXHAUSTED if
+  // the client reads too slowly with `DISCONNECT`
+  grpc::ServerWriteReactor<chirp::MonitorReply> *monitor(
+      grpc::CallbackServerContext *context,
+      const chirp::MonitorRequest *request) override;
 
   // This accepts stream request
+  // The chirps with the tag, or matching the query, are written as they are
+  // posted through this server. A stream given `since` or `since_time` first
+  // writes the chirps posted since then from the time buckets of the tags.
+  // returns the reactor writing the stream, which finishes with
+  // grpc::Status::Ok when the client cancels it, or RESOURCE_EXHAUSTED if
+  // the client reads too slowly with `DISCONNECT`
+  grpc::ServerWriteReactor<chirp::StreamReply> *stream(
+      grpc::CallbackServerContext *context,
+      const chirp::StreamRequest *request) override;
+
+  // This accepts trending request
+  // returns grpc::Status::Ok if this operation succeeds
+  grpc::Status trending(grpc::ServerContext *context,
+                        const chirp::TrendingRequest *request,
+                        chirp::TrendingReply *reply) override;
+
+  // This accepts search request
   // returns grpc::Status::Ok if this operation succeeds
-  grpc::Status stream(
-      grpc::ServerContext *context, const chirp::StreamRequest *request,
-      grpc::ServerWriter<chirp::StreamReply> *writer) override;
+  grpc::Status search(grpc::ServerContext *context,
+                      const chirp::SearchRequest *request,
+                      chirp::SearchReply *reply) override;
 
  private:
+  // A `monitor` open on this server
+  class Monitor;
+
+  // Subscribe the monitors of `username` on this server to the users it
+  // follows now
+  void ResubscribeMonitors(const std::string &username);
+
+  // Read the home timelines of the monitors on this server every
+  // `monitor_poll_interval_` on `setup_pool_` until this is destroyed
+  void PollMonitors();
+
   // This instantiates a ServiceDataStructure so that those operations above
   // can leverage this.
   ServiceDataStructure service_data_structure_;
 
+  // The chirps posted through `chirp` are published here to `monitor` and
+  // `stream`, so that they do not poll the backend
+  EventBus event_bus_;
+  const EventBus::QueueLimit stream_queue_limit_;
+
+  // The monitors on this server by their users
+  // This guards `monitors_` and `stopping_`.
+  std::mutex monitors_mutex_;
+  std::multimap<std::string, std::shared_ptr<Monitor>> monitors_;
+  // Set when this is being destroyed, to stop `monitor_poller_`
+  bool stopping_;
+  std::condition_variable stopping_cv_;
+
+  const std::chrono::milliseconds monitor_poll_interval_;
+  std::thread monitor_poller_;
+
+  // `monitor` is set up and polled here, and the backlogs of resuming
+  // `stream` are read here, so that they hold neither the threads of the
+  // callbacks nor a thread each
+  // This is declared last, so that it is joined before the members its
+  // tasks use are destroyed.
+  WorkerPool setup_pool_;
+
   // This is a helper function that helps translate a
   // `ServiceDataStructure::Chirp` object to a grpc version of `chirp::Chirp`
   // object.
@@ -65,10 +187,11 @@ class ServiceImpl final : public chirp::ServiceLayer::Service {
       const ServiceDataStructure::Chirp &internal_chirp,
       chirp::Chirp *const grpc_chirp);
 
-  // This is a helper function that helps traverse all children chirps within a
-  // chirp in a DFS manner.
-  ServiceDataStructure::ReturnCodes DfsScanChirps(chirp::ReadReply *const reply,
-                                                  const uint64_t &chirp_id);
+  // This is a helper function that reads the chirps `chirp_ids` a stream
+  // resumes with and appends them to `backlog`, leaving out deleted chirps
+  // returns grpc::Status::Ok if this operation succeeds
+  grpc::Status ReadBacklog(const std::vector<uint64_t> &chirp_ids,
+                           std::vector<chirp::Chirp> *const backlog);
 
   // This is a helper function that helps translate `ReturnCodes` to
   // `grpc::Status`
@@ -0,0 +1,484 @@
+#include "shared_memory_transport.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "key_value.pb.h"
+
+namespace shared_memory_transport {
+namespace {
+// Identifies an initialized segment of this layout
+const uint32_t kMagic = 0x43485250;
+const uint32_t kVersion = 1;
+
+// The number of slots, which should be a power of two
+const uint32_t kNumOfSlots = 64;
+// The size of the request or reply that one slot holds
+const uint32_t kSlotDataSize = 64 * 1024;
+
+// How many times a side checks for work before sleeping on a futex
+const int kSpinCount = 100;
+// How long a side sleeps on a futex before checking the other side is alive
+const long kWaitTimeoutNanoseconds = 100 * 1000 * 1000;
+// How long a client waits before trying to attach to the segment again
+const std::chrono::seconds kAttachRetryInterval(1);
+
+// The life cycle of a slot
+enum SlotState : uint32_t {
+  SLOT_FREE = 0,
+  SLOT_CLAIMED,  // a client is writing its request
+  SLOT_REQUEST,  // the request is waiting for the server
+  SLOT_REPLY     // the reply is waiting for the client
+};
+
+// The result of the operation in a slot
+enum SlotStatus : uint32_t { STATUS_OK = 0, STATUS_FAILED, STATUS_TOO_LARGE };
+}  // Anonymous namespace
+
+// One request and its reply
+struct Slot {
+  // The futex that the client sleeps on while waiting for the reply
+  std::atomic<uint32_t> state;
+  std::atomic<uint32_t> client_waiting;
+  uint32_t op;
+  uint32_t status;
+  uint32_t size;
+  char data[kSlotDataSize];
+};
+
+// One cell of the ring of slot indices
+struct Cell {
+  std::atomic<uint64_t> sequence;
+  uint32_t slot_index;
+};
+
+struct Segment {
+  // This is set last when the server has initialized the segment
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  pid_t server_pid;
+
+  // The ring of slot indices waiting to be served
+  // Clients push at `enqueue_pos` and the server pops at `dequeue_pos`
+  alignas(64) std::atomic<uint64_t> enqueue_pos;
+  alignas(64) std::atomic<uint64_t> dequeue_pos;
+  // The futex that the server sleeps on, bumped on every push
+  alignas(64) std::atomic<uint32_t> request_seq;
+  std::atomic<uint32_t> server_waiting;
+  Cell ring[kNumOfSlots];
+
+  Slot slots[kNumOfSlots];
+};
+
+namespace {
+long Futex(std::atomic<uint32_t> *const address, const int &op,
+           const uint32_t &value, const struct timespec *const timeout) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(address), op, value,
+                 timeout, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t> *const address) {
+  Futex(address, FUTEX_WAKE, 1, nullptr);
+}
+
+// returns false if the futex wait times out
+bool FutexWait(std::atomic<uint32_t> *const address, const uint32_t &value) {
+  struct timespec timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_nsec = kWaitTimeoutNanoseconds;
+  return Futex(address, FUTEX_WAIT, value, &timeout) == 0 ||
+         errno != ETIMEDOUT;
+}
+
+// Push a slot index into the ring
+// Multiple clients can push at the same time.
+void Push(Segment *const segment, const uint32_t &slot_index) {
+  uint64_t pos = segment->enqueue_pos.load(std::memory_order_relaxed);
+  Cell *cell;
+  while (true) {
+    cell = &segment->ring[pos & (kNumOfSlots - 1)];
+    uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+    int64_t diff = int64_t(sequence) - int64_t(pos);
+    if (diff == 0 &&
+        segment->enqueue_pos.compare_exchange_weak(
+            pos, pos + 1, std::memory_order_relaxed)) {
+      break;
+    } else if (diff != 0) {
+      // The ring holds every slot at most once, so it cannot be full. Another
+      // client has taken this cell.
+      pos = segment->enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->slot_index = slot_index;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+}
+
+// Pop a slot index from the ring
+// Only the server thread pops.
+// returns false if the ring is empty
+bool Pop(Segment *const segment, uint32_t *const slot_index) {
+  uint64_t pos = segment->dequeue_pos.load(std::memory_order_relaxed);
+  Cell *cell = &segment->ring[pos & (kNumOfSlots - 1)];
+  if (cell->sequence.load(std::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+
+  *slot_index = cell->slot_index;
+  cell->sequence.store(pos + kNumOfSlots, std::memory_order_release);
+  segment->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+// returns true if there is a slot index in the ring
+bool RingHasRequest(Segment *const segment) {
+  uint64_t pos = segment->dequeue_pos.load(std::memory_order_relaxed);
+  return segment->ring[pos & (kNumOfSlots - 1)].sequence.load(
+             std::memory_order_acquire) == pos + 1;
+}
+
+// returns true if the server process of the segment is still running
+bool ServerAlive(Segment *const segment) {
+  return kill(segment->server_pid, 0) == 0 || errno == EPERM;
+}
+}  // Anonymous namespace
+}  // namespace shared_memory_transport
+
+using namespace shared_memory_transport;
+
+// Start of `SharedMemoryListener` definitions
+SharedMemoryListener::SharedMemoryListener(
+    const std::string &name, ConcurrentBackendDataStructure *const backend_data)
+    : name_(name),
+      backend_data_(backend_data),
+      segment_(nullptr),
+      stopping_(false) {}
+
+SharedMemoryListener::~SharedMemoryListener() {
+  if (segment_ == nullptr) {
+    return;
+  }
+
+  stopping_ = true;
+  segment_->request_seq.fetch_add(1);
+  FutexWake(&segment_->request_seq);
+  server_.join();
+
+  // Clients notice the segment is gone once the server process exits
+  segment_->magic.store(0);
+  munmap(segment_, sizeof(Segment));
+  shm_unlink(name_.c_str());
+}
+
+bool SharedMemoryListener::Start() {
+  // Remove the segment left by a previous server
+  shm_unlink(name_.c_str());
+
+  int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, sizeof(Segment)) != 0) {
+    close(fd);
+    shm_unlink(name_.c_str());
+    return false;
+  }
+  void *address = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    shm_unlink(name_.c_str());
+    return false;
+  }
+
+  // The new segment is zero-filled, so only the non-zero fields are set
+  segment_ = static_cast<Segment *>(address);
+  segment_->version = kVersion;
+  segment_->server_pid = getpid();
+  for (uint32_t i = 0; i < kNumOfSlots; ++i) {
+    segment_->ring[i].sequence.store(i);
+  }
+  segment_->magic.store(kMagic, std::memory_order_release);
+
+  server_ = std::thread(&SharedMemoryListener::ServeLoop, this);
+  return true;
+}
+
+void SharedMemoryListener::ServeLoop() {
+  int idle_count = 0;
+
+  while (!stopping_) {
+    uint32_t slot_index;
+    if (Pop(segment_, &slot_index)) {
+      Serve(slot_index);
+      idle_count = 0;
+      continue;
+    }
+
+    // Check again for a while before sleeping
+    if (++idle_count < kSpinCount) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    segment_->server_waiting.store(1);
+    // Clients bump `request_seq` after pushing, so a push that comes after
+    // this read makes the wait below return right away
+    uint32_t request_seq = segment_->request_seq.load();
+    if (!RingHasRequest(segment_) && !stopping_) {
+      FutexWait(&segment_->request_seq, request_seq);
+    }
+    segment_->server_waiting.store(0);
+    idle_count = 0;
+  }
+}
+
+void SharedMemoryListener::Serve(const uint32_t &slot_index) {
+  Slot &slot = segment_->slots[slot_index];
+  std::string request(slot.data, slot.size);
+  std::string reply;
+  uint32_t status = STATUS_OK;
+
+  switch (slot.op) {
+    case PUT: {
+      chirp::PutRequest put;
+      if (!put.ParseFromString(request) ||
+          !backend_data_->Put(put.key(), put.value())) {
+        status = STATUS_FAILED;
+      }
+      break;
+    }
+    case PUT_BATCH: {
+      chirp::PutBatchRequest batch;
+      if (!batch.ParseFromString(request)) {
+        status = STATUS_FAILED;
+        break;
+      }
+      std::vector<std::pair<std::string, std::string>> key_values;
+      for (const chirp::PutRequest &put : batch.puts()) {
+        key_values.push_back(std::make_pair(put.key(), put.value()));
+      }
+      std::vector<bool> results;
+      backend_data_->PutBatch(key_values, &results);
+
+      chirp::PutBatchReply batch_reply;
+      for (const bool ok : results) {
+        batch_reply.add_ok(ok);
+      }
+      batch_reply.SerializeToString(&reply);
+      break;
+    }
+    case GET_BATCH: {
+      chirp::GetBatchRequest batch;
+      if (!batch.ParseFromString(request)) {
+        status = STATUS_FAILED;
+        break;
+      }
+      std::vector<std::string> keys(batch.keys().begin(), batch.keys().end());
+      std::vector<std::string> values;
+      backend_data_->GetBatch(keys, &values);
+
+      chirp::GetBatchReply batch_reply;
+      for (const std::string &value : values) {
+        batch_reply.add_values(value);
+      }
+      batch_reply.SerializeToString(&reply);
+      break;
+    }
+    case COMPARE_AND_SWAP: {
+      chirp::CompareAndSwapRequest cas;
+      if (!cas.ParseFromString(request)) {
+        status = STATUS_FAILED;
+        break;
+      }
+      std::string current;
+      chirp::CompareAndSwapReply cas_reply;
+      cas_reply.set_swapped(backend_data_->CompareAndSwap(
+          cas.key(), cas.expected(), cas.value(), &current));
+      if (!cas_reply.swapped()) {
+        cas_reply.set_current(current);
+      }
+      cas_reply.SerializeToString(&reply);
+      break;
+    }
+    case DELETE_KEY: {
+      chirp::DeleteRequest del;
+      if (!del.ParseFromString(request) ||
+          !backend_data_->DeleteKey(del.key())) {
+        status = STATUS_FAILED;
+      }
+      break;
+    }
+    default:
+      status = STATUS_FAILED;
+  }
+
+  if (reply.size() > kSlotDataSize) {
+    // The client will send this request through grpc instead
+    status = STATUS_TOO_LARGE;
+    reply.clear();
+  }
+
+  memcpy(slot.data, reply.data(), reply.size());
+  slot.size = reply.size();
+  slot.status = status;
+  slot.state.store(SLOT_REPLY, std::memory_order_release);
+  if (slot.client_waiting.load()) {
+    FutexWake(&slot.state);
+  }
+}
+// End of `SharedMemoryListener` definitions
+
+// Start of `SharedMemoryChannel` definitions
+SharedMemoryChannel::SharedMemoryChannel(const std::string &name)
+    : name_(name), segment_(nullptr), last_attach_() {
+  Attach();
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  Segment *segment = segment_.load();
+  if (segment != nullptr) {
+    munmap(segment, sizeof(Segment));
+  }
+  for (Segment *detached : detached_segments_) {
+    munmap(detached, sizeof(Segment));
+  }
+}
+
+CallResult SharedMemoryChannel::Call(const Operation &op,
+                                     const std::string &request,
+                                     std::string *const reply) {
+  Segment *segment = Attach();
+  if (segment == nullptr || request.size() > kSlotDataSize) {
+    return CALL_UNAVAILABLE;
+  }
+
+  // Claim a free slot, starting from a different one for each thread
+  uint32_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+  Slot *slot = nullptr;
+  uint32_t slot_index;
+  for (uint32_t i = 0; i < kNumOfSlots && slot == nullptr; ++i) {
+    slot_index = (start + i) & (kNumOfSlots - 1);
+    uint32_t expected = SLOT_FREE;
+    if (segment->slots[slot_index].state.compare_exchange_strong(
+            expected, SLOT_CLAIMED)) {
+      slot = &segment->slots[slot_index];
+    }
+  }
+  if (slot == nullptr) {
+    // Every slot is in use
+    return CALL_UNAVAILABLE;
+  }
+
+  memcpy(slot->data, request.data(), request.size());
+  slot->size = request.size();
+  slot->op = op;
+  slot->client_waiting.store(0);
+  slot->state.store(SLOT_REQUEST, std::memory_order_release);
+
+  Push(segment, slot_index);
+  segment->request_seq.fetch_add(1);
+  if (segment->server_waiting.load()) {
+    FutexWake(&segment->request_seq);
+  }
+
+  // Wait for the reply
+  for (int i = 0; i < kSpinCount && slot->state.load(std::memory_order_acquire) !=
+                                        SLOT_REPLY;
+       ++i) {
+    std::this_thread::yield();
+  }
+  while (slot->state.load(std::memory_order_acquire) != SLOT_REPLY) {
+    slot->client_waiting.store(1);
+    if (slot->state.load() == SLOT_REPLY) {
+      break;
+    }
+    if (!FutexWait(&slot->state, SLOT_REQUEST) && !ServerAlive(segment)) {
+      // The server is gone, so is the slot
+      Detach(segment);
+      return CALL_UNAVAILABLE;
+    }
+  }
+
+  uint32_t status = slot->status;
+  if (reply != nullptr) {
+    reply->assign(slot->data, slot->size);
+  }
+  slot->state.store(SLOT_FREE, std::memory_order_release);
+
+  switch (status) {
+    case STATUS_OK:
+      return CALL_OK;
+    case STATUS_FAILED:
+      return CALL_FAILED;
+    default:
+      return CALL_UNAVAILABLE;
+  }
+}
+
+Segment *SharedMemoryChannel::Attach() {
+  Segment *segment = segment_.load(std::memory_order_acquire);
+  if (segment != nullptr) {
+    return segment;
+  }
+
+  std::lock_guard<std::mutex> lock(attach_mutex_);
+  segment = segment_.load();
+  if (segment != nullptr) {
+    return segment;
+  }
+
+  // Do not look for the segment on every call while it is missing
+  auto now = std::chrono::steady_clock::now();
+  if (last_attach_ != std::chrono::steady_clock::time_point() &&
+      now - last_attach_ < kAttachRetryInterval) {
+    return nullptr;
+  }
+  last_attach_ = now;
+
+  int fd = shm_open(name_.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size != sizeof(Segment)) {
+    close(fd);
+    return nullptr;
+  }
+  void *address = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+
+  segment = static_cast<Segment *>(address);
+  if (segment->magic.load(std::memory_order_acquire) != kMagic ||
+      segment->version != kVersion || !ServerAlive(segment)) {
+    munmap(address, sizeof(Segment));
+    return nullptr;
+  }
+
+  segment_.store(segment, std::memory_order_release);
+  return segment;
+}
+
+void SharedMemoryChannel::Detach(Segment *const segment) {
+  std::lock_guard<std::mutex> lock(attach_mutex_);
+  if (segment_.load() == segment) {
+    segment_.store(nullptr);
+    detached_segments_.push_back(segment);
+  }
+}
+// End of `SharedMemoryChannel` definitions
@@ -0,0 +1,123 @@
+#ifndef CHIRP_SRC_SHARED_MEMORY_TRANSPORT_H_
+#define CHIRP_SRC_SHARED_MEMORY_TRANSPORT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend_data_structure.h"
+
+// This transport carries key-value requests between processes on the same
+// host through a shared memory segment instead of the network stack.
+//
+// The segment holds a fixed number of slots and a lock-free ring of slot
+// indices. A client claims a free slot, writes its request into it, and
+// pushes the slot index into the ring. Any number of clients can push at the
+// same time while one server thread pops from the ring. The server writes the
+// reply into the same slot. Both sides spin briefly and then sleep on futexes
+// placed in the segment.
+namespace shared_memory_transport {
+// The operations that can be sent through the segment
+// The payloads are the serialized messages defined in `key_value.proto`
+enum Operation : uint32_t {
+  PUT = 1,        // `PutRequest`, no reply payload
+  PUT_BATCH = 2,  // `PutBatchRequest`, replies `PutBatchReply`
+  GET_BATCH = 3,  // `GetBatchRequest`, replies `GetBatchReply`
+  DELETE_KEY = 4,  // `DeleteRequest`, no reply payload
+  // `CompareAndSwapRequest`, replies `CompareAndSwapReply`
+  // `current` is left empty when the value has been swapped, since it is
+  // the value sent. So a swap is never replied too large for a slot and
+  // done again through grpc.
+  COMPARE_AND_SWAP = 5
+};
+
+// The result of a call through the segment
+enum CallResult : int {
+  // The operation has been done and succeeded
+  CALL_OK = 0,
+  // The operation has been done and failed, e.g. deleting a missing key
+  CALL_FAILED,
+  // The operation has not been done through the segment, e.g. no segment is
+  // available or the request or the reply does not fit in a slot
+  CALL_UNAVAILABLE
+};
+
+// The layout of the segment, defined in the .cc
+struct Segment;
+}  // namespace shared_memory_transport
+
+// The server side of the transport
+// This creates the segment and serves the requests in it with a thread of
+// its own.
+class SharedMemoryListener {
+ public:
+  // The requests will be served on `backend_data`, which should outlive this
+  SharedMemoryListener(const std::string &name,
+                       ConcurrentBackendDataStructure *const backend_data);
+
+  // Stops serving and removes the segment
+  ~SharedMemoryListener();
+
+  // Create the segment and start serving
+  // returns true if this operation succeeds
+  // returns false otherwise
+  bool Start();
+
+ private:
+  // The serving thread runs this
+  void ServeLoop();
+
+  // Serve the request in the slot with index `slot_index`
+  void Serve(const uint32_t &slot_index);
+
+  const std::string name_;
+  ConcurrentBackendDataStructure *const backend_data_;
+
+  shared_memory_transport::Segment *segment_;
+  std::atomic<bool> stopping_;
+  std::thread server_;
+};
+
+// The client side of the transport
+// This is safe to be used by multiple threads.
+class SharedMemoryChannel {
+ public:
+  // This attaches to the segment named `name` if it exists
+  explicit SharedMemoryChannel(const std::string &name);
+
+  ~SharedMemoryChannel();
+
+  // Send `request` with the operation `op` through the segment and wait for
+  // its reply.
+  // The reply payload will be set to `reply` if `reply` is not nullptr.
+  // returns the result of this call
+  shared_memory_transport::CallResult Call(
+      const shared_memory_transport::Operation &op, const std::string &request,
+      std::string *const reply);
+
+ private:
+  // Attach to the segment if it is not attached and the last try is not too
+  // recent
+  // returns the segment if it is attached
+  // returns nullptr otherwise
+  shared_memory_transport::Segment *Attach();
+
+  // Stop using the segment, e.g. after the server is gone
+  // Other threads may still be in a call on it, so it stays mapped until
+  // this channel is destroyed.
+  void Detach(shared_memory_transport::Segment *const segment);
+
+  const std::string name_;
+
+  // This guards attaching and detaching. Calls only read `segment_`.
+  std::mutex attach_mutex_;
+  std::atomic<shared_memory_transport::Segment *> segment_;
+  std::vector<shared_memory_transport::Segment *> detached_segments_;
+  std::chrono::steady_clock::time_point last_attach_;
+};
+
+#endif /* CHIRP_SRC_SHARED_MEMORY_TRANSPORT_H_ */
@@ -0,0 +1,51 @@
+#include "single_flight.h"
+
+SingleFlightGroup::SingleFlightGroup() : calls_(), collapsed_count_(0) {}
+
+bool SingleFlightGroup::Do(const std::string &key, const Fetcher &fetch,
+                           std::string *const value) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  auto it = calls_.find(key);
+  if (it != calls_.end()) {
+    // Another caller is reading this key, wait for its result
+    std::shared_ptr<Call> call = it->second;
+    ++collapsed_count_;
+    call->cv.wait(lock, [&call]() { return call->done; });
+
+    if (value != nullptr) {
+      *value = call->value;
+    }
+    return call->ok;
+  }
+
+  // This caller is the first one, so it sends the request
+  std::shared_ptr<Call> call(new Call());
+  calls_[key] = call;
+  lock.unlock();
+
+  std::string result;
+  bool ok = fetch(key, &result);
+
+  lock.lock();
+  call->ok = ok;
+  call->value = result;
+  call->done = true;
+  // `Forget()` may have replaced this call with a newer one
+  it = calls_.find(key);
+  if (it != calls_.end() && it->second == call) {
+    calls_.erase(it);
+  }
+  lock.unlock();
+  call->cv.notify_all();
+
+  if (value != nullptr) {
+    *value = std::move(result);
+  }
+  return ok;
+}
+
+void SingleFlightGroup::Forget(const std::string &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  calls_.erase(key);
+}
@@ -0,0 +1,62 @@
+#ifndef CHIRP_SRC_SINGLE_FLIGHT_H_
+#define CHIRP_SRC_SINGLE_FLIGHT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// This coalesces concurrent reads of the same key.
+// Only the first caller of a key sends the request to the backend. Callers
+// that come while that request is still in flight wait for it and share its
+// result instead of sending a duplicate request.
+class SingleFlightGroup {
+ public:
+  // The function that actually reads `key` from the backend
+  // returns true if this operation succeeds
+  // returns false otherwise
+  typedef std::function<bool(const std::string &key, std::string *const value)>
+      Fetcher;
+
+  SingleFlightGroup();
+
+  // Read `key` through `fetch`, or join the in-flight read of `key` if there
+  // is one.
+  // The value read will be set to `value` if `value` is not nullptr.
+  // returns the result of the read that has been shared
+  bool Do(const std::string &key, const Fetcher &fetch,
+          std::string *const value);
+
+  // Make the next read of `key` go to the backend again even if there is a
+  // read of `key` in flight.
+  // This should be called after a write to `key` completes so that readers
+  // coming after the write do not join a read started before it.
+  void Forget(const std::string &key);
+
+  // returns the number of reads that have been served by another caller's
+  // in-flight read
+  inline uint64_t get_collapsed_count() const { return collapsed_count_; }
+
+ private:
+  // One read in flight and the callers waiting for it
+  struct Call {
+    Call() : done(false), ok(false) {}
+
+    bool done;
+    bool ok;
+    std::string value;
+    std::condition_variable cv;
+  };
+
+  // This guards `calls_` and the contents of every `Call`
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<Call>> calls_;
+
+  std::atomic<uint64_t> collapsed_count_;
+};
+
+#endif /* CHIRP_SRC_SINGLE_FLIGHT_H_ */
@@ -0,0 +1,110 @@
+#include "trending_tags.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include <glog/logging.h>
+
+namespace {
+// Weights beyond this are scaled back before they lose precision
+const double kMaxWeight = 1e100;
+
+// returns the column of `tag` in the row `row`
+// The rows use hashes `h1 + row * h2` from two independent hashes, which is
+// as good as independent hashes for a count-min sketch.
+inline size_t Column(const size_t &hash, const size_t &row) {
+  uint64_t h2 = uint64_t(hash) * 0x9e3779b97f4a7c15ULL;
+  h2 = (h2 ^ (h2 >> 29)) | 1;
+  return (hash + row * h2) % TrendingTags::kWidth;
+}
+}  // Anonymous namespace
+
+const size_t TrendingTags::kDepth;
+const size_t TrendingTags::kWidth;
+
+TrendingTags::TrendingTags(const double &half_life_seconds,
+                           const size_t &capacity)
+    : half_life_seconds_(half_life_seconds),
+      capacity_(capacity),
+      landmark_(0),
+      counters_(kDepth * kWidth, 0) {
+  CHECK(half_life_seconds > 0 && capacity > 0)
+      << "The half-life and the capacity should be positive.";
+}
+
+void TrendingTags::Add(const std::string &tag, const double &now_seconds) {
+  size_t hash = std::hash<std::string>()(tag);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // This also moves the landmark from 0 to the time of the first use
+  double weight = WeightAt(now_seconds);
+  if (weight > kMaxWeight) {
+    Rescale(now_seconds);
+    weight = 1;
+  }
+
+  double estimate = -1;
+  for (size_t row = 0; row < kDepth; ++row) {
+    double &counter = counters_[row * kWidth + Column(hash, row)];
+    counter += weight;
+    estimate = estimate < 0 ? counter : std::min(estimate, counter);
+  }
+  UpdateCandidate(tag, estimate);
+}
+
+std::vector<std::pair<std::string, double>> TrendingTags::Top(
+    const size_t &count, const double &now_seconds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Scale the estimates back from the landmark to now
+  double scale = 1 / WeightAt(now_seconds);
+
+  std::vector<std::pair<std::string, double>> ret;
+  for (auto it = ranked_candidates_.rbegin();
+       it != ranked_candidates_.rend() && ret.size() < count; ++it) {
+    ret.push_back(std::make_pair(it->second, it->first * scale));
+  }
+  return ret;
+}
+
+double TrendingTags::WeightAt(const double &now_seconds) const {
+  return std::exp2((now_seconds - landmark_) / half_life_seconds_);
+}
+
+void TrendingTags::Rescale(const double &now_seconds) {
+  double scale = 1 / WeightAt(now_seconds);
+  for (double &counter : counters_) {
+    counter *= scale;
+  }
+
+  std::set<std::pair<double, std::string>> ranked_candidates;
+  for (auto &candidate : candidates_) {
+    candidate.second *= scale;
+    ranked_candidates.insert(std::make_pair(candidate.second, candidate.first));
+  }
+  ranked_candidates_.swap(ranked_candidates);
+  landmark_ = now_seconds;
+}
+
+void TrendingTags::UpdateCandidate(const std::string &tag,
+                                   const double &estimate) {
+  auto it = candidates_.find(tag);
+  if (it != candidates_.end()) {
+    ranked_candidates_.erase(std::make_pair(it->second, tag));
+    it->second = estimate;
+    ranked_candidates_.insert(std::make_pair(estimate, tag));
+    return;
+  }
+
+  if (candidates_.size() >= capacity_) {
+    auto lowest = ranked_candidates_.begin();
+    if (lowest->first >= estimate) {
+      // Not hot enough to be a candidate
+      return;
+    }
+    candidates_.erase(lowest->second);
+    ranked_candidates_.erase(lowest);
+  }
+  candidates_[tag] = estimate;
+  ranked_candidates_.insert(std::make_pair(estimate, tag));
+}
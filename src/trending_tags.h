@@ -0,0 +1,70 @@
+#ifndef CHIRP_SRC_TRENDING_TAGS_H_
+#define CHIRP_SRC_TRENDING_TAGS_H_
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// This finds the tags used the most recently in bounded memory.
+// Every use of a tag is counted in a count-min sketch, which overestimates a
+// count by a little with high probability however many distinct tags there
+// are. The tags with the highest estimates are kept as candidates in an
+// ordered set of a fixed capacity, so that the tags used only a few times are
+// not remembered.
+// Counts decay exponentially with `half_life_seconds`, i.e. a use counts half
+// as much after a half-life. Instead of decaying every counter as time goes,
+// a use at time t adds 2^((t - landmark) / half_life), and an estimate is
+// scaled back to now when it is read. All the counters are rescaled once in a
+// while when the weights grow too large, so the work per use is O(1) on
+// average.
+// This is safe to be used by multiple threads.
+class TrendingTags {
+ public:
+  static const size_t kDepth = 4;
+  static const size_t kWidth = 2048;
+
+  // At most `capacity` candidates are kept, which should be more than the
+  // number of tags asked for from `Top`
+  TrendingTags(const double &half_life_seconds, const size_t &capacity);
+
+  // Count a use of `tag` at `now_seconds`
+  // Times are expected to be roughly increasing.
+  void Add(const std::string &tag, const double &now_seconds);
+
+  // returns at most `count` tags with the highest decayed counts at
+  // `now_seconds` and their counts, highest first
+  std::vector<std::pair<std::string, double>> Top(const size_t &count,
+                                                  const double &now_seconds);
+
+ private:
+  // returns the weight of a use at `now_seconds` relative to `landmark_`
+  double WeightAt(const double &now_seconds) const;
+
+  // Move `landmark_` to `now_seconds` and scale everything down accordingly
+  // This should be called with `mutex_` held.
+  void Rescale(const double &now_seconds);
+
+  // Set the candidate `tag` to `estimate`, evicting the lowest candidate if
+  // there are too many
+  // This should be called with `mutex_` held.
+  void UpdateCandidate(const std::string &tag, const double &estimate);
+
+  const double half_life_seconds_;
+  const size_t capacity_;
+
+  // This guards the members below
+  std::mutex mutex_;
+  // The time the weights are relative to
+  double landmark_;
+  // `kDepth` rows of `kWidth` counters
+  std::vector<double> counters_;
+  // The candidates by their estimates, and the estimates by the candidates
+  std::set<std::pair<double, std::string>> ranked_candidates_;
+  std::unordered_map<std::string, double> candidates_;
+};
+
+#endif /* CHIRP_SRC_TRENDING_TAGS_H_ */
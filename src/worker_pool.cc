@@ -0,0 +1,53 @@
+#include "worker_pool.h"
+
+#include <glog/logging.h>
+
+// Start of `WorkerPool` definitions
+WorkerPool::WorkerPool(const size_t &num_of_workers, const size_t &max_queued)
+    : max_queued_(max_queued), stopping_(false) {
+  CHECK(num_of_workers > 0) << "A pool should have at least one thread.";
+  CHECK(max_queued > 0) << "A pool should queue at least one task.";
+  for (size_t i = 0; i < num_of_workers; ++i) {
+    workers_.push_back(std::thread(&WorkerPool::WorkLoop, this));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+bool WorkerPool::Submit(const std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || tasks_.size() >= max_queued_) {
+      return false;
+    }
+    tasks_.push_back(task);
+  }
+  ready_.notify_one();
+  return true;
+}
+
+void WorkerPool::WorkLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+      // The tasks still waiting are run before stopping
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef CHIRP_SRC_WORKER_POOL_H_
+#define CHIRP_SRC_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// This runs tasks on a fixed number of threads, so that a burst of tasks
+// neither starts a thread for each of them nor holds the threads they come
+// from.
+// At most `max_queued` tasks wait for a thread, and the ones beyond are
+// refused, so that a burst costs bounded memory. The tasks still waiting are
+// run before the pool is destroyed, which joins its threads.
+// This is safe to be used by multiple threads.
+class WorkerPool {
+ public:
+  // `num_of_workers` and `max_queued` should be more than 0
+  WorkerPool(const size_t &num_of_workers, const size_t &max_queued);
+
+  // Runs the tasks still waiting and joins the threads
+  ~WorkerPool();
+
+  // Queue `task` to be run on one of the threads
+  // returns true if `task` is queued
+  // returns false if `max_queued` tasks are waiting already
+  bool Submit(const std::function<void()> &task);
+
+ private:
+  // Run the tasks queued until the pool is destroyed
+  void WorkLoop();
+
+  const size_t max_queued_;
+  std::mutex mutex_;
+  // Notified when a task is queued or the pool is being destroyed
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_;
+  std::vector<std::thread> workers_;
+};
+
+#endif /* CHIRP_SRC_WORKER_POOL_H_ */
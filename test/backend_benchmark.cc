@@ -0,0 +1,109 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend_client_lib.h"
+
+namespace {
+
+const int kNumOfOps = 10000;
+const int kNumOfThreads = 4;
+const int kValueSize = 128;
+
+// Put and then get `num_of_ops` keys starting with `prefix` through `client`
+// returns the average time in nanoseconds that one put plus one get takes
+// returns a negative number if any operation fails
+double MeasurePutAndGet(BackendClient *client, const std::string &prefix,
+                        const int &num_of_ops) {
+  const std::string value(kValueSize, 'v');
+  std::vector<std::string> reply;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_of_ops; ++i) {
+    std::string key = prefix + std::to_string(i);
+    reply.clear();
+    bool ok = client->SendPutRequest(key, value) &&
+              client->SendGetRequest(std::vector<std::string>(1, key), &reply);
+    if (!ok || reply.size() != 1 || reply[0] != value) {
+      return -1;
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return double(
+             std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                 .count()) /
+         num_of_ops;
+}
+
+// Run `MeasurePutAndGet` on `client` from `kNumOfThreads` threads at the same
+// time
+// returns the number of put plus get pairs completed per second
+// returns a negative number if any operation fails
+double MeasureConcurrentPutAndGet(BackendClient *client) {
+  std::vector<double> results(kNumOfThreads);
+  std::vector<std::thread> workers;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfThreads; ++i) {
+    workers.push_back(std::thread([client, i, &results]() {
+      results[i] = MeasurePutAndGet(
+          client, std::string("thread") + std::to_string(i) + "-", kNumOfOps);
+    }));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  for (const double &result : results) {
+    if (result < 0) {
+      return -1;
+    }
+  }
+  return kNumOfThreads * kNumOfOps /
+         std::chrono::duration<double>(elapsed).count();
+}
+
+void PrintResult(const std::string &name, const double &ns_per_op) {
+  std::cout << std::left << std::setw(12) << name;
+  if (ns_per_op < 0) {
+    std::cout << "unavailable\n";
+  } else {
+    std::cout << std::fixed << std::setprecision(1) << ns_per_op / 1000
+              << " us per put + get\n";
+  }
+}
+
+}  // end of namespace
+
+// This benchmarks the cost of one put plus one get through the backend
+// clients. The grpc and the shared memory clients require `backend_server` to
+// run simultaneously, otherwise they are reported as unavailable. The shared
+// memory client falls back to grpc if the segment is not available.
+int main(int argc, char **argv) {
+  std::cout << "Running backend benchmark from " << __FILE__ << std::endl;
+
+  BackendClientEmbedded embedded_client;
+  BackendClientStandard standard_client;
+  BackendClientSharedMemory shm_client("/chirp_backend");
+
+  PrintResult("embedded",
+              MeasurePutAndGet(&embedded_client, "embedded-", kNumOfOps));
+  PrintResult("grpc", MeasurePutAndGet(&standard_client, "grpc-", kNumOfOps));
+  PrintResult("shm", MeasurePutAndGet(&shm_client, "shm-", kNumOfOps));
+
+  double throughput = MeasureConcurrentPutAndGet(&embedded_client);
+  std::cout << "embedded with " << kNumOfThreads << " threads: ";
+  if (throughput < 0) {
+    std::cout << "failed\n";
+  } else {
+    std::cout << std::fixed << std::setprecision(0) << throughput
+              << " put + get per second\n";
+  }
+
+  return 0;
+}
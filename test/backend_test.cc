@@ -1,11 +1,19 @@
 
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 
 #include "backend_client_lib.h"
 #include "backend_server.h"
+#include "shared_memory_transport.h"
 
 namespace {
 
@@ -116,6 +124,262 @@ TEST_F(BackendTest, DataStructurPutGetAndDelete) {
   }
 }
 
+// The following test is on the embedded backend client
+// to see if it works correctly when it is used by multiple threads at once.
+// Each thread puts, gets, and deletes its own copy of the keys
+TEST_F(BackendTest, EmbeddedClientConcurrentPutGetAndDelete) {
+  const int kNumOfThreads = 8;
+  BackendClientEmbedded embedded_client;
+
+  std::atomic<int> mismatches(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < kNumOfThreads; ++t) {
+    workers.push_back(std::thread([&, t]() {
+      std::vector<std::string> thread_keys;
+      for (const std::string& key : keys) {
+        thread_keys.push_back(std::to_string(t) + key);
+      }
+
+      for (int i = 0; i < kNumOfPairs; ++i) {
+        if (!embedded_client.SendPutRequest(thread_keys[i],
+                                            correct_values_full[i])) {
+          ++mismatches;
+        }
+      }
+      for (int i = 0; i < kNumOfPairs; i += 2) {
+        if (!embedded_client.SendDeleteKeyRequest(thread_keys[i + 1])) {
+          ++mismatches;
+        }
+      }
+
+      std::vector<std::string> output_values;
+      embedded_client.SendGetRequest(thread_keys, &output_values);
+      if (output_values != correct_values_after_delete) {
+        ++mismatches;
+      }
+    }));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // Every thread should see exactly its own writes
+  EXPECT_EQ(0, mismatches);
+}
+
+// A debug backend client which counts how many batches it has received
+class CountingBackendClientDebug : public BackendClientDebug {
+ public:
+  CountingBackendClientDebug() : batch_count(0) {}
+
+  bool SendPutBatchRequest(
+      const std::vector<std::pair<std::string, std::string>>& key_values,
+      std::vector<bool>* const results) override {
+    ++batch_count;
+    return BackendClientDebug::SendPutBatchRequest(key_values, results);
+  }
+
+  std::atomic<int> batch_count;
+};
+
+// The following test is on the write batcher
+// to see if puts from concurrent callers are sent together and every caller
+// gets the result of its own put.
+TEST_F(BackendTest, SharedMemoryClientConcurrentPutGetAndDelete) {
+  const int kNumOfThreads = 8;
+  const std::string shm_name =
+      "/chirp_backend_test_" + std::to_string(getpid());
+  ConcurrentBackendDataStructure backend_data;
+  SharedMemoryListener listener(shm_name, &backend_data);
+  ASSERT_TRUE(listener.Start());
+  // No backend server is running, so any request falling back to grpc fails
+  BackendClientSharedMemory shm_client(shm_name);
+
+  std::atomic<int> mismatches(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < kNumOfThreads; ++t) {
+    workers.push_back(std::thread([&, t]() {
+      std::vector<std::string> thread_keys;
+      for (const std::string& key : keys) {
+        thread_keys.push_back(std::to_string(t) + key);
+      }
+
+      for (int i = 0; i < kNumOfPairs; ++i) {
+        if (!shm_client.SendPutRequest(thread_keys[i],
+                                       correct_values_full[i])) {
+          ++mismatches;
+        }
+      }
+      for (int i = 0; i < kNumOfPairs; i += 2) {
+        if (!shm_client.SendDeleteKeyRequest(thread_keys[i + 1])) {
+          ++mismatches;
+        }
+      }
+      // The key has been deleted already
+      if (shm_client.SendDeleteKeyRequest(thread_keys[1])) {
+        ++mismatches;
+      }
+
+      std::vector<std::string> output_values;
+      if (!shm_client.SendGetRequest(thread_keys, &output_values) ||
+          output_values != correct_values_after_delete) {
+        ++mismatches;
+      }
+    }));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  EXPECT_EQ(0, mismatches);
+
+  // The writes should have reached the data the listener serves
+  std::vector<std::string> output_values;
+  backend_data.GetBatch(std::vector<std::string>(1, "0" + keys[0]),
+                        &output_values);
+  EXPECT_EQ(std::vector<std::string>(1, correct_values_full[0]),
+            output_values);
+}
+
+// The following test is on compare and swap through the shared memory
+// segment, which should be atomic against concurrent clients
+TEST_F(BackendTest, SharedMemoryClientConcurrentCompareAndSwap) {
+  const int kNumOfThreads = 8;
+  const int kNumOfIncrements = 100;
+  const std::string shm_name =
+      "/chirp_backend_test_cas_" + std::to_string(getpid());
+  ConcurrentBackendDataStructure backend_data;
+  SharedMemoryListener listener(shm_name, &backend_data);
+  ASSERT_TRUE(listener.Start());
+  // No backend server is running, so any request falling back to grpc fails
+  BackendClientSharedMemory shm_client(shm_name);
+
+  std::atomic<int> failures(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < kNumOfThreads; ++t) {
+    workers.push_back(std::thread([&]() {
+      for (int i = 0; i < kNumOfIncrements; ++i) {
+        // Increment the counter, trying again with the value swapped in by
+        // others
+        std::string current;
+        bool swapped = false;
+        while (!swapped) {
+          std::string next =
+              std::to_string(current.empty() ? 1 : std::stoi(current) + 1);
+          if (!shm_client.SendCompareAndSwapRequest(keys[0], current, next,
+                                                    &swapped, &current)) {
+            ++failures;
+            return;
+          }
+        }
+      }
+    }));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  EXPECT_EQ(0, failures);
+  std::vector<std::string> output_values;
+  backend_data.GetBatch(std::vector<std::string>(1, keys[0]), &output_values);
+  EXPECT_EQ(std::vector<std::string>(
+                1, std::to_string(kNumOfThreads * kNumOfIncrements)),
+            output_values);
+}
+
+TEST_F(BackendTest, SharedMemoryChannelUnavailable) {
+  SharedMemoryChannel channel("/chirp_backend_test_missing");
+  std::string reply;
+
+  EXPECT_EQ(shared_memory_transport::CALL_UNAVAILABLE,
+            channel.Call(shared_memory_transport::PUT, "", &reply));
+}
+
+TEST_F(BackendTest, EmbeddedClientCompareAndSwap) {
+  BackendClientEmbedded embedded_client;
+  bool swapped;
+  std::string current;
+
+  // An empty expected value matches a missing key
+  ASSERT_TRUE(embedded_client.SendCompareAndSwapRequest(
+      keys[0], "", correct_values_full[0], &swapped, &current));
+  EXPECT_TRUE(swapped);
+  EXPECT_EQ(correct_values_full[0], current);
+
+  // The value has changed, so this should not swap
+  ASSERT_TRUE(embedded_client.SendCompareAndSwapRequest(
+      keys[0], "", correct_values_full[1], &swapped, &current));
+  EXPECT_FALSE(swapped);
+  EXPECT_EQ(correct_values_full[0], current);
+
+  ASSERT_TRUE(embedded_client.SendCompareAndSwapRequest(
+      keys[0], correct_values_full[0], correct_values_full[1], &swapped,
+      nullptr));
+  EXPECT_TRUE(swapped);
+
+  std::vector<std::string> output_values;
+  embedded_client.SendGetRequest(std::vector<std::string>(1, keys[0]),
+                                 &output_values);
+  EXPECT_EQ(std::vector<std::string>(1, correct_values_full[1]),
+            output_values);
+}
+
+TEST_F(BackendTest, WriteBatcherCollectsConcurrentPuts) {
+  CountingBackendClientDebug counting_client;
+  {
+    BackendWriteBatcher batcher(&counting_client,
+                                std::chrono::milliseconds(50), kNumOfPairs);
+
+    // Put from multiple threads at the same time
+    std::vector<std::future<bool>> results(kNumOfPairs);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < kNumOfPairs; ++i) {
+      writers.push_back(std::thread([&, i]() {
+        results[i] = batcher.Put(keys[i], correct_values_full[i]);
+      }));
+    }
+    for (auto& writer : writers) {
+      writer.join();
+    }
+
+    for (auto& result : results) {
+      // Every put should be successful
+      EXPECT_TRUE(result.get());
+    }
+  }
+  // The puts should have been sent in fewer requests than puts
+  EXPECT_LT(counting_client.batch_count, kNumOfPairs);
+
+  // Get
+  std::vector<std::string> output_values;
+  bool ok = counting_client.SendGetRequest(keys, &output_values);
+  EXPECT_TRUE(ok);
+  EXPECT_EQ(correct_values_full, output_values);
+}
+
+// The following test is on the write batcher
+// to see if a full batch is sent without waiting for its window to pass
+TEST_F(BackendTest, WriteBatcherFlushesFullBatch) {
+  CountingBackendClientDebug counting_client;
+  // The window is long enough that only a full batch can be sent in time
+  BackendWriteBatcher batcher(&counting_client, std::chrono::seconds(10),
+                              kNumOfPairs);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::future<bool>> results;
+  for (int i = 0; i < kNumOfPairs; ++i) {
+    results.push_back(batcher.Put(keys[i], correct_values_full[i]));
+  }
+  for (auto& result : results) {
+    EXPECT_TRUE(result.get());
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // The batch should have been sent as soon as it became full
+  EXPECT_LT(elapsed, std::chrono::seconds(1));
+  EXPECT_EQ(1, counting_client.batch_count);
+}
+
 // TODO: Since the follwing tests require a running backend server, I made them
 // disabled for now This test is similar to the DataStructurePutAndGet above.
 // The difference is this tests use grpc to communicate with the backend server.
@@ -176,6 +440,29 @@ TEST_F(BackendTest, DISABLED_ServerPutGetAndDelete) {
   EXPECT_EQ(correct_values_after_delete, output_values);
 }
 
+// This test is similar to the DISABLED_ServerPutAndGet above.
+// The difference is the puts are sent in one batched request.
+// Therefore, this test requires the server process to run simultaneously
+TEST_F(BackendTest, DISABLED_ServerPutBatchAndGet) {
+  // Put
+  std::vector<std::pair<std::string, std::string>> key_values;
+  for (int i = 0; i < kNumOfPairs; ++i) {
+    key_values.push_back(std::make_pair(keys[i], correct_values_full[i]));
+  }
+  std::vector<bool> results;
+  bool ok = client.SendPutBatchRequest(key_values, &results);
+  // The batch should be sent successfully
+  EXPECT_TRUE(ok);
+  // Put operations should be successful here
+  EXPECT_EQ(std::vector<bool>(kNumOfPairs, true), results);
+
+  // Get
+  std::vector<std::string> output_values;
+  ok = client.SendGetRequest(keys, &output_values);
+  EXPECT_TRUE(ok);
+  EXPECT_EQ(correct_values_full, output_values);
+}
+
 }  // end of namespace
 
 GTEST_API_ int main(int argc, char** argv) {
@@ -0,0 +1,137 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "chirp_id_codec.h"
+#include "service_data.pb.h"
+
+namespace {
+
+const int kNumOfIds = 100000;
+const int kNumOfRounds = 20;
+
+// The bytes allocated through `CountingAllocator`
+size_t allocated_bytes = 0;
+
+// An allocator which counts the bytes it allocates, to measure the memory a
+// container takes
+template <typename T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    allocated_bytes += n * sizeof(T);
+    return static_cast<T *>(std::malloc(n * sizeof(T)));
+  }
+  void deallocate(T *p, std::size_t) { std::free(p); }
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T> &, const CountingAllocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T> &, const CountingAllocator<U> &) {
+  return false;
+}
+
+typedef std::set<uint64_t, std::less<uint64_t>, CountingAllocator<uint64_t>>
+    CountedSet;
+typedef std::vector<uint64_t, CountingAllocator<uint64_t>> CountedVector;
+
+// returns the average time in microseconds that `decode` takes
+template <typename Function>
+double MeasureMicroseconds(const Function &decode) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfRounds; ++i) {
+    decode();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::micro>(elapsed).count() /
+         kNumOfRounds;
+}
+
+// Compare the plain `repeated uint64` list decoded into a set with the codec
+// decoded into a flat vector on the sorted `ids`
+void Compare(const std::string &name, const std::vector<uint64_t> &ids) {
+  ServiceData::UserChirpList plain;
+  for (const uint64_t &id : ids) {
+    plain.add_chirp_id(id);
+  }
+  std::string plain_binary;
+  plain.SerializeToString(&plain_binary);
+
+  ServiceData::UserChirpList encoded;
+  chirp_id_codec::Encode(ids, encoded.mutable_encoded_chirp_ids());
+  std::string encoded_binary;
+  encoded.SerializeToString(&encoded_binary);
+
+  size_t set_bytes = 0;
+  double set_us = MeasureMicroseconds([&]() {
+    ServiceData::UserChirpList tmp;
+    tmp.ParseFromString(plain_binary);
+    size_t bytes_before = allocated_bytes;
+    CountedSet set(tmp.chirp_id().begin(), tmp.chirp_id().end());
+    set_bytes = allocated_bytes - bytes_before;
+  });
+
+  size_t vector_bytes = 0;
+  double vector_us = MeasureMicroseconds([&]() {
+    ServiceData::UserChirpList tmp;
+    tmp.ParseFromString(encoded_binary);
+    std::vector<uint64_t> decoded;
+    chirp_id_codec::Decode(tmp.encoded_chirp_ids(), &decoded);
+    size_t bytes_before = allocated_bytes;
+    CountedVector vector(decoded.begin(), decoded.end());
+    vector_bytes = allocated_bytes - bytes_before;
+  });
+
+  std::cout << name << " (" << ids.size() << " ids)\n" << std::fixed
+            << std::setprecision(1);
+  std::cout << "  wire bytes:   " << std::setw(9) << plain_binary.size()
+            << " -> " << std::setw(9) << encoded_binary.size() << "\n";
+  std::cout << "  memory bytes: " << std::setw(9) << set_bytes << " -> "
+            << std::setw(9) << vector_bytes << "\n";
+  std::cout << "  decode us:    " << std::setw(9) << set_us << " -> "
+            << std::setw(9) << vector_us << "\n";
+}
+
+}  // end of namespace
+
+// This benchmarks the chirp id codec against the plain `repeated uint64`
+// list in `UserChirpList` decoded into a `std::set`. Memory bytes are the
+// bytes allocated for the decoded container. Decode time includes parsing
+// the protobuf message.
+int main(int argc, char **argv) {
+  std::cout << "Running chirp id codec benchmark from " << __FILE__
+            << std::endl;
+
+  // Snowflake ids of chirps posted about a second apart
+  std::vector<uint64_t> snowflake_ids;
+  uint64_t id = 1ULL << 60;
+  std::srand(0);
+  for (int i = 0; i < kNumOfIds; ++i) {
+    id += (uint64_t(500 + std::rand() % 1000) << 22) + std::rand() % 4096;
+    snowflake_ids.push_back(id);
+  }
+  Compare("snowflake ids", snowflake_ids);
+
+  // Ids from the counter with other users' chirps in between
+  std::vector<uint64_t> counter_ids;
+  id = 1000000;
+  for (int i = 0; i < kNumOfIds; ++i) {
+    id += 1 + std::rand() % 100;
+    counter_ids.push_back(id);
+  }
+  Compare("counter ids", counter_ids);
+
+  return 0;
+}